@@ -1,4 +1,7 @@
 
+// before extern "C": sys/sdt.h has C++ templates
+#include "socket_probe.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -13,10 +16,20 @@ extern "C" {
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#define HAVE_UNIX_SOCKET
 
 #endif
 
 #include "socket_os.h"
+#include "socket_flight.h"
 #include <sys/types.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -38,6 +51,7 @@ extern "C" {
 #define SOCKET_EXIT 5
 #define SOCKET_UDP 6
 #define SOCKET_WARNING 7
+#define SOCKET_FD 8	// ud is a descriptor received with SCM_RIGHTS
 
 #define PROTOCOL_UDP 1
 #define PROTOCOL_UDPv6 2
@@ -47,8 +61,10 @@ extern "C" {
 struct socket_message {
 	int id;
 	uintptr_t opaque;
+	uintptr_t context;	// user context of socket id, see socket.context
 	int ud;	// for accept, ud is new connection id ; for data, ud is size of data 
 	char* data;
+	void * chunk;	// not NULL: data is a slice of this recv_chunk, release it instead of free
 };
 
 struct socket_udp_address;
@@ -86,6 +102,8 @@ struct socket_object_interface {
 #define PROTOCOL_TCP 0
 #define PROTOCOL_UDP 1
 #define PROTOCOL_UDPv6 2
+#define PROTOCOL_SHM 3	// s->fd is the unix socket of the rendezvous, bytes go through s->shm
+#define PROTOCOL_UNIX 4	// unix datagram, sends go to the peer of connect(2)
 #define PROTOCOL_UNKNOWN 255
 
 #define UDP_ADDRESS_SIZE 19	// ipv6 128bit + port 16bit + 1 byte type
@@ -107,65 +125,174 @@ struct write_buffer {
 	char *ptr;
 	int sz;
 	bool userobject;
+	bool shared;	// buffer is a struct shared_payload
+	bool passfd;	// buffer is an int descriptor, sent with SCM_RIGHTS and closed
 	uint8_t udp_address[UDP_ADDRESS_SIZE];
 };
 
 #define SIZEOF_TCPBUFFER (offsetof(struct write_buffer, udp_address[0]))
 #define SIZEOF_UDPBUFFER (sizeof(struct write_buffer))
 
+// One payload for every socket of a broadcast, released with the last write_buffer.
+// id, data and taken point into the same allocation.
+struct shared_payload {
+	volatile long ref;
+	int sz;
+	int n;
+	int * id;
+	char * data;
+	uint8_t * taken;	// taken[i]: id[i] holds a sending ref
+};
+
+// Receive buffer of a socket with SOCKET_OPT_RECV_CHUNK. Reads are appended at used
+// and handed out as slices, every slice holds a ref, the socket holds one more
+// until the chunk is full. data follows the header.
+struct recv_chunk {
+	volatile long ref;
+	int size;
+	int used;
+};
+
+#define RECV_CHUNK_DATA(c) ((char*)((c) + 1))
+#define RECV_CHUNK_MIN 1024
+#define RECV_CHUNK_SPILL (64*1024)
+
+// One direction of a shm connection, data follows the header. head and tail only
+// grow, size is a power of 2. Both sides map the same pages, ring 0 carries the
+// bytes of the connecting side.
+struct shm_ring {
+	volatile uint64_t head;	// written by the producer
+	char pad0[64 - sizeof(uint64_t)];
+	volatile uint64_t tail;	// written by the consumer
+	volatile uint32_t waiting;	// the producer found the ring full
+	uint32_t size;
+	char pad1[64 - sizeof(uint64_t) - 2 * sizeof(uint32_t)];
+};
+
+#define SHM_RING_DATA(r) ((char*)((r) + 1))
+#define SHM_RING_MIN (64*1024)
+#define SHM_READ_MAX (256*1024)
+
+struct shm_conn {
+	void * base;
+	size_t mapsize;
+	struct shm_ring * rx;
+	struct shm_ring * tx;
+	int eof;	// the peer closed the rendezvous socket
+	int pending;	// on ss->shm_pending
+};
+
 struct wb_list {
 	struct write_buffer * head;
 	struct write_buffer * tail;
 };
 
 struct socket_stat {
-	uint64_t rtime;
-	uint64_t wtime;
-	uint64_t read;
-	uint64_t write;
+	uint64_t time;	// ss->time of the last one
+	uint64_t bytes;
 };
 
+// One cache line per part, and a slot is a whole number of lines: the parts of a socket
+// and the neighbouring slots of ss->slot never share a line (256 bytes on LP64).
+//   identity      read by every thread, written when the socket opens or closes
+//   read side     written by the socket thread at every read
+//   write side    the write lists, written by whoever flushes them
+//   direct write  taken by the threads that send
 struct socket {
+	// identity
 	uintptr_t opaque;
-	struct wb_list high;
-	struct wb_list low;
-	int64_t wb_size;
-	struct socket_stat stat;
+	uintptr_t context;	// set by start/bind/connect, echoed in every message of this socket
+	void * inline_handler;	// not NULL: reads are handed to ss->inline_cb on the socket thread
+	struct socket_option * option;	// listener only, applied to every accepted socket
+	struct shm_conn * shm;	// PROTOCOL_SHM once connected
 	int fd;
 	int id;
 	uint8_t protocol;
+	uint8_t passfd;	// SOCKET_OPT_PASSFD: reads with recvmsg, descriptors become SOCKET_FD
 #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
-	volatile long sending;
 	long type;
-	long udpconnecting;
 #else
-	volatile uint32_t sending;
 	uint8_t type;
-	uint16_t udpconnecting;
 #endif
-	int64_t warn_size;
+	int rchunk_size;	// 0: a malloc per read
+	int shm_ring;	// shm listener: ring bytes per direction
+
+	// read side
+	SOCKET_CACHE_ALIGNED struct socket_stat rstat;
 	union {
 		int size;
 		uint8_t udp_address[UDP_ADDRESS_SIZE];
 	} p;
+	struct recv_chunk * rchunk;
+	int recvfd;	// received with the last read, reported before the next one. -1: none
+	uint32_t dispatched;	// messages forwarded, up to the threshold of OpenSocket::setColocate
+
+	// write side
+	SOCKET_CACHE_ALIGNED struct wb_list high;
+	struct wb_list low;
+	int64_t wb_size;
+	int64_t warn_size;
+	struct socket_stat wstat;	// direct writes of the sending threads too, under dw_lock
+
+	// direct write
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+	SOCKET_CACHE_ALIGNED volatile long sending;
+	long udpconnecting;
+#else
+	SOCKET_CACHE_ALIGNED volatile uint32_t sending;
+	uint16_t udpconnecting;
+#endif
 	struct spinlock dw_lock;
 	int dw_offset;
 	const void * dw_buffer;
 	size_t dw_size;
 };
 
+// flight recorder, see socket_flight.h
+#define FLIGHT_RECORDS 8192	// power of 2
+#define FLIGHT_SERVERS 64	// dumped by the signal of socket_server_flight_signal
+
+struct flight {
+	struct flight_record ring[FLIGHT_RECORDS];
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+	long head;
+#else
+	unsigned int head;	// records written, wraps: ring[head & (FLIGHT_RECORDS-1)] is the next
+#endif
+	struct flight_record cur;	// iteration in progress
+	int64_t mark;	// start of the operation in progress, or of sp_wait
+	int op_id;
+	int op;	// operation in progress, 0 none
+	int waiting;	// in sp_wait, cur is already in the ring
+	int server;	// flight_header.server
+};
+
+// a cell of the free slot queue, seq tells whether it is ready for a push or a pop
+struct free_cell {
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+	volatile long seq;
+#else
+	volatile int seq;
+#endif
+	int index;
+};
+
 struct socket_server {
-	volatile uint64_t time;
+	volatile uint64_t time;	// monotonic ms, set by the socket thread at every loop iteration
 	int recvctrl_fd;
 	int sendctrl_fd;
 	int checkctrl;
 	poll_fd event_fd;
+	// free slots, see reserve_id. Head and tail are taken by different threads.
+	struct free_cell free_queue[MAX_SOCKET];
 #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
-	long alloc_id;
+	SOCKET_CACHE_ALIGNED volatile long free_head;
+	SOCKET_CACHE_ALIGNED volatile long free_tail;
 #else
-	int alloc_id;
+	SOCKET_CACHE_ALIGNED volatile int free_head;	// next pop
+	SOCKET_CACHE_ALIGNED volatile int free_tail;	// next push
 #endif
-	int event_n;
+	SOCKET_CACHE_ALIGNED int event_n;
 	int event_index;
 	struct socket_object_interface soi;
 	struct event ev[MAX_EVENT];
@@ -173,12 +300,248 @@ struct socket_server {
 	char buffer[MAX_INFO];
 	uint8_t udpbuffer[MAX_UDP_PACKAGE];
 	fd_set rfds;
+	void (*inline_cb)(void *ud, void *handler, struct socket_message *msg);
+	void * inline_ud;
+	char * inline_buffer;	// read buffer shared by all inline sockets
+	int inline_size;
+	char * chunk_spill;	// second readv segment of recv chunks
+	int * shm_pending;	// ids of shm sockets with data left in the ring, see shm_defer
+	int shm_pending_n;
+	int shm_pending_cap;
+	volatile int trace;	// stamp ready, written by any thread, see OpenSocket::setTrace
+	int64_t ready;	// of the message returned: ready_batch, or when its command was read. 0 without trace
+	int64_t ready_batch;	// when the last sp_wait returned, 0 if trace was off then
+	struct flight flight;
+};
+
+// steady clock in nanoseconds, the clock of the Msg trace stamps
+static inline int64_t
+trace_now() {
+	return socket_clock_ns();
+}
+
+// The previous operation ends where this one starts, the slowest is kept.
+// One clock read per control command and per event.
+static inline void
+flight_op(struct socket_server *ss, int id, int op) {
+	struct flight *f = &ss->flight;
+	int64_t now = socket_clock_ns();
+	if (f->op && now - f->mark > f->cur.slowest) {
+		f->cur.slowest = now - f->mark;
+		f->cur.slowest_id = f->op_id;
+		f->cur.slowest_op = (uint8_t)f->op;
+	}
+	f->mark = now;
+	f->op_id = id;
+	f->op = op;
+}
+
+// before sp_wait: the iteration goes into the ring
+static inline void
+flight_end(struct socket_server *ss) {
+	struct flight *f = &ss->flight;
+	flight_op(ss, -1, 0);
+	f->waiting = 1;
+	if (f->cur.time == 0) {
+		return;
+	}
+	f->cur.busy = f->mark - f->cur.time;
+	f->ring[(unsigned int)f->head & (FLIGHT_RECORDS - 1)] = f->cur;
+	// a full barrier, the record is complete before head moves
+	ATOM_INC(&f->head);
+}
+
+// after sp_wait
+static inline int64_t
+flight_begin(struct socket_server *ss, int n) {
+	struct flight *f = &ss->flight;
+	int64_t now = socket_clock_ns();
+	memset(&f->cur, 0, sizeof(f->cur));
+	f->cur.time = now;
+	f->cur.wait = now - f->mark;
+	f->cur.events = n > 0 ? n : 0;
+	f->cur.slowest_id = -1;
+	f->mark = now;
+	f->waiting = 0;
+	return now;
+}
+
+static int
+flight_write(int fd, const void *buffer, size_t sz) {
+	const char *p = (const char *)buffer;
+	while (sz > 0) {
+		ssize_t n = socket_write(fd, p, sz);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		sz -= n;
+	}
+	return 0;
+}
+
+// Records of the last seconds, oldest first, then the iteration in progress. Runs on
+// any thread, in a signal handler too: no lock, no malloc. A record the socket thread
+// reused while it was copied is flagged FLIGHT_OVERWRITTEN; cur is read as it is.
+static int
+flight_dump(struct socket_server *ss, int fd, int64_t now, int seconds) {
+	struct flight *f = &ss->flight;
+	int64_t since = now - (int64_t)seconds * 1000000000;
+	unsigned int head = (unsigned int)ATOM_ADD(&f->head, 0);
+	unsigned int n = 0;
+	// one record of margin, the socket thread may be writing it
+	while (n < FLIGHT_RECORDS - 1) {
+		const struct flight_record *r = &f->ring[(head - n - 1) & (FLIGHT_RECORDS - 1)];
+		if (r->time == 0 || r->time < since)
+			break;
+		++n;
+	}
+	struct flight_record partial = f->cur;
+	int op = f->op;
+	int64_t mark = f->mark;
+	int has_partial = !f->waiting && partial.time != 0;
+	if (has_partial) {
+		partial.busy = now - partial.time;
+		if (op && now - mark > partial.slowest) {
+			partial.slowest = now - mark;
+			partial.slowest_id = f->op_id;
+			partial.slowest_op = (uint8_t)op;
+		}
+		partial.flags |= FLIGHT_PARTIAL;
+	}
+
+	struct flight_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, FLIGHT_MAGIC, sizeof(header.magic));
+	header.version = FLIGHT_VERSION;
+	header.record_size = sizeof(struct flight_record);
+	header.count = n + (has_partial ? 1 : 0);
+	header.now = now;
+	header.server = f->server;
+	if (flight_write(fd, &header, sizeof(header)))
+		return -1;
+	struct flight_record batch[32];
+	unsigned int i = 0;
+	while (i < n) {
+		unsigned int k = 0;
+		unsigned int first = head - n + i;
+		for (; k < 32 && i + k < n; k++) {
+			batch[k] = f->ring[(first + k) & (FLIGHT_RECORDS - 1)];
+		}
+		unsigned int now_head = (unsigned int)ATOM_ADD(&f->head, 0);
+		unsigned int j;
+		for (j = 0; j < k; j++) {
+			if (now_head - (first + j) >= FLIGHT_RECORDS) {
+				batch[j].flags |= FLIGHT_OVERWRITTEN;
+			}
+		}
+		if (flight_write(fd, batch, k * sizeof(batch[0])))
+			return -1;
+		i += k;
+	}
+	if (has_partial && flight_write(fd, &partial, sizeof(partial)))
+		return -1;
+	return 0;
+}
+
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+
+static void flight_register(struct socket_server *ss) {}
+static void flight_unregister(struct socket_server *ss) {}
+
+#else
+
+static struct socket_server * volatile flight_servers[FLIGHT_SERVERS];
+static volatile int flight_busy[FLIGHT_SERVERS];	// handlers in flight_servers[i], see flight_unregister
+static int flight_count = 0;
+static char flight_path[256];
+static int flight_seconds = 10;
+
+// a server past FLIGHT_SERVERS still records, it is only left out of the signal dump
+static void
+flight_register(struct socket_server *ss) {
+	int i;
+	ss->flight.server = ATOM_FINC(&flight_count);
+	for (i = 0; i < FLIGHT_SERVERS; i++) {
+		if (flight_servers[i] == NULL && ATOM_CAS_POINTER(&flight_servers[i], NULL, ss)) {
+			return;
+		}
+	}
+}
+
+// A handler that read ss before the slot was cleared is waited for: release frees ss next.
+// One that interrupts this thread returns before the wait, it never spins on itself.
+static void
+flight_unregister(struct socket_server *ss) {
+	int i;
+	for (i = 0; i < FLIGHT_SERVERS; i++) {
+		if (flight_servers[i] == ss) {
+			ATOM_CAS_POINTER(&flight_servers[i], ss, NULL);
+			while (flight_busy[i] != 0) {
+				sched_yield();
+			}
+			return;
+		}
+	}
+}
+
+static void
+flight_signal(int signo) {
+	(void)signo;
+	int saved = errno;
+	int fd = socket_file_create(flight_path);
+	if (fd >= 0) {
+		int64_t now = socket_clock_ns();
+		int i;
+		for (i = 0; i < FLIGHT_SERVERS; i++) {
+			ATOM_INC(&flight_busy[i]);
+			struct socket_server *ss = flight_servers[i];
+			if (ss) {
+				flight_dump(ss, fd, now, flight_seconds);
+			}
+			ATOM_DEC(&flight_busy[i]);
+		}
+		socket_close(fd);
+	}
+	errno = saved;
+}
+
+#endif
+
+// Socket-default profile, value[i] is applied when bit i of mask is set.
+// Same order as OpenSocket::EOption.
+#define SOCKET_OPT_NODELAY 0
+#define SOCKET_OPT_SNDBUF 1
+#define SOCKET_OPT_RCVBUF 2
+#define SOCKET_OPT_QUICKACK 3
+#define SOCKET_OPT_NOTSENT_LOWAT 4
+#define SOCKET_OPT_BUSY_POLL 5
+#define SOCKET_OPT_USER_TIMEOUT 6
+#define SOCKET_OPT_KEEPALIVE 7
+#define SOCKET_OPT_KEEPIDLE 8
+#define SOCKET_OPT_KEEPINTVL 9
+#define SOCKET_OPT_KEEPCNT 10
+#define SOCKET_OPT_FASTOPEN 11
+#define SOCKET_OPT_RECV_CHUNK 12
+#define SOCKET_OPT_PASSFD 13
+#define SOCKET_OPT_MAX 14
+
+struct socket_option {
+	uint32_t mask;
+	int value[SOCKET_OPT_MAX];
 };
 
 struct request_open {
 	int id;
 	int port;
 	uintptr_t opaque;
+	uintptr_t context;
+	struct socket_option option;
+	char * buffer;	// initial data, NULL for a plain connect. Owned by the request until queued
+	int sz;
+	int local;	// offset of the source address in host, 0 for none
 	char host[1];
 };
 
@@ -186,6 +549,7 @@ struct request_send {
 	int id;
 	int sz;
 	char * buffer;
+	int ref;	// a sending ref was taken, see inc_sending_ref
 };
 
 struct request_send_udp {
@@ -208,6 +572,9 @@ struct request_listen {
 	int id;
 	int fd;
 	uintptr_t opaque;
+	struct socket_option option;
+	int protocol;	// PROTOCOL_TCP or PROTOCOL_SHM
+	int ring;	// PROTOCOL_SHM: ring bytes per direction
 	char host[1];
 };
 
@@ -215,11 +582,13 @@ struct request_bind {
 	int id;
 	int fd;
 	uintptr_t opaque;
+	uintptr_t context;
 };
 
 struct request_start {
 	int id;
 	uintptr_t opaque;
+	uintptr_t context;
 };
 
 struct request_setopt {
@@ -235,6 +604,15 @@ struct request_udp {
 	uintptr_t opaque;
 };
 
+struct request_inline {
+	int id;
+	void * handler;
+};
+
+struct request_broadcast {
+	struct shared_payload * payload;
+};
+
 /*
 	The first byte is TYPE
 
@@ -251,6 +629,10 @@ struct request_udp {
 	U Create UDP socket
 	C set udp address
 	Q query info
+	I Set inline handler
+	M Broadcast package (high)
+	H Connect shm (request_bind, fd is the connecting unix socket)
+	F Send descriptor (request_send, buffer holds the int)
  */
 
 struct request_package {
@@ -267,6 +649,8 @@ struct request_package {
 		struct request_setopt setopt;
 		struct request_udp udp;
 		struct request_setudp set_udp;
+		struct request_inline inline_;
+		struct request_broadcast broadcast;
 	} u;
 	uint8_t dummy[256];
 };
@@ -275,8 +659,135 @@ union sockaddr_all {
 	struct sockaddr s;
 	struct sockaddr_in v4;
 	struct sockaddr_in6 v6;
+#ifdef HAVE_UNIX_SOCKET
+	struct sockaddr_un un;
+#endif
 };
 
+#ifdef HAVE_UNIX_SOCKET
+// "/path" is a filesystem socket, "@name" one in the abstract namespace (Linux),
+// a lone "@" lets bind pick a free abstract name.
+// return 0 when host is not a unix address, -1 when it is invalid
+static int
+unix_address(const char *host, struct sockaddr_un *un, socklen_t *len) {
+	if (host == NULL || (host[0] != '/' && host[0] != '@')) {
+		return 0;
+	}
+	size_t n = strlen(host);
+	if (n >= sizeof(un->sun_path)) {
+		return -1;
+	}
+	memset(un, 0, sizeof(*un));
+	un->sun_family = AF_UNIX;
+	if (host[0] == '@') {
+#ifdef __linux__
+		memcpy(un->sun_path + 1, host + 1, n - 1);
+		*len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + (n == 1 ? 0 : n));
+#else
+		return -1;
+#endif
+	} else {
+		memcpy(un->sun_path, host, n);
+		*len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + n + 1);
+	}
+	return 1;
+}
+
+// SCM_RIGHTS only travels on unix sockets, elsewhere sendmsg fails and the socket is closed
+static int
+socket_is_unix(int fd) {
+	union sockaddr_all u;
+	socklen_t len = sizeof(u);
+	if (getsockname(fd, &u.s, &len) != 0) {
+		return 0;
+	}
+	return u.s.sa_family == AF_UNIX;
+}
+
+// one byte carries the descriptor, a reader with SOCKET_OPT_PASSFD drops it
+static int
+socket_sendfd(int fd, int passfd) {
+	char byte = 0;
+	struct iovec iov;
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	union {
+		struct cmsghdr h;
+		char buffer[CMSG_SPACE(sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+	struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &passfd, sizeof(int));
+	return (int)sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+// *passfd is -1 unless a descriptor came with the bytes, its byte is then the last one
+static int
+socket_recvfd(int fd, void *buffer, int sz, int *passfd) {
+	struct iovec iov;
+	iov.iov_base = buffer;
+	iov.iov_len = sz;
+	union {
+		struct cmsghdr h;
+		char buffer[CMSG_SPACE(4 * sizeof(int))];
+	} control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+	*passfd = -1;
+#ifdef MSG_CMSG_CLOEXEC
+	int n = (int)recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+#else
+	int n = (int)recvmsg(fd, &msg, 0);
+#endif
+	struct cmsghdr * cmsg;
+	for (cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+		int i;
+		for (i = 0; i < count; i++) {
+			int received;
+			memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			if (*passfd < 0) {
+				*passfd = received;
+			} else {
+				// one per sendFd, anything else is not ours
+				socket_close(received);
+			}
+		}
+	}
+	return n;
+}
+
+#else
+
+static int
+socket_is_unix(int fd) {
+	return 0;
+}
+
+static int
+socket_sendfd(int fd, int passfd) {
+	errno = EINVAL;
+	return -1;
+}
+
+#endif
+
 struct send_object {
 	void * buffer;
 	int sz;
@@ -339,9 +850,28 @@ send_object_init(struct socket_server *ss, struct send_object *so, void *object,
 	}
 }
 
+static inline void
+recv_chunk_release(struct recv_chunk *c) {
+	if (ATOM_DEC(&c->ref) == 0) {
+		FREE(c);
+	}
+}
+
+static inline void
+shared_payload_release(struct shared_payload *p) {
+	if (ATOM_DEC(&p->ref) == 0) {
+		FREE(p);
+	}
+}
+
 static inline void
 write_buffer_free(struct socket_server *ss, struct write_buffer *wb) {
-	if (wb->userobject) {
+	if (wb->shared) {
+		shared_payload_release((struct shared_payload *)wb->buffer);
+	} else if (wb->passfd) {
+		socket_close(*(int *)wb->buffer);
+		FREE(wb->buffer);
+	} else if (wb->userobject) {
 		ss->soi.free(wb->buffer);
 	} else {
 		FREE(wb->buffer);
@@ -355,31 +885,206 @@ socket_keepalive(int fd) {
 	socket_setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (void *)&keepalive , sizeof(keepalive));
 }
 
+// level -1: not available on this platform, -2: not a socket option, see socket_option_local
+static const struct {
+	int level;
+	int name;
+} socket_option_name[SOCKET_OPT_MAX] = {
+	{ IPPROTO_TCP, TCP_NODELAY },
+	{ SOL_SOCKET, SO_SNDBUF },
+	{ SOL_SOCKET, SO_RCVBUF },
+#ifdef TCP_QUICKACK
+	{ IPPROTO_TCP, TCP_QUICKACK },
+#else
+	{ -1, 0 },
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+	{ IPPROTO_TCP, TCP_NOTSENT_LOWAT },
+#else
+	{ -1, 0 },
+#endif
+#ifdef SO_BUSY_POLL
+	{ SOL_SOCKET, SO_BUSY_POLL },
+#else
+	{ -1, 0 },
+#endif
+#ifdef TCP_USER_TIMEOUT
+	{ IPPROTO_TCP, TCP_USER_TIMEOUT },
+#else
+	{ -1, 0 },
+#endif
+	{ SOL_SOCKET, SO_KEEPALIVE },
+#ifdef TCP_KEEPIDLE
+	{ IPPROTO_TCP, TCP_KEEPIDLE },
+#else
+	{ -1, 0 },
+#endif
+#ifdef TCP_KEEPINTVL
+	{ IPPROTO_TCP, TCP_KEEPINTVL },
+#else
+	{ -1, 0 },
+#endif
+#ifdef TCP_KEEPCNT
+	{ IPPROTO_TCP, TCP_KEEPCNT },
+#else
+	{ -1, 0 },
+#endif
+#ifdef TCP_FASTOPEN
+	{ IPPROTO_TCP, TCP_FASTOPEN },
+#else
+	{ -1, 0 },
+#endif
+	{ -2, 0 },	// SOCKET_OPT_RECV_CHUNK, kept in struct socket
+#ifdef HAVE_UNIX_SOCKET
+	{ -2, 0 },	// SOCKET_OPT_PASSFD
+#else
+	{ -1, 0 },
+#endif
+};
+
+static int
+socket_option_set(int fd, int what, int value) {
+	if (what < 0 || what >= SOCKET_OPT_MAX || socket_option_name[what].level == -1) {
+		return -1;
+	}
+	if (socket_option_name[what].level == -2) {
+		return 0;
+	}
+	return socket_setsockopt(fd, socket_option_name[what].level, socket_option_name[what].name, (void *)&value, sizeof(value));
+}
+
 static int
-reserve_id(struct socket_server *ss) {
+socket_option_get(int fd, int what, int *value) {
+	if (what < 0 || what >= SOCKET_OPT_MAX || socket_option_name[what].level < 0) {
+		return -1;
+	}
+	int v = 0;
+	socklen_t len = sizeof(v);
+	if (socket_getsockopt(fd, socket_option_name[what].level, socket_option_name[what].name, (void *)&v, &len) != 0) {
+		return -1;
+	}
+	*value = v;
+	return 0;
+}
+
+static void
+socket_option_local(struct socket *s, int what, int value) {
+	if (what == SOCKET_OPT_RECV_CHUNK) {
+		if (value > 0 && value < RECV_CHUNK_MIN) {
+			value = RECV_CHUNK_MIN;
+		}
+		s->rchunk_size = value > 0 ? value : 0;
+		if (s->rchunk_size == 0 && s->rchunk) {
+			// the slices still out keep their own ref
+			recv_chunk_release(s->rchunk);
+			s->rchunk = NULL;
+		}
+	} else if (what == SOCKET_OPT_PASSFD) {
+		// stays off on anything but a unix socket, socket_server_sendfd relies on it
+		s->passfd = value != 0 && socket_is_unix(s->fd);
+	}
+}
+
+static void
+socket_option_apply_local(struct socket *s, const struct socket_option *option) {
+	if (option->mask & (1u << SOCKET_OPT_RECV_CHUNK)) {
+		socket_option_local(s, SOCKET_OPT_RECV_CHUNK, option->value[SOCKET_OPT_RECV_CHUNK]);
+	}
+	if (option->mask & (1u << SOCKET_OPT_PASSFD)) {
+		socket_option_local(s, SOCKET_OPT_PASSFD, option->value[SOCKET_OPT_PASSFD]);
+	}
+}
+
+// Sizes must be set before listen/connect to take part in window scaling.
+// TCP_QUICKACK is not sticky, the kernel may fall back to delayed acks later.
+static void
+socket_option_apply(int fd, const struct socket_option *option) {
 	int i;
-	for (i=0;i<MAX_SOCKET;i++) {
-		int id = ATOM_INC(&(ss->alloc_id));
-		if (id < 0) {
-			id = ATOM_AND(&(ss->alloc_id), 0x7fffffff);
+	for (i = 0; i < SOCKET_OPT_MAX; i++) {
+		if (option->mask & (1u << i)) {
+			socket_option_set(fd, i, option->value[i]);
 		}
-		struct socket *s = &ss->slot[HASH_ID(id)];
-		if (s->type == SOCKET_TYPE_INVALID) {
-			if (ATOM_CAS(&s->type, SOCKET_TYPE_INVALID, SOCKET_TYPE_RESERVE)) {
-				s->id = id;
-				s->protocol = PROTOCOL_UNKNOWN;
-				// socket_server_udp_connect may inc s->udpconncting directly (from other thread, before new_fd), 
-				// so reset it to 0 here rather than in new_fd.
-				s->udpconnecting = 0;
-				s->fd = -1;
-				return id;
-			} else {
-				// retry
-				--i;
+	}
+}
+
+// Free slot indices in a bounded MPMC queue (D. Vyukov): one CAS per pop and per push,
+// from any thread. It holds every slot that is not in use, so it is never full.
+// FIFO: a released slot is reused after all the other free ones, its previous ids stay
+// stale for as long as they can, like the old alloc_id sweep.
+static int
+free_pop(struct socket_server *ss) {
+	for (;;) {
+		unsigned int pos = (unsigned int)ss->free_head;
+		struct free_cell *c = &ss->free_queue[pos % MAX_SOCKET];
+		int diff = (int)((unsigned int)c->seq - (pos + 1));
+		if (diff == 0) {
+			if (ATOM_CAS(&ss->free_head, (int)pos, (int)(pos + 1))) {
+				int index = c->index;
+				// the index is read before the cell is handed to a push
+				ATOM_SYNC();
+				c->seq = (int)(pos + MAX_SOCKET);
+				return index;
 			}
+		} else if (diff < 0) {
+			// empty
+			return -1;
 		}
 	}
-	return -1;
+}
+
+static void
+free_push(struct socket_server *ss, int index) {
+	for (;;) {
+		unsigned int pos = (unsigned int)ss->free_tail;
+		struct free_cell *c = &ss->free_queue[pos % MAX_SOCKET];
+		int diff = (int)((unsigned int)c->seq - pos);
+		if (diff == 0) {
+			if (ATOM_CAS(&ss->free_tail, (int)pos, (int)(pos + 1))) {
+				c->index = index;
+				// the index is written before a pop can see the cell
+				ATOM_SYNC();
+				c->seq = (int)(pos + 1);
+				return;
+			}
+		} else if (diff < 0) {
+			// a full queue: the slot was released twice and is already in it
+			fprintf(stderr, "socket-server: slot %d released twice.\n", index);
+			return;
+		}
+	}
+}
+
+// An id is the slot index with a generation in the upper bits, one more at each reuse
+// of the slot, so ID_TAG16 and s->id == id still tell a stale id. 0 is never given.
+static int
+reserve_id(struct socket_server *ss) {
+	int index = free_pop(ss);
+	if (index < 0) {
+		return -1;
+	}
+	struct socket *s = &ss->slot[index];
+	assert(s->type == SOCKET_TYPE_INVALID);
+	int id = (int)(((unsigned int)s->id + MAX_SOCKET) & 0x7fffffff);
+	if ((id >> MAX_SOCKET_P) == 0) {
+		id += MAX_SOCKET;
+	}
+	s->id = id;
+	s->protocol = PROTOCOL_UNKNOWN;
+	// socket_server_udp_connect may inc s->udpconncting directly (from other thread, before new_fd), 
+	// so reset it to 0 here rather than in new_fd.
+	s->udpconnecting = 0;
+	s->fd = -1;
+	s->type = SOCKET_TYPE_RESERVE;
+	return id;
+}
+
+// The slot of a reserved id that never got a socket goes back to the free queue.
+static void
+release_id(struct socket_server *ss, int id) {
+	struct socket *s = &ss->slot[HASH_ID(id)];
+	assert(s->type == SOCKET_TYPE_RESERVE && s->id == id);
+	s->type = SOCKET_TYPE_INVALID;
+	free_push(ss, HASH_ID(id));
 }
 
 static inline void
@@ -412,7 +1117,8 @@ socket_server_create(uint64_t time) {
 		return NULL;
 	}
 
-	struct socket_server *ss = (struct socket_server*)MALLOC(sizeof(*ss));
+	// slot[] is laid out in cache lines, see struct socket
+	struct socket_server *ss = (struct socket_server*)socket_aligned_alloc(SOCKET_CACHE_LINE, sizeof(*ss));
 	if (!ss) return 0;
 	ss->time = time;
 	ss->event_fd = efd;
@@ -423,13 +1129,34 @@ socket_server_create(uint64_t time) {
 	for (i=0; i < MAX_SOCKET; ++i) {
 		s = &ss->slot[i];
 		s->type = SOCKET_TYPE_INVALID;
+		s->id = i;
+		// queue full: every slot pushed once, in order
+		ss->free_queue[i].index = i;
+		ss->free_queue[i].seq = i + 1;
 		clear_wb_list(&s->high);
 		clear_wb_list(&s->low);
 		spinlock_init(&s->dw_lock);
 	}
-	ss->alloc_id = 0;
+	ss->free_head = 0;
+	ss->free_tail = MAX_SOCKET;
 	ss->event_n = 0;
 	ss->event_index = 0;
+	ss->inline_cb = NULL;
+	ss->inline_ud = NULL;
+	ss->inline_buffer = NULL;
+	ss->inline_size = 0;
+	ss->chunk_spill = NULL;
+	ss->shm_pending = NULL;
+	ss->shm_pending_n = 0;
+	ss->shm_pending_cap = 0;
+	ss->trace = 0;
+	ss->ready = 0;
+	ss->ready_batch = 0;
+	memset(&ss->flight, 0, sizeof(ss->flight));
+	ss->flight.op_id = -1;
+	ss->flight.waiting = 1;
+	ss->flight.mark = socket_clock_ns();
+	flight_register(ss);
 	memset(&ss->soi, 0, sizeof(ss->soi));
 	FD_ZERO(&ss->rfds);
 #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
@@ -439,6 +1166,7 @@ socket_server_create(uint64_t time) {
 	return ss;
 }
 
+// the socket thread sets it again at its next loop iteration
 void
 socket_server_updatetime(struct socket_server *ss, uint64_t time) {
 	ss->time = time;
@@ -463,18 +1191,39 @@ free_buffer(struct socket_server *ss, const void * buffer, int sz) {
 	so.free_func((void *)buffer);
 }
 
+#ifdef __linux__
 static void
-force_close(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message *result) {
-	result->id = s->id;
-	result->ud = 0;
-	result->data = NULL;
-	result->opaque = s->opaque;
+shm_conn_free(struct shm_conn *c) {
+	munmap(c->base, c->mapsize);
+	FREE(c);
+}
+#else
+static void
+shm_conn_free(struct shm_conn *c) {
+	FREE(c);
+}
+#endif
+
+static void
+force_close(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message *result, int reason) {
+	result->id = s->id;
+	result->ud = 0;
+	result->data = NULL;
+	result->opaque = s->opaque;
+	result->context = s->context;
 	if (s->type == SOCKET_TYPE_INVALID) {
 		return;
 	}
 	assert(s->type != SOCKET_TYPE_RESERVE);
-	free_wb_list(ss,&s->high);
-	free_wb_list(ss,&s->low);
+	SOCKET_PROBE3(close, s->id, s->fd, reason);
+	if (s->option) {
+		FREE(s->option);
+		s->option = NULL;
+	}
+	if (s->rchunk) {
+		recv_chunk_release(s->rchunk);
+		s->rchunk = NULL;
+	}
 	if (s->type != SOCKET_TYPE_PACCEPT && s->type != SOCKET_TYPE_PLISTEN) {
 		sp_del(ss->event_fd, s->fd);
 	}
@@ -485,30 +1234,46 @@ force_close(struct socket_server *ss, struct socket *s, struct socket_lock *l, s
 		}
 	}
 	s->type = SOCKET_TYPE_INVALID;
+	// shm sockets are appended to by the sending threads, under the lock
+	free_wb_list(ss,&s->high);
+	free_wb_list(ss,&s->low);
 	if (s->dw_buffer) {
 		free_buffer(ss, s->dw_buffer, (int)s->dw_size);
 		s->dw_buffer = NULL;
 	}
+	if (s->shm) {
+		shm_conn_free(s->shm);
+		s->shm = NULL;
+	}
+	if (s->recvfd >= 0) {
+		socket_close(s->recvfd);
+		s->recvfd = -1;
+	}
 	socket_unlock(l);
+	free_push(ss, HASH_ID(s->id));
 }
 
 void 
 socket_server_release(struct socket_server *ss) {
 	int i = 0;
 	struct socket_message dummy;
+	flight_unregister(ss);
 	for (i=0;i<MAX_SOCKET;i++) {
 		struct socket *s = &ss->slot[i];
 		struct socket_lock l;
 		socket_lock_init(s, &l);
 		if (s->type != SOCKET_TYPE_RESERVE) {
-			force_close(ss, s, &l, &dummy);
+			force_close(ss, s, &l, &dummy, SOCKET_CLOSE_RELEASE);
 		}
 		spinlock_destroy(&s->dw_lock);
 	}
 	socket_close(ss->sendctrl_fd);
 	socket_close(ss->recvctrl_fd);
 	sp_release(ss->event_fd);
-	FREE(ss);
+	FREE(ss->inline_buffer);
+	FREE(ss->chunk_spill);
+	FREE(ss->shm_pending);
+	socket_aligned_free(ss);
 	socket_stop();
 }
 
@@ -521,7 +1286,7 @@ socket_server_close(struct socket_server* ss) {
 		struct socket_lock l;
 		socket_lock_init(s, &l);
 		if (s->type != SOCKET_TYPE_RESERVE) {
-			force_close(ss, s, &l, &dummy);
+			force_close(ss, s, &l, &dummy, SOCKET_CLOSE_RELEASE);
 		}
 		spinlock_destroy(&s->dw_lock);
 	}
@@ -543,7 +1308,7 @@ new_fd(struct socket_server *ss, int id, int fd, int protocol, uintptr_t opaque,
 
 	if (add) {
 		if (sp_add(ss->event_fd, fd, s)) {
-			s->type = SOCKET_TYPE_INVALID;
+			// still reserved, the caller releases the id
 			return NULL;
 		}
 	}
@@ -553,106 +1318,40 @@ new_fd(struct socket_server *ss, int id, int fd, int protocol, uintptr_t opaque,
 	s->protocol = protocol;
 	s->p.size = MIN_READ_BUFFER;
 	s->opaque = opaque;
+	s->context = 0;
+	s->inline_handler = NULL;
+	s->option = NULL;
+	s->rchunk = NULL;
+	s->rchunk_size = 0;
+	s->shm = NULL;
+	s->shm_ring = 0;
+	s->passfd = 0;
+	s->recvfd = -1;
+	s->dispatched = 0;
 	s->wb_size = 0;
 	s->warn_size = 0;
 	check_wb_list(&s->high);
 	check_wb_list(&s->low);
 	s->dw_buffer = NULL;
 	s->dw_size = 0;
-	memset(&s->stat, 0, sizeof(s->stat));
+	memset(&s->rstat, 0, sizeof(s->rstat));
+	memset(&s->wstat, 0, sizeof(s->wstat));
+	s->dw_lock.acquire = 0;
+	s->dw_lock.spin = 0;
+	s->dw_lock.park = 0;
 	return s;
 }
 
 static inline void
 stat_read(struct socket_server *ss, struct socket *s, int n) {
-	s->stat.read += n;
-	s->stat.rtime = ss->time;
+	s->rstat.bytes += n;
+	s->rstat.time = ss->time;
 }
 
 static inline void
 stat_write(struct socket_server *ss, struct socket *s, int n) {
-	s->stat.write += n;
-	s->stat.wtime = ss->time;
-}
-
-// return -1 when connecting
-static int
-open_socket(struct socket_server *ss, struct request_open * request, struct socket_message *result) {
-	int id = request->id;
-	result->opaque = request->opaque;
-	result->id = id;
-	result->ud = 0;
-	result->data = NULL;
-	struct socket *ns;
-	int status;
-	struct addrinfo ai_hints;
-	struct addrinfo *ai_list = NULL;
-	struct addrinfo *ai_ptr = NULL;
-	char port[16];
-	snprintf(port, sizeof(port), "%d", request->port);
-	memset(&ai_hints, 0, sizeof( ai_hints ) );
-	ai_hints.ai_family = AF_UNSPEC;
-	ai_hints.ai_socktype = SOCK_STREAM;
-	ai_hints.ai_protocol = IPPROTO_TCP;
-
-	status = getaddrinfo( request->host, port, &ai_hints, &ai_list );
-	do
-	{
-		if (status != 0) {
-			result->data = (char*)gai_strerror(status);
-			break;
-		}
-		int sock = -1;
-		for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next) {
-			sock = (int)socket(ai_ptr->ai_family, ai_ptr->ai_socktype, ai_ptr->ai_protocol);
-			if (sock < 0) {
-				continue;
-			}
-			socket_keepalive(sock);
-			sp_nonblocking(sock);
-			status = socket_connect(sock, ai_ptr->ai_addr, (int)ai_ptr->ai_addrlen);
-			if (status != 0 && errno != EINPROGRESS) {
-				socket_close(sock);
-				sock = -1;
-				continue;
-			}
-			break;
-		}
-
-		if (sock < 0) {
-			result->data = strerror(errno);
-			break;
-		}
-
-		ns = new_fd(ss, id, sock, PROTOCOL_TCP, request->opaque, true);
-		if (ns == NULL) {
-			socket_close(sock);
-			result->data = (char*)"reach skynet socket number limit";
-			break;
-		}
-
-		if (status == 0) {
-			ns->type = SOCKET_TYPE_CONNECTED;
-			struct sockaddr* addr = ai_ptr->ai_addr;
-			void* sin_addr = (ai_ptr->ai_family == AF_INET) ? (void*)&((struct sockaddr_in*)addr)->sin_addr : (void*)&((struct sockaddr_in6*)addr)->sin6_addr;
-			if (inet_ntop(ai_ptr->ai_family, sin_addr, ss->buffer, sizeof(ss->buffer))) {
-				result->data = ss->buffer;
-			}
-			freeaddrinfo(ai_list);
-			return SOCKET_OPEN;
-		}
-		else {
-			ns->type = SOCKET_TYPE_CONNECTING;
-			sp_write(ss->event_fd, ns->fd, ns, true);
-		}
-
-		freeaddrinfo(ai_list);
-		return -1;
-	} while (false);
-
-	freeaddrinfo( ai_list );
-	ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
-	return SOCKET_ERR;
+	s->wstat.bytes += n;
+	s->wstat.time = ss->time;
 }
 
 static int
@@ -660,7 +1359,7 @@ send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 	while (list->head) {
 		struct write_buffer * tmp = list->head;
 		for (;;) {
-			ssize_t sz = socket_write(s->fd, tmp->ptr, tmp->sz);
+			ssize_t sz = tmp->passfd ? socket_sendfd(s->fd, *(int *)tmp->buffer) : socket_write(s->fd, tmp->ptr, tmp->sz);
 			if (sz < 0) {
 				switch(errno) {
 				case EINTR:
@@ -668,11 +1367,13 @@ send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 				case AGAIN_WOULDBLOCK:
 					return -1;
 				}
-				force_close(ss,s,l,result);
+				force_close(ss,s,l,result,SOCKET_CLOSE_ERROR);
 				return SOCKET_CLOSE;
 			}
 			stat_write(ss,s,(int)sz);
+			ss->flight.cur.bytes += sz;
 			s->wb_size -= sz;
+			SOCKET_PROBE4(write, s->id, s->fd, (int)sz, s->wb_size);
 			if (sz != tmp->sz) {
 				tmp->ptr += sz;
 				tmp->sz -= (int)sz;
@@ -693,6 +1394,12 @@ udp_socket_address(struct socket *s, const uint8_t udp_address[UDP_ADDRESS_SIZE]
 	int type = (uint8_t)udp_address[0];
 	if (type != s->protocol)
 		return 0;
+	if (type == PROTOCOL_UNIX) {
+		// no address, see udp_sendto
+		memset(sa, 0, sizeof(sa->s));
+		sa->s.sa_family = AF_UNSPEC;
+		return sizeof(sa->s);
+	}
 	uint16_t port = 0;
 	memcpy(&port, udp_address+1, sizeof(uint16_t));
 	switch (s->protocol) {
@@ -712,6 +1419,15 @@ udp_socket_address(struct socket *s, const uint8_t udp_address[UDP_ADDRESS_SIZE]
 	return 0;
 }
 
+// a unix datagram socket sends to the peer it is connected to
+static inline int
+udp_sendto(int fd, const void *buffer, int sz, union sockaddr_all *sa, socklen_t sasz) {
+	if (sa->s.sa_family == AF_UNSPEC) {
+		return (int)sendto(fd, (const char *)buffer, sz, 0, NULL, 0);
+	}
+	return (int)sendto(fd, (const char *)buffer, sz, 0, &sa->s, sasz);
+}
+
 static void
 drop_udp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct write_buffer *tmp) {
 	s->wb_size -= tmp->sz;
@@ -732,7 +1448,7 @@ send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 			drop_udp(ss, s, list, tmp);
 			return -1;
 		}
-		int err = sendto(s->fd, tmp->ptr, tmp->sz, 0, &sa.s, sasz);
+		int err = udp_sendto(s->fd, tmp->ptr, tmp->sz, &sa, sasz);
 		if (err < 0) {
 			switch(errno) {
 			case EINTR:
@@ -744,6 +1460,7 @@ send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 			return -1;
 		}
 		stat_write(ss,s,tmp->sz);
+		ss->flight.cur.bytes += tmp->sz;
 		s->wb_size -= tmp->sz;
 		list->head = tmp->next;
 		write_buffer_free(ss,tmp);
@@ -827,12 +1544,13 @@ send_buffer_(struct socket_server *ss, struct socket *s, struct socket_lock *l,
 		sp_write(ss->event_fd, s->fd, s, false);			
 
 		if (s->type == SOCKET_TYPE_HALFCLOSE) {
-			force_close(ss, s, l, result);
+			force_close(ss, s, l, result, SOCKET_CLOSE_HALFCLOSE);
 			return SOCKET_CLOSE;
 		}
 		if(s->warn_size > 0){
 			s->warn_size = 0;
 			result->opaque = s->opaque;
+			result->context = s->context;
 			result->id = s->id;
 			result->ud = 0;
 			result->data = NULL;
@@ -856,6 +1574,8 @@ send_buffer(struct socket_server *ss, struct socket *s, struct socket_lock *l, s
 		}
 		struct send_object so;
 		buf->userobject = send_object_init(ss, &so, (void *)s->dw_buffer, (int)s->dw_size);
+		buf->shared = false;
+		buf->passfd = false;
 		buf->ptr = (char*)so.buffer+s->dw_offset;
 		buf->sz = so.sz - s->dw_offset;
 		buf->buffer = (void *)s->dw_buffer;
@@ -884,6 +1604,8 @@ append_sendbuffer_(struct socket_server *ss, struct wb_list *s, struct request_s
 	}
 	struct send_object so;
 	buf->userobject = send_object_init(ss, &so, request->buffer, request->sz);
+	buf->shared = false;
+	buf->passfd = false;
 	buf->ptr = (char*)so.buffer;
 	buf->sz = so.sz;
 	buf->buffer = request->buffer;
@@ -920,6 +1642,629 @@ append_sendbuffer_low(struct socket_server *ss,struct socket *s, struct request_
 }
 
 
+// return -1 when connecting
+static inline void
+release_addrinfo(struct addrinfo *list, struct addrinfo *local) {
+	if (list != NULL && list != local) {
+		freeaddrinfo(list);
+	}
+}
+
+// source address of an outgoing connection, connect() still picks the port
+static int
+bind_local(int fd, int family, const char *local) {
+	struct addrinfo ai_hints;
+	struct addrinfo *ai_list = NULL;
+	memset(&ai_hints, 0, sizeof( ai_hints ) );
+	ai_hints.ai_family = family;
+	ai_hints.ai_socktype = SOCK_STREAM;
+	ai_hints.ai_flags = AI_NUMERICHOST | AI_PASSIVE;
+	if (getaddrinfo(local, "0", &ai_hints, &ai_list) != 0 || ai_list == NULL) {
+		errno = EADDRNOTAVAIL;
+		return -1;
+	}
+#ifdef IP_BIND_ADDRESS_NO_PORT
+	// the port is taken per 4-tuple at connect time, not per address at bind time
+	int one = 1;
+	socket_setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, (void *)&one, sizeof(one));
+#endif
+	int status = bind(fd, (struct sockaddr *)ai_list->ai_addr, (int)ai_list->ai_addrlen);
+	freeaddrinfo(ai_list);
+	return status;
+}
+
+static int
+open_socket(struct socket_server *ss, struct request_open * request, struct socket_message *result) {
+	int id = request->id;
+	result->opaque = request->opaque;
+	result->context = request->context;
+	result->id = id;
+	result->ud = 0;
+	result->data = NULL;
+	struct socket *ns;
+	int status;
+	int sent = 0;
+	struct addrinfo ai_hints;
+	struct addrinfo *ai_list = NULL;
+	struct addrinfo *ai_ptr = NULL;
+	char port[16];
+	snprintf(port, sizeof(port), "%d", request->port);
+	memset(&ai_hints, 0, sizeof( ai_hints ) );
+	ai_hints.ai_family = AF_UNSPEC;
+	ai_hints.ai_socktype = SOCK_STREAM;
+	ai_hints.ai_protocol = IPPROTO_TCP;
+
+	struct addrinfo unix_ai;
+#ifdef HAVE_UNIX_SOCKET
+	struct sockaddr_un un;
+	socklen_t unlen = 0;
+	int isunix = unix_address(request->host, &un, &unlen);
+	if (isunix != 0) {
+		// a single candidate, as if resolved
+		memset(&unix_ai, 0, sizeof(unix_ai));
+		unix_ai.ai_family = AF_UNIX;
+		unix_ai.ai_socktype = SOCK_STREAM;
+		unix_ai.ai_addr = (struct sockaddr *)&un;
+		unix_ai.ai_addrlen = unlen;
+		ai_list = isunix > 0 ? &unix_ai : NULL;
+		status = isunix > 0 ? 0 : EAI_FAMILY;
+	} else
+#endif
+	status = getaddrinfo( request->host, port, &ai_hints, &ai_list );
+	do
+	{
+		if (status != 0) {
+			result->data = (char*)gai_strerror(status);
+			break;
+		}
+		int sock = -1;
+		for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next) {
+			sock = (int)socket(ai_ptr->ai_family, ai_ptr->ai_socktype, ai_ptr->ai_protocol);
+			if (sock < 0) {
+				continue;
+			}
+			socket_keepalive(sock);
+			if (request->option.mask) {
+				socket_option_apply(sock, &request->option);
+			}
+			if (request->local && bind_local(sock, ai_ptr->ai_family, request->host + request->local) != 0) {
+				socket_close(sock);
+				sock = -1;
+				continue;
+			}
+			sp_nonblocking(sock);
+#ifdef MSG_FASTOPEN
+			if (request->buffer) {
+				// SYN carries the data when the cookie of the peer is cached,
+				// otherwise a cookie request goes out and nothing is taken
+				int n = (int)sendto(sock, request->buffer, request->sz, MSG_FASTOPEN, ai_ptr->ai_addr, ai_ptr->ai_addrlen);
+				if (n >= 0 || errno == EINPROGRESS) {
+					sent = n > 0 ? n : 0;
+					status = -1;
+					errno = EINPROGRESS;
+				} else {
+					// fast open disabled, plain connect
+					status = socket_connect(sock, ai_ptr->ai_addr, (int)ai_ptr->ai_addrlen);
+				}
+			} else
+#endif
+			status = socket_connect(sock, ai_ptr->ai_addr, (int)ai_ptr->ai_addrlen);
+			if (status != 0 && errno != EINPROGRESS) {
+				socket_close(sock);
+				sock = -1;
+				continue;
+			}
+			break;
+		}
+
+		if (sock < 0) {
+			result->data = strerror(errno);
+			break;
+		}
+
+		ns = new_fd(ss, id, sock, PROTOCOL_TCP, request->opaque, true);
+		if (ns == NULL) {
+			socket_close(sock);
+			result->data = (char*)"reach skynet socket number limit";
+			break;
+		}
+		ns->context = request->context;
+		if (request->option.mask) {
+			socket_option_apply_local(ns, &request->option);
+		}
+		if (request->buffer) {
+			stat_write(ss, ns, sent);
+			if (sent < request->sz) {
+				// the rest goes out after the handshake, see report_connect
+				struct request_send rs;
+				rs.id = id;
+				rs.sz = request->sz;
+				rs.buffer = request->buffer;
+				struct write_buffer * buf = append_sendbuffer_(ss, &ns->high, &rs, (int)SIZEOF_TCPBUFFER);
+				if (buf) {
+					buf->ptr += sent;
+					buf->sz -= sent;
+					ns->wb_size += buf->sz;
+					request->buffer = NULL;
+				}
+			}
+		}
+
+		if (status == 0) {
+			ns->type = SOCKET_TYPE_CONNECTED;
+			if (!send_buffer_empty(ns)) {
+				sp_write(ss->event_fd, ns->fd, ns, true);
+			}
+			struct sockaddr* addr = ai_ptr->ai_addr;
+			void* sin_addr = (ai_ptr->ai_family == AF_INET) ? (void*)&((struct sockaddr_in*)addr)->sin_addr : (void*)&((struct sockaddr_in6*)addr)->sin6_addr;
+			if (inet_ntop(ai_ptr->ai_family, sin_addr, ss->buffer, sizeof(ss->buffer))) {
+				result->data = ss->buffer;
+			}
+			release_addrinfo(ai_list, &unix_ai);
+			return SOCKET_OPEN;
+		}
+		else {
+			ns->type = SOCKET_TYPE_CONNECTING;
+			sp_write(ss->event_fd, ns->fd, ns, true);
+		}
+
+		release_addrinfo(ai_list, &unix_ai);
+		return -1;
+	} while (false);
+
+	release_addrinfo(ai_list, &unix_ai);
+	release_id(ss, id);
+	return SOCKET_ERR;
+}
+
+#ifdef __linux__
+
+static void
+shm_wake(int fd) {
+	// a full socket buffer means the peer has wakeups pending anyway
+	send(fd, "", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+// producer side, under the socket lock. return bytes written
+static int
+shm_ring_write(int fd, struct shm_ring *r, const char *buffer, int sz) {
+	uint32_t mask = r->size - 1;
+	uint64_t head = r->head;
+	int n = 0;
+	while (n < sz) {
+		uint64_t space = r->size - (head - r->tail);
+		if (space == 0) {
+			// the consumer clears waiting and wakes us once it has made room
+			r->waiting = 1;
+			__sync_synchronize();
+			if (r->size == head - r->tail) {
+				break;
+			}
+			continue;
+		}
+		int len = sz - n;
+		if ((uint64_t)len > space) {
+			len = (int)space;
+		}
+		uint32_t offset = (uint32_t)(head & mask);
+		int first = (int)(r->size - offset);
+		if (first > len) {
+			first = len;
+		}
+		memcpy(SHM_RING_DATA(r) + offset, buffer + n, first);
+		memcpy(SHM_RING_DATA(r), buffer + n + first, len - first);
+		__sync_synchronize();
+		r->head = head + len;
+		__sync_synchronize();
+		if (r->tail == head) {
+			// the consumer had caught up, it may be asleep
+			shm_wake(fd);
+		}
+		head += len;
+		n += len;
+	}
+	return n;
+}
+
+// consumer side, socket thread only. return bytes read
+static int
+shm_ring_read(int fd, struct shm_ring *r, char *buffer, int sz) {
+	uint32_t mask = r->size - 1;
+	uint64_t tail = r->tail;
+	uint64_t avail = r->head - tail;
+	__sync_synchronize();
+	int len = avail < (uint64_t)sz ? (int)avail : sz;
+	uint32_t offset = (uint32_t)(tail & mask);
+	int first = (int)(r->size - offset);
+	if (first > len) {
+		first = len;
+	}
+	memcpy(buffer, SHM_RING_DATA(r) + offset, first);
+	memcpy(buffer + first, SHM_RING_DATA(r), len - first);
+	__sync_synchronize();
+	r->tail = tail + len;
+	__sync_synchronize();
+	if (r->waiting) {
+		r->waiting = 0;
+		shm_wake(fd);
+	}
+	return len;
+}
+
+static struct shm_conn *
+shm_conn_map(int memfd, size_t mapsize, bool accepted) {
+	void * base = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (base == MAP_FAILED) {
+		return NULL;
+	}
+	struct shm_ring * r0 = (struct shm_ring *)base;
+	uint32_t size = r0->size;
+	if (size < SHM_RING_MIN || (size & (size - 1)) != 0 || mapsize != 2 * (sizeof(struct shm_ring) + (size_t)size)) {
+		munmap(base, mapsize);
+		return NULL;
+	}
+	struct shm_ring * r1 = (struct shm_ring *)(SHM_RING_DATA(r0) + size);
+	struct shm_conn * c = (struct shm_conn *)MALLOC(sizeof(*c));
+	if (!c) {
+		munmap(base, mapsize);
+		return NULL;
+	}
+	c->base = base;
+	c->mapsize = mapsize;
+	c->rx = accepted ? r0 : r1;
+	c->tx = accepted ? r1 : r0;
+	c->eof = 0;
+	c->pending = 0;
+	return c;
+}
+
+// listener side: one memfd for both rings, handed to the peer with SCM_RIGHTS
+static struct shm_conn *
+shm_accept(int fd, int ring) {
+	uint32_t size = SHM_RING_MIN;
+	while (size < (uint32_t)ring && size < (1u << 30)) {
+		size <<= 1;
+	}
+	size_t mapsize = 2 * (sizeof(struct shm_ring) + (size_t)size);
+	int memfd = (int)syscall(SYS_memfd_create, "opensocket.shm", 1u);	// MFD_CLOEXEC
+	if (memfd < 0) {
+		return NULL;
+	}
+	struct shm_conn * c = NULL;
+	if (ftruncate(memfd, (off_t)mapsize) == 0) {
+		void * base = mmap(NULL, sizeof(struct shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+		if (base != MAP_FAILED) {
+			// the second header is set up the same way below, pages start zeroed
+			((struct shm_ring *)base)->size = size;
+			munmap(base, sizeof(struct shm_ring));
+			c = shm_conn_map(memfd, mapsize, true);
+		}
+	}
+	if (c) {
+		c->tx->size = size;
+		char byte = 0;
+		struct iovec iov;
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+		union {
+			struct cmsghdr h;
+			char buffer[CMSG_SPACE(sizeof(int))];
+		} control;
+		memset(&control, 0, sizeof(control));
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buffer;
+		msg.msg_controllen = sizeof(control.buffer);
+		struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+		// a fresh unix socket has room for one byte, the client may still be blocking
+		if (sendmsg(fd, &msg, MSG_NOSIGNAL) != 1) {
+			shm_conn_free(c);
+			c = NULL;
+		}
+	}
+	close(memfd);
+	return c;
+}
+
+// moves s->high into the ring as far as it goes
+static void
+shm_flush(struct socket_server *ss, struct socket *s, struct socket_lock *l) {
+	socket_lock(l);
+	while (s->high.head) {
+		struct write_buffer * tmp = s->high.head;
+		int n = shm_ring_write(s->fd, s->shm->tx, tmp->ptr, tmp->sz);
+		stat_write(ss, s, n);
+		ss->flight.cur.bytes += n;
+		s->wb_size -= n;
+		if (n < tmp->sz) {
+			tmp->ptr += n;
+			tmp->sz -= n;
+			break;
+		}
+		s->high.head = tmp->next;
+		write_buffer_free(ss, tmp);
+	}
+	if (s->high.head == NULL) {
+		s->high.tail = NULL;
+	}
+	socket_unlock(l);
+}
+
+// connecting side, the handshake byte carries the memfd
+static int
+report_connect_shm(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message *result) {
+	char byte;
+	struct iovec iov;
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	union {
+		struct cmsghdr h;
+		char buffer[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+	ssize_t n = recvmsg(s->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return -1;
+	}
+	int memfd = -1;
+	struct cmsghdr * cmsg = n == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	struct stat st;
+	if (memfd >= 0 && fstat(memfd, &st) == 0) {
+		s->shm = shm_conn_map(memfd, (size_t)st.st_size, false);
+	}
+	if (memfd >= 0) {
+		close(memfd);
+	}
+	if (s->shm == NULL) {
+		force_close(ss, s, l, result, SOCKET_CLOSE_ERROR);
+		result->data = (char*)"shm handshake failed";
+		return SOCKET_ERR;
+	}
+	s->type = SOCKET_TYPE_CONNECTED;
+	shm_flush(ss, s, l);
+	result->opaque = s->opaque;
+	result->context = s->context;
+	result->id = s->id;
+	result->ud = 0;
+	result->data = (char*)"shm";
+	return SOCKET_OPEN;
+}
+
+// any thread. Written to the ring unless older bytes are pending, the rest is
+// queued on s->high and flushed by the socket thread when the peer makes room.
+static int
+shm_send(struct socket_server *ss, struct socket *s, int id, const void * buffer, int sz) {
+	struct socket_lock l;
+	socket_lock_init(s, &l);
+	socket_lock(&l);
+	struct send_object so;
+	send_object_init(ss, &so, (void *)buffer, sz);
+	if (s->id != id || (s->type != SOCKET_TYPE_CONNECTED && s->type != SOCKET_TYPE_CONNECTING)) {
+		socket_unlock(&l);
+		so.free_func((void *)buffer);
+		return -1;
+	}
+	int n = 0;
+	if (s->shm && s->high.head == NULL) {
+		n = shm_ring_write(s->fd, s->shm->tx, (const char *)so.buffer, so.sz);
+		stat_write(ss, s, n);
+	}
+	if (n == so.sz) {
+		socket_unlock(&l);
+		so.free_func((void *)buffer);
+		return 0;
+	}
+	struct request_send request;
+	request.id = id;
+	request.sz = sz;
+	request.buffer = (char *)buffer;
+	struct write_buffer * buf = append_sendbuffer_(ss, &s->high, &request, SIZEOF_TCPBUFFER);
+	if (buf == NULL) {
+		socket_unlock(&l);
+		so.free_func((void *)buffer);
+		return -1;
+	}
+	buf->ptr += n;
+	buf->sz -= n;
+	s->wb_size += buf->sz;
+	socket_unlock(&l);
+	return 0;
+}
+
+// One read per event: a busy ring is not drained in one go, the rest waits for the
+// next sp_wait round. The peer only wakes us when the ring was empty, so the socket
+// is remembered and socket_server_poll turns it into an event again.
+static void
+shm_defer(struct socket_server *ss, struct socket *s) {
+	struct shm_conn * c = s->shm;
+	if (c->pending) {
+		return;
+	}
+	if (ss->shm_pending_n == ss->shm_pending_cap) {
+		int cap = ss->shm_pending_cap ? ss->shm_pending_cap * 2 : MAX_EVENT;
+		int * pending = (int *)MALLOC(cap * sizeof(int));
+		if (pending == NULL) {
+			// serve it again now rather than lose the wakeup
+			--ss->event_index;
+			return;
+		}
+		if (ss->shm_pending_n > 0) {
+			memcpy(pending, ss->shm_pending, ss->shm_pending_n * sizeof(int));
+		}
+		FREE(ss->shm_pending);
+		ss->shm_pending = pending;
+		ss->shm_pending_cap = cap;
+	}
+	c->pending = 1;
+	ss->shm_pending[ss->shm_pending_n++] = s->id;
+}
+
+static int
+forward_message_shm(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
+	struct shm_conn * c = s->shm;
+	char wake[64];
+	ssize_t r = recv(s->fd, wake, sizeof(wake), MSG_DONTWAIT);
+	if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+		c->eof = 1;
+	}
+	if (s->high.head) {
+		shm_flush(ss, s, l);
+	}
+	if (s->type == SOCKET_TYPE_HALFCLOSE) {
+		// nobody reads any more
+		c->rx->tail = c->rx->head;
+		if (s->high.head == NULL || c->eof) {
+			force_close(ss, s, l, result, SOCKET_CLOSE_HALFCLOSE);
+			return SOCKET_CLOSE;
+		}
+		return -1;
+	}
+	uint64_t avail = c->rx->head - c->rx->tail;
+	if (avail == 0) {
+		if (c->eof) {
+			force_close(ss, s, l, result, SOCKET_CLOSE_EOF);
+			return SOCKET_CLOSE;
+		}
+		return -1;
+	}
+	int sz = avail > SHM_READ_MAX ? SHM_READ_MAX : (int)avail;
+	char * buffer = (char*)MALLOC(sz);
+	int n = shm_ring_read(s->fd, c->rx, buffer, sz);
+	stat_read(ss, s, n);
+	ss->flight.cur.bytes += n;
+	SOCKET_PROBE3(read, s->id, s->fd, n);
+	if (c->eof || c->rx->head != c->rx->tail) {
+		// the rest, or the close, after the other sockets of the next sp_wait
+		shm_defer(ss, s);
+	}
+	result->opaque = s->opaque;
+	result->context = s->context;
+	result->id = s->id;
+	result->ud = n;
+	result->data = buffer;
+	return SOCKET_DATA;
+}
+
+static int
+connect_shm(struct socket_server *ss, struct request_bind *request, struct socket_message *result) {
+	int id = request->id;
+	result->id = id;
+	result->opaque = request->opaque;
+	result->context = request->context;
+	result->ud = 0;
+	result->data = NULL;
+	struct socket *s = new_fd(ss, id, request->fd, PROTOCOL_SHM, request->opaque, true);
+	if (s == NULL) {
+		release_id(ss, id);
+		socket_close(request->fd);
+		result->data = (char*)"reach skynet socket number limit";
+		return SOCKET_ERR;
+	}
+	s->context = request->context;
+	s->type = SOCKET_TYPE_CONNECTING;
+	return -1;
+}
+
+static void
+shm_address(const char *name, struct sockaddr_un *addr, socklen_t *len) {
+	// abstract namespace: no file to clean up, gone with the listener
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	int n = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "opensocket.shm.%s", name);
+	if (n < 0 || n >= (int)sizeof(addr->sun_path) - 1) {
+		n = (int)sizeof(addr->sun_path) - 2;
+	}
+	*len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + n);
+}
+
+static int
+do_listen_shm(const char *name, int backlog) {
+	struct sockaddr_un addr;
+	socklen_t len;
+	shm_address(name, &addr, &len);
+	int fd = (int)socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&addr, len) != 0 || listen(fd, backlog) != 0) {
+		socket_close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// the handshake completes on the socket thread, see report_connect_shm
+static int
+do_connect_shm(const char *name) {
+	struct sockaddr_un addr;
+	socklen_t len;
+	shm_address(name, &addr, &len);
+	int fd = (int)socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, len) != 0) {
+		socket_close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+#else
+
+static struct shm_conn *
+shm_accept(int fd, int ring) {
+	return NULL;
+}
+
+static int
+report_connect_shm(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message *result) {
+	force_close(ss, s, l, result, SOCKET_CLOSE_ERROR);
+	return SOCKET_ERR;
+}
+
+static void
+shm_flush(struct socket_server *ss, struct socket *s, struct socket_lock *l) {
+}
+
+static int
+shm_send(struct socket_server *ss, struct socket *s, int id, const void * buffer, int sz) {
+	free_buffer(ss, buffer, sz);
+	return -1;
+}
+
+static int
+forward_message_shm(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
+	return -1;
+}
+
+static int
+connect_shm(struct socket_server *ss, struct request_bind *request, struct socket_message *result) {
+	result->id = request->id;
+	result->opaque = request->opaque;
+	result->context = request->context;
+	result->ud = 0;
+	result->data = (char*)"shm is not supported";
+	release_id(ss, request->id);
+	return SOCKET_ERR;
+}
+
+#endif
+
 /*
 	When send a package , we can assign the priority : PRIORITY_HIGH or PRIORITY_LOW
 
@@ -944,6 +2289,11 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 		so.free_func(request->buffer);
 		return -1;
 	}
+	if (s->protocol == PROTOCOL_SHM) {
+		// no priority on a ring, low goes after high like a partial write
+		shm_send(ss, s, id, request->buffer, request->sz);
+		return -1;
+	}
 	if (send_buffer_empty(s) && s->type == SOCKET_TYPE_CONNECTED) {
 		if (s->protocol == PROTOCOL_TCP) {
 			append_sendbuffer(ss, s, request);	// add to high priority list, even priority == PRIORITY_LOW
@@ -960,7 +2310,7 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 				so.free_func(request->buffer);
 				return -1;
 			}
-			int n = sendto(s->fd, (char*)so.buffer, so.sz, 0, &sa.s, sasz);
+			int n = udp_sendto(s->fd, so.buffer, so.sz, &sa, sasz);
 			if (n != so.sz) {
 				append_sendbuffer_udp(ss,s,priority,request,udp_address);
 			} else {
@@ -987,16 +2337,19 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 	if (s->wb_size >= WARNING_SIZE && s->wb_size >= s->warn_size) {
 		s->warn_size = s->warn_size == 0 ? WARNING_SIZE * 2 : s->warn_size * 2;
 		result->opaque = s->opaque;
+		result->context = s->context;
 		result->id = s->id;
 		result->ud = (int)(s->wb_size % 1024 == 0 ? s->wb_size / 1024 : s->wb_size / 1024 + 1);
 		result->data = NULL;
 		if (result->ud <= 0) {
 			result->ud = 1;
 		}
+		SOCKET_PROBE3(warning, s->id, s->fd, s->wb_size);
 		return SOCKET_WARNING;
 	}
 	s->warn_size = 1;
 	result->opaque = s->opaque;
+	result->context = s->context;
 	result->id = s->id;
 	result->ud = 1;
 	result->data = NULL;
@@ -1007,19 +2360,27 @@ static int
 listen_socket(struct socket_server *ss, struct request_listen * request, struct socket_message *result) {
 	int id = request->id;
 	int listen_fd = request->fd;
-	struct socket *s = new_fd(ss, id, listen_fd, PROTOCOL_TCP, request->opaque, false);
+	struct socket *s = new_fd(ss, id, listen_fd, request->protocol, request->opaque, false);
 	if (s == NULL) {
 		goto _failed;
 	}
 	s->type = SOCKET_TYPE_PLISTEN;
+	s->shm_ring = request->ring;
+	if (request->option.mask) {
+		s->option = (struct socket_option *)MALLOC(sizeof(*s->option));
+		if (s->option) {
+			*s->option = request->option;
+		}
+	}
 	return -1;
 _failed:
 	socket_close(listen_fd);
 	result->opaque = request->opaque;
+	result->context = 0;
 	result->id = id;
 	result->ud = 0;
 	result->data = (char*)"reach skynet socket number limit";
-	ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
+	release_id(ss, id);
 
 	return SOCKET_ERR;
 }
@@ -1036,22 +2397,28 @@ close_socket(struct socket_server *ss, struct request_close *request, struct soc
 	if (s->type == SOCKET_TYPE_INVALID || s->id != id) {
 		result->id = id;
 		result->opaque = request->opaque;
+		result->context = 0;
 		result->ud = 0;
 		result->data = NULL;
 		return SOCKET_CLOSE;
 	}
 	struct socket_lock l;
 	socket_lock_init(s, &l);
-	if (!nomore_sending_data(s)) {
+	if (s->protocol == PROTOCOL_SHM) {
+		if (s->shm) {
+			shm_flush(ss, s, &l);
+		}
+	} else if (!nomore_sending_data(s)) {
 		int type = send_buffer(ss,s,&l,result);
 		// type : -1 or SOCKET_WARNING or SOCKET_CLOSE, SOCKET_WARNING means nomore_sending_data
 		if (type != -1 && type != SOCKET_WARNING)
 			return type;
 	}
 	if (request->shutdown || nomore_sending_data(s)) {
-		force_close(ss,s,&l,result);
+		force_close(ss,s,&l,result,SOCKET_CLOSE_USER);
 		result->id = id;
 		result->opaque = request->opaque;
+		result->context = 0;
 		return SOCKET_CLOSE;
 	}
 	s->type = SOCKET_TYPE_HALFCLOSE;
@@ -1064,13 +2431,16 @@ bind_socket(struct socket_server *ss, struct request_bind *request, struct socke
 	int id = request->id;
 	result->id = id;
 	result->opaque = request->opaque;
+	result->context = request->context;
 	result->ud = 0;
 	struct socket *s = new_fd(ss, id, request->fd, PROTOCOL_TCP, request->opaque, true);
 	if (s == NULL) {
+		release_id(ss, id);
 		result->data = (char*)"reach skynet socket number limit";
 		return SOCKET_ERR;
 	}
 	sp_nonblocking(request->fd);
+	s->context = request->context;
 	s->type = SOCKET_TYPE_BIND;
 	result->data = (char*)"binding";
 	return SOCKET_OPEN;
@@ -1081,6 +2451,7 @@ start_socket(struct socket_server *ss, struct request_start *request, struct soc
 	int id = request->id;
 	result->id = id;
 	result->opaque = request->opaque;
+	result->context = request->context;
 	result->ud = 0;
 	result->data = NULL;
 	struct socket *s = &ss->slot[HASH_ID(id)];
@@ -1092,17 +2463,19 @@ start_socket(struct socket_server *ss, struct request_start *request, struct soc
 	socket_lock_init(s, &l);
 	if (s->type == SOCKET_TYPE_PACCEPT || s->type == SOCKET_TYPE_PLISTEN) {
 		if (sp_add(ss->event_fd, s->fd, s)) {
-			force_close(ss, s, &l, result);
+			force_close(ss, s, &l, result, SOCKET_CLOSE_ERROR);
 			result->data = strerror(errno);
 			return SOCKET_ERR;
 		}
 		s->type = (s->type == SOCKET_TYPE_PACCEPT) ? SOCKET_TYPE_CONNECTED : SOCKET_TYPE_LISTEN;
 		s->opaque = request->opaque;
+		s->context = request->context;
 		result->data = (char*)"start";
 		return SOCKET_OPEN;
 	} else if (s->type == SOCKET_TYPE_CONNECTED) {
 		// todo: maybe we should send a message SOCKET_TRANSFER to s->opaque
 		s->opaque = request->opaque;
+		s->context = request->context;
 		result->data = (char*)"transfer";
 		return SOCKET_OPEN;
 	}
@@ -1110,15 +2483,37 @@ start_socket(struct socket_server *ss, struct request_start *request, struct soc
 	return -1;
 }
 
+static void
+set_inline(struct socket_server *ss, struct request_inline *request) {
+	int id = request->id;
+	struct socket *s = &ss->slot[HASH_ID(id)];
+	if (s->type == SOCKET_TYPE_INVALID || s->id != id) {
+		return;
+	}
+	s->inline_handler = request->handler;
+}
+
 static void
 setopt_socket(struct socket_server *ss, struct request_setopt *request) {
 	int id = request->id;
 	struct socket *s = &ss->slot[HASH_ID(id)];
-	if (s->type == SOCKET_TYPE_INVALID || s->id !=id) {
+	if (s->type == SOCKET_TYPE_INVALID || s->id !=id || request->what < 0 || request->what >= SOCKET_OPT_MAX) {
 		return;
 	}
-	int v = request->value;
-	socket_setsockopt(s->fd, IPPROTO_TCP, request->what, &v, sizeof(v));
+	socket_option_set(s->fd, request->what, request->value);
+	socket_option_local(s, request->what, request->value);
+	if (s->type == SOCKET_TYPE_PLISTEN || s->type == SOCKET_TYPE_LISTEN) {
+		// becomes a default of the sockets accepted from now on
+		if (s->option == NULL) {
+			s->option = (struct socket_option *)MALLOC(sizeof(*s->option));
+			if (s->option == NULL) {
+				return;
+			}
+			memset(s->option, 0, sizeof(*s->option));
+		}
+		s->option->mask |= 1u << request->what;
+		s->option->value[request->what] = request->value;
+	}
 }
 
 static void
@@ -1154,13 +2549,17 @@ add_udp_socket(struct socket_server *ss, struct request_udp *udp) {
 	int protocol;
 	if (udp->family == AF_INET6) {
 		protocol = PROTOCOL_UDPv6;
+#ifdef HAVE_UNIX_SOCKET
+	} else if (udp->family == AF_UNIX) {
+		protocol = PROTOCOL_UNIX;
+#endif
 	} else {
 		protocol = PROTOCOL_UDP;
 	}
 	struct socket *ns = new_fd(ss, id, udp->fd, protocol, udp->opaque, true);
 	if (ns == NULL) {
 		socket_close(udp->fd);
-		ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
+		release_id(ss, id);
 		return;
 	}
 	ns->type = SOCKET_TYPE_CONNECTED;
@@ -1178,6 +2577,7 @@ set_udp_address(struct socket_server *ss, struct request_setudp *request, struct
 	if (type != s->protocol) {
 		// protocol mismatch
 		result->opaque = s->opaque;
+		result->context = s->context;
 		result->id = s->id;
 		result->ud = 0;
 		result->data = (char*)"protocol mismatch";
@@ -1186,6 +2586,21 @@ set_udp_address(struct socket_server *ss, struct request_setudp *request, struct
 	}
 	if (type == PROTOCOL_UDP) {
 		memcpy(s->p.udp_address, request->address, 1+2+4);	// 1 type, 2 port, 4 ipv4
+#ifdef HAVE_UNIX_SOCKET
+	} else if (type == PROTOCOL_UNIX) {
+		// the peer is kept by the kernel, see udp_sendto
+		ATOM_DEC(&s->udpconnecting);
+		if (connect(s->fd, (struct sockaddr *)(request->address + 2), request->address[1]) != 0) {
+			result->opaque = s->opaque;
+			result->context = s->context;
+			result->id = s->id;
+			result->ud = 0;
+			result->data = strerror(errno);
+			return SOCKET_ERR;
+		}
+		s->p.udp_address[0] = PROTOCOL_UNIX;
+		return -1;
+#endif
 	} else {
 		memcpy(s->p.udp_address, request->address, 1+2+16);	// 1 type, 2 port, 16 ipv6
 	}
@@ -1193,10 +2608,12 @@ set_udp_address(struct socket_server *ss, struct request_setudp *request, struct
 	return -1;
 }
 
-static inline void
+// return 1 when the ref is taken, only then the socket thread may dec it.
+// A socket still reserved by connect has no protocol yet and is not counted.
+static inline int
 inc_sending_ref(struct socket *s, int id) {
-	if (s->protocol != PROTOCOL_TCP)
-		return;
+	if (s->protocol != PROTOCOL_TCP && s->protocol != PROTOCOL_SHM)
+		return 0;
 	for (;;) {
 		uint32_t sending = s->sending;
 		if ((sending >> 16) == ID_TAG16(id)) {
@@ -1205,24 +2622,120 @@ inc_sending_ref(struct socket *s, int id) {
 				continue;
 			}
 			// inc sending only matching the same socket id
+			// the cast is for the windows shim only, a long* CAS on the uint32_t is 8 bytes wide on LP64 and never matches
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
 			if (ATOM_CAS((long*)&s->sending, sending, sending + 1))
-				return;
+#else
+			if (ATOM_CAS(&s->sending, sending, sending + 1))
+#endif
+				return 1;
 			// atom inc failed, retry
 		} else {
 			// socket id changed, just return
-			return;
+			return 0;
 		}
 	}
 }
 
-static inline void
-dec_sending_ref(struct socket_server *ss, int id) {
+static inline void
+dec_sending_ref(struct socket_server *ss, int id) {
+	struct socket * s = &ss->slot[HASH_ID(id)];
+	// Notice: udp may inc sending while type == SOCKET_TYPE_RESERVE
+	if (s->id == id && s->protocol == PROTOCOL_TCP) {
+		assert((s->sending & 0xffff) != 0);
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+		ATOM_DEC((long*)&s->sending);
+#else
+		ATOM_DEC(&s->sending);
+#endif
+	}
+}
+
+static void
+append_sendbuffer_shared(struct socket_server *ss, struct socket *s, struct shared_payload *p, int offset) {
+	struct write_buffer * buf = (struct write_buffer*)MALLOC(SIZEOF_TCPBUFFER);
+	if (!buf) {
+		return;
+	}
+	ATOM_INC(&p->ref);
+	buf->userobject = false;
+	buf->shared = true;
+	buf->passfd = false;
+	buf->buffer = p;
+	buf->ptr = p->data + offset;
+	buf->sz = p->sz - offset;
+	buf->next = NULL;
+	if (s->high.head == NULL) {
+		s->high.head = s->high.tail = buf;
+	} else {
+		s->high.tail->next = buf;
+		s->high.tail = buf;
+	}
+	s->wb_size += buf->sz;
+}
+
+// The descriptor is queued like data and keeps its place in the stream.
+// The sending ref of socket_server_sendfd holds off direct writes meanwhile.
+static int
+sendfd_socket(struct socket_server *ss, struct request_send * request) {
+	int id = request->id;
 	struct socket * s = &ss->slot[HASH_ID(id)];
-	// Notice: udp may inc sending while type == SOCKET_TYPE_RESERVE
-	if (s->id == id && s->protocol == PROTOCOL_TCP) {
-		assert((s->sending & 0xffff) != 0);
-		ATOM_DEC((long*)&s->sending);
+	if (s->type == SOCKET_TYPE_INVALID || s->id != id || s->protocol != PROTOCOL_TCP || !s->passfd
+		|| (s->type != SOCKET_TYPE_CONNECTED && s->type != SOCKET_TYPE_CONNECTING)) {
+		socket_close(*(int *)request->buffer);
+		FREE(request->buffer);
+		return -1;
+	}
+	bool empty = send_buffer_empty(s);
+	append_sendbuffer(ss, s, request);
+	s->high.tail->passfd = true;
+	if (empty && s->type == SOCKET_TYPE_CONNECTED) {
+		sp_write(ss->event_fd, s->fd, s, true);
+	}
+	return -1;
+}
+
+/*
+	Fan out one payload to many tcp sockets. An idle socket is written directly,
+	the rest of the payload (or all of it) is queued as a write_buffer that
+	references the payload instead of a copy. Other sockets are skipped.
+	A connected id holds the sending ref taken by socket_server_broadcast, so no
+	other thread can direct write in between and the order of sends is kept.
+	No SOCKET_WARNING is reported for a broadcast.
+ */
+static int
+broadcast_socket(struct socket_server *ss, struct request_broadcast * request) {
+	struct shared_payload * p = request->payload;
+	int i;
+	for (i = 0; i < p->n; i++) {
+		int id = p->id[i];
+		struct socket * s = &ss->slot[HASH_ID(id)];
+		if (s->id != id || s->protocol != PROTOCOL_TCP) {
+			continue;
+		}
+		if (s->type == SOCKET_TYPE_CONNECTED || s->type == SOCKET_TYPE_CONNECTING) {
+			int n = 0;
+			if (s->type == SOCKET_TYPE_CONNECTED && send_buffer_empty(s) && s->dw_buffer == NULL) {
+				n = (int)socket_write(s->fd, p->data, p->sz);
+				if (n < 0) {
+					// let the socket thread try again
+					n = 0;
+				}
+				stat_write(ss, s, n);
+				if (n < p->sz) {
+					sp_write(ss->event_fd, s->fd, s, true);
+				}
+			}
+			if (n < p->sz) {
+				append_sendbuffer_shared(ss, s, p, n);
+			}
+		}
+		if (p->taken[i]) {
+			dec_sending_ref(ss, id);
+		}
 	}
+	shared_payload_release(p);
+	return -1;
 }
 
 // return type
@@ -1236,6 +2749,14 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 	int type = header[0];
 	int len = header[1];
 	block_readpipe(fd, buffer, len);
+	SOCKET_PROBE2(ctrl, type, len);
+	// every request but 'X' and 'M' starts with the socket id
+	int id = -1;
+	if (type != 'X' && type != 'M' && len >= (int)sizeof(id)) {
+		memcpy(&id, buffer, sizeof(id));
+	}
+	flight_op(ss, id, type);
+	++ss->flight.cur.cmds;
 	// ctrl command only exist in local fd, so don't worry about endian.
 	// printf("[skynet-socket]ctrl_cmd type=%c\n", type);
 	switch (type) {
@@ -1247,10 +2768,18 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 		return listen_socket(ss,(struct request_listen *)buffer, result);
 	case 'K':
 		return close_socket(ss,(struct request_close *)buffer, result);
-	case 'O':
-		return open_socket(ss, (struct request_open *)buffer, result);
+	case 'O': {
+		struct request_open * request = (struct request_open *)buffer;
+		int ret = open_socket(ss, request, result);
+		if (request->buffer) {
+			// failed, or written at once
+			FREE(request->buffer);
+		}
+		return ret;
+	}
 	case 'X':
 		result->opaque = 0;
+		result->context = 0;
 		result->id = 0;
 		result->ud = 0;
 		result->data = NULL;
@@ -1261,7 +2790,9 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 		struct request_send * request = (struct request_send *) buffer;
 		int ret = send_socket(ss, request, result, priority, NULL);
 		//printf("ctrl_cmd ==<< id =%d\n", request->id);
-		dec_sending_ref(ss, request->id);
+		if (request->ref) {
+			dec_sending_ref(ss, request->id);
+		}
 		return ret;
 	}
 	case 'A': {
@@ -1276,6 +2807,21 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 	case 'U':
 		add_udp_socket(ss, (struct request_udp *)buffer);
 		return -1;
+	case 'I':
+		set_inline(ss, (struct request_inline *)buffer);
+		return -1;
+	case 'M':
+		return broadcast_socket(ss, (struct request_broadcast *)buffer);
+	case 'H':
+		return connect_shm(ss, (struct request_bind *)buffer, result);
+	case 'F': {
+		struct request_send * request = (struct request_send *) buffer;
+		int ret = sendfd_socket(ss, request);
+		if (request->ref) {
+			dec_sending_ref(ss, request->id);
+		}
+		return ret;
+	}
 	default:
 		fprintf(stderr, "socket-server: Unknown ctrl %c.\n",type);
 		return -1;
@@ -1284,14 +2830,189 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 	return -1;
 }
 
+// only the socket holds it, every slice has been released: it can be written from the start.
+// The CAS is a full barrier, the consumers are done reading when it succeeds.
+static inline int
+recv_chunk_idle(struct recv_chunk *c) {
+	return ATOM_CAS(&c->ref, 1, 1);
+}
+
+// the new chunk replaces s->rchunk, the caller copies from the old one first if needed
+static struct recv_chunk *
+recv_chunk_new(int size) {
+	struct recv_chunk * c = (struct recv_chunk *)MALLOC(sizeof(*c) + size);
+	if (c == NULL) {
+		return NULL;
+	}
+	c->ref = 1;
+	c->size = size;
+	c->used = 0;
+	return c;
+}
+
+static inline void
+recv_chunk_replace(struct socket *s, struct recv_chunk *c) {
+	if (s->rchunk) {
+		recv_chunk_release(s->rchunk);
+	}
+	s->rchunk = c;
+}
+
+/*
+	Read into the tail of s->rchunk, the message is a slice of it: no malloc for
+	small reads. The second readv segment catches what does not fit the tail, so
+	one read never needs a FIONREAD first. Such a burst is copied once into a new
+	chunk that holds all of it, which also becomes the chunk of the next reads
+	until it is idle and the reads are small again.
+	Once every slice of a chunk is released it is reused from the start, a ring.
+ */
+static int
+forward_message_chunk(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
+	struct recv_chunk * c = s->rchunk;
+	// grown for a burst that is over: back to the configured size once idle
+	if (c && c->size > s->rchunk_size && s->p.size < s->rchunk_size && recv_chunk_idle(c)) {
+		recv_chunk_replace(s, NULL);
+		c = NULL;
+	}
+	// s->p.size follows the recent read sizes, rewind rather than split a read
+	if (c && c->used > 0 && c->size - c->used < s->p.size && recv_chunk_idle(c)) {
+		c->used = 0;
+	}
+	if (c == NULL || c->size - c->used < MIN_READ_BUFFER) {
+		c = recv_chunk_new(s->rchunk_size);
+		if (c == NULL) {
+			return -1;
+		}
+		recv_chunk_replace(s, c);
+	}
+	if (ss->chunk_spill == NULL) {
+		ss->chunk_spill = (char*)MALLOC(RECV_CHUNK_SPILL);
+		if (ss->chunk_spill == NULL) {
+			return -1;
+		}
+	}
+	int tail = c->size - c->used;
+	struct iovec iov[2];
+	iov[0].iov_base = RECV_CHUNK_DATA(c) + c->used;
+	iov[0].iov_len = tail;
+	iov[1].iov_base = ss->chunk_spill;
+	iov[1].iov_len = RECV_CHUNK_SPILL;
+	int n = (int)socket_readv(s->fd, iov, 2);
+	if (n < 0) {
+		switch(errno) {
+		case EINTR:
+			break;
+		case AGAIN_WOULDBLOCK:
+			fprintf(stderr, "socket-server: EAGAIN capture.\n");
+			break;
+		default:
+			// close when error
+			force_close(ss, s, l, result, SOCKET_CLOSE_ERROR);
+			result->data = strerror(errno);
+			return SOCKET_ERR;
+		}
+		return -1;
+	}
+	if (n == 0) {
+		force_close(ss, s, l, result, SOCKET_CLOSE_EOF);
+		return SOCKET_CLOSE;
+	}
+
+	if (s->type == SOCKET_TYPE_HALFCLOSE) {
+		// discard recv data
+		return -1;
+	}
+
+	stat_read(ss,s,n);
+	ss->flight.cur.bytes += n;
+	SOCKET_PROBE3(read, s->id, s->fd, n);
+
+	if (n > s->p.size) {
+		s->p.size = n;
+	} else if (s->p.size > MIN_READ_BUFFER && n*2 < s->p.size) {
+		s->p.size /= 2;
+	}
+
+	char * data;
+	if (n <= tail) {
+		data = RECV_CHUNK_DATA(c) + c->used;
+		c->used += n;
+	} else if (c->size >= n && recv_chunk_idle(c)) {
+		memmove(RECV_CHUNK_DATA(c), RECV_CHUNK_DATA(c) + c->used, tail);
+		memcpy(RECV_CHUNK_DATA(c) + tail, ss->chunk_spill, n - tail);
+		data = RECV_CHUNK_DATA(c);
+		c->used = n;
+	} else {
+		int size = s->rchunk_size;
+		while (size < n) {
+			size *= 2;
+		}
+		struct recv_chunk * nc = recv_chunk_new(size);
+		if (nc == NULL) {
+			return -1;
+		}
+		memcpy(RECV_CHUNK_DATA(nc), RECV_CHUNK_DATA(c) + c->used, tail);
+		memcpy(RECV_CHUNK_DATA(nc) + tail, ss->chunk_spill, n - tail);
+		recv_chunk_replace(s, nc);
+		c = nc;
+		data = RECV_CHUNK_DATA(c);
+		c->used = n;
+	}
+	ATOM_INC(&c->ref);
+
+	result->opaque = s->opaque;
+	result->context = s->context;
+	result->id = s->id;
+	result->ud = n;
+	result->data = data;
+	result->chunk = c;
+	return SOCKET_DATA;
+}
+
 // return -1 (ignore) when error
 static int
 forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
 	int sz = s->p.size;
-	char * buffer = (char*)MALLOC(sz);
+	int inl = s->inline_handler != NULL && ss->inline_cb != NULL;
+	if (s->recvfd >= 0) {
+		// came with the bytes of the last read
+		result->opaque = s->opaque;
+		result->context = s->context;
+		result->id = s->id;
+		result->ud = s->recvfd;
+		result->data = NULL;
+		s->recvfd = -1;
+		return SOCKET_FD;
+	}
+	if (!inl && s->rchunk_size > 0 && !s->passfd) {
+		return forward_message_chunk(ss, s, l, result);
+	}
+	char * buffer;
+	if (inl) {
+		if (ss->inline_size < sz) {
+			FREE(ss->inline_buffer);
+			ss->inline_buffer = (char*)MALLOC(sz);
+			ss->inline_size = sz;
+		}
+		buffer = ss->inline_buffer;
+	} else {
+		buffer = (char*)MALLOC(sz);
+	}
+#ifdef HAVE_UNIX_SOCKET
+	int n = s->passfd ? socket_recvfd(s->fd, buffer, sz, &s->recvfd) : (int)socket_read(s->fd, buffer, sz);
+	if (s->recvfd >= 0) {
+		// drop its byte, the descriptor follows as SOCKET_FD, see socket_server_poll
+		--n;
+		if (n == 0) {
+			if (!inl) FREE(buffer);
+			return -1;
+		}
+	}
+#else
 	int n = (int)socket_read(s->fd, buffer, sz);
+#endif
 	if (n < 0) {
-		FREE(buffer);
+		if (!inl) FREE(buffer);
 		switch(errno) {
 		case EINTR:
 			break;
@@ -1300,25 +3021,27 @@ forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lo
 			break;
 		default:
 			// close when error
-			force_close(ss, s, l, result);
+			force_close(ss, s, l, result, SOCKET_CLOSE_ERROR);
 			result->data = strerror(errno);
 			return SOCKET_ERR;
 		}
 		return -1;
 	}
 	if (n == 0) {
-		FREE(buffer);
-		force_close(ss, s, l, result);
+		if (!inl) FREE(buffer);
+		force_close(ss, s, l, result, SOCKET_CLOSE_EOF);
 		return SOCKET_CLOSE;
 	}
 
 	if (s->type == SOCKET_TYPE_HALFCLOSE) {
 		// discard recv data
-		FREE(buffer);
+		if (!inl) FREE(buffer);
 		return -1;
 	}
 
 	stat_read(ss,s,n);
+	ss->flight.cur.bytes += n;
+	SOCKET_PROBE3(read, s->id, s->fd, n);
 
 	if (n == sz) {
 		s->p.size *= 2;
@@ -1327,9 +3050,15 @@ forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lo
 	}
 
 	result->opaque = s->opaque;
+	result->context = s->context;
 	result->id = s->id;
 	result->ud = n;
 	result->data = buffer;
+	if (inl) {
+		// the handler only borrows buffer, nothing is forwarded
+		ss->inline_cb(ss->inline_ud, s->inline_handler, result);
+		return -1;
+	}
 	return SOCKET_DATA;
 }
 
@@ -1363,16 +3092,22 @@ forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_lo
 			break;
 		default:
 			// close when error
-			force_close(ss, s, l, result);
+			force_close(ss, s, l, result, SOCKET_CLOSE_ERROR);
 			result->data = strerror(errno);
 			return SOCKET_ERR;
 		}
 		return -1;
 	}
 	stat_read(ss,s,n);
+	ss->flight.cur.bytes += n;
+	SOCKET_PROBE3(read, s->id, s->fd, n);
 
 	uint8_t* data = 0;
-	if (slen == sizeof(sa.v4)) {
+	if (s->protocol == PROTOCOL_UNIX) {
+		// the type alone, a reply goes to the connected peer
+		data = (uint8_t*)MALLOC(n + 1);
+		data[n] = PROTOCOL_UNIX;
+	} else if (slen == sizeof(sa.v4)) {
 		if (s->protocol != PROTOCOL_UDP)
 			return -1;
 		data = (uint8_t*)MALLOC(n + 1 + 2 + 4);
@@ -1386,6 +3121,7 @@ forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_lo
 	memcpy(data, ss->udpbuffer, n);
 
 	result->opaque = s->opaque;
+	result->context = s->context;
 	result->id = s->id;
 	result->ud = n;
 	result->data = (char *)data;
@@ -1399,7 +3135,7 @@ report_connect(struct socket_server *ss, struct socket *s, struct socket_lock *l
 	socklen_t len = sizeof(error);  
 	int code = socket_getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &error, &len);  
 	if (code < 0 || error) {  
-		force_close(ss,s,l, result);
+		force_close(ss,s,l, result, SOCKET_CLOSE_ERROR);
 		if (code >= 0)
 			result->data = strerror(error);
 		else
@@ -1407,7 +3143,9 @@ report_connect(struct socket_server *ss, struct socket *s, struct socket_lock *l
 		return SOCKET_ERR;
 	} else {
 		s->type = SOCKET_TYPE_CONNECTED;
+		SOCKET_PROBE2(connect, s->id, s->fd);
 		result->opaque = s->opaque;
+		result->context = s->context;
 		result->id = s->id;
 		result->ud = 0;
 		if (nomore_sending_data(s)) {
@@ -1430,6 +3168,19 @@ report_connect(struct socket_server *ss, struct socket *s, struct socket_lock *l
 static int
 getname(union sockaddr_all *u, char *buffer, size_t sz) {
 	char tmp[INET6_ADDRSTRLEN];
+#ifdef HAVE_UNIX_SOCKET
+	if (u->s.sa_family == AF_UNIX) {
+		// the peer of an accepted socket has no name most of the time
+		if (u->un.sun_path[0]) {
+			snprintf(buffer, sz, "%s", u->un.sun_path);
+		} else if (u->un.sun_path[1]) {
+			snprintf(buffer, sz, "@%s", u->un.sun_path + 1);
+		} else {
+			buffer[0] = '\0';
+		}
+		return 1;
+	}
+#endif
 	void * sin_addr = (u->s.sa_family == AF_INET) ? (void*)&u->v4.sin_addr : (void *)&u->v6.sin6_addr;
 	int sin_port = ntohs((u->s.sa_family == AF_INET) ? u->v4.sin_port : u->v6.sin6_port);
 	if (inet_ntop(u->s.sa_family, sin_addr, tmp, sizeof(tmp))) {
@@ -1449,6 +3200,7 @@ report_accept(struct socket_server *ss, struct socket *s, struct socket_message
 	if (client_fd < 0) {
 		if (errno == EMFILE || errno == ENFILE) {
 			result->opaque = s->opaque;
+			result->context = s->context;
 			result->id = s->id;
 			result->ud = 0;
 			result->data = strerror(errno);
@@ -1457,23 +3209,48 @@ report_accept(struct socket_server *ss, struct socket *s, struct socket_message
 			return 0;
 		}
 	}
+	struct shm_conn * shm = NULL;
+	if (s->protocol == PROTOCOL_SHM) {
+		shm = shm_accept(client_fd, s->shm_ring);
+		if (shm == NULL) {
+			socket_close(client_fd);
+			return 0;
+		}
+	}
 	int id = reserve_id(ss);
 	if (id < 0) {
+		if (shm) {
+			shm_conn_free(shm);
+		}
 		socket_close(client_fd);
 		return 0;
 	}
-	socket_keepalive(client_fd);
+	if (shm == NULL) {
+		socket_keepalive(client_fd);
+		if (s->option) {
+			socket_option_apply(client_fd, s->option);
+		}
+	}
 	sp_nonblocking(client_fd);
-	struct socket *ns = new_fd(ss, id, client_fd, PROTOCOL_TCP, s->opaque, false);
+	struct socket *ns = new_fd(ss, id, client_fd, s->protocol, s->opaque, false);
 	if (ns == NULL) {
+		if (shm) {
+			shm_conn_free(shm);
+		}
 		socket_close(client_fd);
 		return 0;
 	}
+	ns->shm = shm;
+	if (s->option) {
+		socket_option_apply_local(ns, s->option);
+	}
 	// accept new one connection
 	stat_read(ss,s,1);
+	SOCKET_PROBE3(accept, s->id, id, client_fd);
 
 	ns->type = SOCKET_TYPE_PACCEPT;
 	result->opaque = s->opaque;
+	result->context = s->context;
 	result->id = s->id;
 	result->ud = id;
 	result->data = NULL;
@@ -1484,6 +3261,33 @@ report_accept(struct socket_server *ss, struct socket *s, struct socket_message
 	return 1;
 }
 
+// moves deferred shm sockets (shm_defer) to the end of the batch as read events, oldest first.
+// Closed or reused ones are dropped. return events added
+static int
+shm_pending_take(struct socket_server *ss, struct event *e, int max) {
+	int n = 0;
+	int i = 0;
+	for (; i < ss->shm_pending_n && n < max; i++) {
+		int id = ss->shm_pending[i];
+		struct socket *s = &ss->slot[HASH_ID(id)];
+		if (s->id != id || s->protocol != PROTOCOL_SHM || s->shm == NULL) {
+			continue;
+		}
+		s->shm->pending = 0;
+		e[n].s = s;
+		e[n].read = true;
+		e[n].write = false;
+		e[n].error = false;
+		e[n].eof = false;
+		++n;
+	}
+	ss->shm_pending_n -= i;
+	if (ss->shm_pending_n > 0) {
+		memmove(ss->shm_pending, ss->shm_pending + i, ss->shm_pending_n * sizeof(int));
+	}
+	return n;
+}
+
 static inline void 
 clear_closed_event(struct socket_server *ss, struct socket_message * result, int type) {
 	if (type == SOCKET_CLOSE || type == SOCKET_ERR) {
@@ -1512,24 +3316,45 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 				int type = ctrl_cmd(ss, result);
 				if (type != -1) {
 					clear_closed_event(ss, result, type);
+					// open/close/error of a request: not part of the batch
+					ss->ready = ss->trace ? trace_now() : 0;
 					return type;
 				} else
 					continue;
 			} else {
 				ss->checkctrl = 0;
+				ss->ready = ss->ready_batch;
 			}
 		}
 		if (ss->event_index == ss->event_n) {
 			// printf("[skynet-socket]socket_server_poll sp_wait\n");
-			ss->event_n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT);
+			flight_end(ss);
+			int deferred = ss->shm_pending_n > 0;
+			if (deferred) {
+				// do not block, and keep room for the deferred shm sockets
+				int room = ss->shm_pending_n < MAX_EVENT / 2 ? ss->shm_pending_n : MAX_EVENT / 2;
+				int n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT - room, 0);
+				if (n < 0) {
+					n = 0;
+				}
+				ss->event_n = n + shm_pending_take(ss, ss->ev + n, MAX_EVENT - n);
+			} else {
+				ss->event_n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT, -1);
+			}
 			ss->checkctrl = 1;
+			int64_t now = flight_begin(ss, ss->event_n);
+			// the clock of stat.rtime/wtime, no extra clock read: the flight recorder has one
+			ss->time = (uint64_t)(now / 1000000);
+			// every message of this batch waited for the ones before it
+			ss->ready_batch = ss->trace ? now : 0;
+			ss->ready = ss->ready_batch;
 			if (more) {
 				*more = 0;
 			}
 			ss->event_index = 0;
 			if (ss->event_n <= 0) {
 				ss->event_n = 0;
-				if (errno == EINTR) {
+				if (deferred || errno == EINTR) {
 					continue;
 				}
 				return -1;
@@ -1541,10 +3366,23 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 			// dispatch pipe message at beginning
 			continue;
 		}
+		if (s->type == SOCKET_TYPE_CONNECTING) {
+			flight_op(ss, s->id, FLIGHT_OP_CONNECT);
+		} else if (s->type == SOCKET_TYPE_LISTEN) {
+			flight_op(ss, s->id, FLIGHT_OP_ACCEPT);
+		} else {
+			flight_op(ss, s->id, e->read ? FLIGHT_OP_READ : e->write ? FLIGHT_OP_WRITE : FLIGHT_OP_ERROR);
+		}
 		struct socket_lock l;
 		socket_lock_init(s, &l);
 		switch (s->type) {
 		case SOCKET_TYPE_CONNECTING:
+			if (s->protocol == PROTOCOL_SHM) {
+				int type = report_connect_shm(ss, s, &l, result);
+				if (type == -1)
+					break;
+				return type;
+			}
 			return report_connect(ss, s, &l, result);
 		case SOCKET_TYPE_LISTEN: {
 			int ok = report_accept(ss, s, result);
@@ -1564,6 +3402,15 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 				int type;
 				if (s->protocol == PROTOCOL_TCP) {
 					type = forward_message_tcp(ss, s, &l, result);
+					if (s->recvfd >= 0) {
+						// same event again, it reports the descriptor of this read
+						--ss->event_index;
+						if (type == -1)
+							break;
+						return type;
+					}
+				} else if (s->protocol == PROTOCOL_SHM) {
+					type = forward_message_shm(ss, s, &l, result);
 				} else {
 					type = forward_message_udp(ss, s, &l, result);
 					if (type == SOCKET_UDP) {
@@ -1600,12 +3447,12 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 				} else {
 					err = "Unknown error";
 				}
-				force_close(ss, s, &l, result);
+				force_close(ss, s, &l, result, SOCKET_CLOSE_ERROR);
 				result->data = (char *)err;
 				return SOCKET_ERR;
 			}
 			if(e->eof) {
-				force_close(ss, s, &l, result);
+				force_close(ss, s, &l, result, SOCKET_CLOSE_EOF);
 				return SOCKET_CLOSE;
 			}
 			break;
@@ -1630,9 +3477,12 @@ send_request(struct socket_server *ss, struct request_package *request, char typ
 	}
 }
 
-static int open_request(struct socket_server *ss, struct request_package *req, uintptr_t opaque, const char *addr, int port) {
+static int open_request(struct socket_server *ss, struct request_package *req, uintptr_t opaque, uintptr_t context, const struct socket_option *option, const char *addr, int port, const char *local) {
 	int len = (int)strlen(addr);
-	if (len + sizeof(req->u.open) >= 256) {
+	int locallen = local ? (int)strlen(local) : 0;
+	// host, then the source address after its '\0'
+	int total = locallen > 0 ? len + 1 + locallen : len;
+	if (total + sizeof(req->u.open) >= 256) {
 		fprintf(stderr, "socket-server : Invalid addr %s.\n",addr);
 		return -1;
 	}
@@ -1640,16 +3490,30 @@ static int open_request(struct socket_server *ss, struct request_package *req, u
 	if (id < 0)
 		return -1;
 	req->u.open.opaque = opaque;
+	req->u.open.context = context;
+	if (option) {
+		req->u.open.option = *option;
+	} else {
+		req->u.open.option.mask = 0;
+	}
+	req->u.open.buffer = NULL;
+	req->u.open.sz = 0;
 	req->u.open.id = id;
 	req->u.open.port = port;
 	memcpy(req->u.open.host, addr, len);
 	req->u.open.host[len] = '\0';
+	req->u.open.local = 0;
+	if (locallen > 0) {
+		memcpy(req->u.open.host + len + 1, local, locallen);
+		req->u.open.host[total] = '\0';
+		req->u.open.local = len + 1;
+	}
 
-	return len;
+	return total;
 }
 
 static inline int can_direct_write(struct socket *s, int id) {
-	return s->id == id && nomore_sending_data(s) && s->type == SOCKET_TYPE_CONNECTED && s->udpconnecting == 0;
+	return s->id == id && nomore_sending_data(s) && s->type == SOCKET_TYPE_CONNECTED && s->udpconnecting == 0 && s->protocol != PROTOCOL_SHM;
 }
 
 // return -1 when error, 0 when success
@@ -1659,6 +3523,10 @@ int socket_server_send(struct socket_server *ss, int id, const void * buffer, in
 		free_buffer(ss, buffer, sz);
 		return -1;
 	}
+	if (s->protocol == PROTOCOL_SHM && s->type == SOCKET_TYPE_CONNECTED && (s->sending & 0xffff) == 0) {
+		// nothing of this socket left in the pipe, the ring keeps the order
+		return shm_send(ss, s, id, buffer, sz);
+	}
 
 	struct socket_lock l;
 	socket_lock_init(s, &l);
@@ -1681,13 +3549,14 @@ int socket_server_send(struct socket_server *ss, int id, const void * buffer, in
 					so.free_func((void *)buffer);
 					return -1;
 				}
-				n = sendto(s->fd, (char*)so.buffer, so.sz, 0, &sa.s, sasz);
+				n = udp_sendto(s->fd, so.buffer, so.sz, &sa, sasz);
 			}
 			if (n<0) {
 				// ignore error, let socket thread try again
 				n = 0;
 			}
 			stat_write(ss, s, (int)n);
+			SOCKET_PROBE4(write, s->id, s->fd, (int)n, so.sz - (int)n);
 			if (n == so.sz) {
 				// write done
 				socket_unlock(&l);
@@ -1706,16 +3575,207 @@ int socket_server_send(struct socket_server *ss, int id, const void * buffer, in
 		socket_unlock(&l);
 	}
 	//printf("socket_server_send ==>> id =%d\n", id);
-	inc_sending_ref(s, id);
-
 	struct request_package request = {0};
 	request.u.send.id = id;
 	request.u.send.sz = sz;
 	request.u.send.buffer = (char *)buffer;
+	request.u.send.ref = inc_sending_ref(s, id);
+
+	send_request(ss, &request, 'D', sizeof(request.u.send));
+	//return 0;
+	return 1;
+}
+
+static char *
+copy_iovec(const struct iovec *iov, int count, int skip, int sz) {
+	char * buffer = (char*)MALLOC(sz);
+	char * ptr = buffer;
+	int i;
+	for (i = 0; i < count && sz > 0; i++) {
+		int len = (int)iov[i].iov_len;
+		if (skip >= len) {
+			skip -= len;
+			continue;
+		}
+		len -= skip;
+		if (len > sz) {
+			len = sz;
+		}
+		memcpy(ptr, (const char*)iov[i].iov_base + skip, len);
+		ptr += len;
+		sz -= len;
+		skip = 0;
+	}
+	return buffer;
+}
+
+// iov is only read during the call. Like socket_server_send, but the direct write uses
+// writev, and only the part that was not written is copied into s->dw_buffer.
+int socket_server_sendv(struct socket_server *ss, int id, const struct iovec *iov, int count) {
+	struct socket * s = &ss->slot[HASH_ID(id)];
+	if (s->id != id || s->type == SOCKET_TYPE_INVALID || count <= 0) {
+		return -1;
+	}
+	int sz = 0;
+	int i;
+	for (i = 0; i < count; i++) {
+		sz += (int)iov[i].iov_len;
+	}
+	if (sz <= 0) {
+		return 0;
+	}
+	if (s->protocol == PROTOCOL_TCP) {
+		struct socket_lock l;
+		socket_lock_init(s, &l);
+		if (can_direct_write(s,id) && socket_trylock(&l)) {
+			// double check, see socket_server_send
+			if (can_direct_write(s,id)) {
+				int n = (int)socket_writev(s->fd, iov, count);
+				if (n < 0) {
+					n = 0;
+				}
+				stat_write(ss, s, n);
+				SOCKET_PROBE4(write, s->id, s->fd, n, sz - n);
+				if (n == sz) {
+					socket_unlock(&l);
+					return 0;
+				}
+				s->dw_buffer = copy_iovec(iov, count, n, sz - n);
+				s->dw_size = sz - n;
+				s->dw_offset = 0;
+				sp_write(ss->event_fd, s->fd, s, true);
+				socket_unlock(&l);
+				return 0;
+			}
+			socket_unlock(&l);
+		}
+	}
+	return socket_server_send(ss, id, copy_iovec(iov, count, 0, sz), sz);
+}
+
+// socket thread only, from an inline handler. buffer is copied if it can not be written at once.
+// Never goes through the control pipe: its only reader is this thread. What can not be written
+// now is queued behind the pending data, sends of other threads still in the pipe come after it.
+// return -1 when error, 0 when success, n > 0 while n KB, at least WARNING_SIZE, are queued
+int socket_server_send_inline(struct socket_server *ss, int id, const void * buffer, int sz) {
+	struct socket * s = &ss->slot[HASH_ID(id)];
+	if (s->id != id || s->type != SOCKET_TYPE_CONNECTED || s->protocol != PROTOCOL_TCP || sz <= 0) {
+		return -1;
+	}
+	struct request_send request;
+	request.id = id;
+	struct socket_lock l;
+	socket_lock_init(s, &l);
+	// a direct write of another thread may be in progress
+	socket_lock(&l);
+	int n = 0;
+	if (nomore_sending_data(s)) {
+		n = (int)socket_write(s->fd, buffer, sz);
+		if (n < 0) {
+			n = 0;
+		}
+		stat_write(ss, s, n);
+		SOCKET_PROBE4(write, s->id, s->fd, n, sz - n);
+	}
+	int ret = 0;
+	if (n < sz) {
+		struct socket_message result;
+		request.sz = sz - n;
+		request.buffer = (char*)MALLOC(request.sz);
+		memcpy(request.buffer, (const char*)buffer + n, request.sz);
+		send_socket(ss, &request, &result, PRIORITY_HIGH, NULL);
+	}
+	if (s->wb_size >= WARNING_SIZE) {
+		ret = (int)((s->wb_size + 1023) / 1024);
+	}
+	socket_unlock(&l);
+	return ret;
+}
+
+// buffer and id are copied into one shared payload, the fan-out is a single ctrl command.
+// return -1 when error, 0 when success
+int
+socket_server_broadcast(struct socket_server *ss, const int * id, int n, const void * buffer, int sz) {
+	if (n <= 0 || sz <= 0) {
+		return -1;
+	}
+	struct shared_payload * p = (struct shared_payload*)MALLOC(sizeof(*p) + n * sizeof(int) + sz + n);
+	if (!p) {
+		return -1;
+	}
+	p->ref = 1;
+	p->sz = sz;
+	p->n = n;
+	p->id = (int*)(p + 1);
+	p->data = (char*)(p->id + n);
+	p->taken = (uint8_t*)(p->data + sz);
+	memcpy(p->id, id, n * sizeof(int));
+	memcpy(p->data, buffer, sz);
+	int i;
+	for (i = 0; i < n; i++) {
+		p->taken[i] = (uint8_t)inc_sending_ref(&ss->slot[HASH_ID(id[i])], id[i]);
+	}
+
+	struct request_package request = {0};
+	request.u.broadcast.payload = p;
+	send_request(ss, &request, 'M', sizeof(request.u.broadcast));
+	return 0;
+}
+
+#ifdef HAVE_UNIX_SOCKET
+// passfd is duplicated, the caller keeps its own. Needs SOCKET_OPT_PASSFD on the socket:
+// on unix sockets only, and a peer without it would read the carrier byte as data.
+// return -1 when error, 0 when success
+int
+socket_server_sendfd(struct socket_server *ss, int id, int passfd) {
+	struct socket * s = &ss->slot[HASH_ID(id)];
+	if (s->id != id || s->type == SOCKET_TYPE_INVALID || !s->passfd) {
+		return -1;
+	}
+	int * buffer = (int *)MALLOC(sizeof(int));
+	if (!buffer) {
+		return -1;
+	}
+	*buffer = socket_dup(passfd);
+	if (*buffer < 0) {
+		FREE(buffer);
+		return -1;
+	}
+	struct request_package request = {0};
+	request.u.send.id = id;
+	request.u.send.sz = 1;	// the byte that carries it, see socket_sendfd
+	request.u.send.buffer = (char *)buffer;
+	request.u.send.ref = inc_sending_ref(s, id);
+	send_request(ss, &request, 'F', sizeof(request.u.send));
+	return 0;
+}
+#endif
+
+// read from the caller thread, the socket thread never changes an option on its own.
+// Under dw_lock, which force_close holds to close s->fd: the fd read is still the one of id.
+int
+socket_server_getopt(struct socket_server *ss, int id, int what, int *value) {
+	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket_lock l;
+	socket_lock_init(s, &l);
+	socket_lock(&l);
+	int r = 0;
+	if (s->id != id || s->type == SOCKET_TYPE_INVALID || s->type == SOCKET_TYPE_RESERVE) {
+		r = -1;
+	} else if (what == SOCKET_OPT_RECV_CHUNK) {
+		*value = s->rchunk_size;
+	} else if (what == SOCKET_OPT_PASSFD) {
+		*value = s->passfd;
+	} else {
+		r = socket_option_get(s->fd, what, value);
+	}
+	socket_unlock(&l);
+	return r;
+}
 
-	send_request(ss, &request, 'D', sizeof(request.u.send));
-	//return 0;
-	return 1;
+void
+socket_server_chunk_release(void * chunk) {
+	recv_chunk_release((struct recv_chunk *)chunk);
 }
 
 // return -1 when error, 0 when success
@@ -1727,12 +3787,11 @@ socket_server_send_lowpriority(struct socket_server *ss, int id, const void * bu
 		return -1;
 	}
 
-	inc_sending_ref(s, id);
-
 	struct request_package request = {0};
 	request.u.send.id = id;
 	request.u.send.sz = sz;
 	request.u.send.buffer = (char *)buffer;
+	request.u.send.ref = inc_sending_ref(s, id);
 
 	send_request(ss, &request, 'P', sizeof(request.u.send));
 	return 0;
@@ -1744,9 +3803,63 @@ socket_server_exit(struct socket_server *ss) {
 	send_request(ss, &request, 'X', 0);
 }
 
+// the last seconds of the flight recorder of ss into path, see socket_flight.h
+int
+socket_server_flight_dump(struct socket_server *ss, const char *path, int seconds) {
+	int fd = socket_file_create(path);
+	if (fd < 0) {
+		return -1;
+	}
+	int r = flight_dump(ss, fd, socket_clock_ns(), seconds);
+	socket_close(fd);
+	return r;
+}
+
+// On signo the handler itself writes every socket server into path: a socket thread
+// that is stuck is dumped too. The file is replaced at each signal.
+int
+socket_server_flight_signal(int signo, const char *path, int seconds) {
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+	return -1;
+#else
+	if (strlen(path) >= sizeof(flight_path)) {
+		return -1;
+	}
+	strcpy(flight_path, path);
+	flight_seconds = seconds;
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = flight_signal;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	return sigaction(signo, &sa, NULL);
+#endif
+}
+
+
+#ifdef HAVE_UNIX_SOCKET
+// A socket file at the path is replaced, it is what a previous run left behind.
+// Other files are not touched.
+static int
+do_bind_unix(struct sockaddr_un *un, socklen_t len, int protocol) {
+	int fd = (int)socket(AF_UNIX, protocol == IPPROTO_TCP ? SOCK_STREAM : SOCK_DGRAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	struct stat st;
+	if (un->sun_path[0] != '\0' && stat(un->sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(un->sun_path);
+	}
+	if (bind(fd, (struct sockaddr *)un, len) != 0) {
+		socket_close(fd);
+		return -1;
+	}
+	return fd;
+}
+#endif
 
 // return -1 means failed
-// or return AF_INET or AF_INET6
+// or return AF_INET, AF_INET6 or AF_UNIX (host is a path, see unix_address)
 static int
 do_bind(const char *host, int port, int protocol, int *family) {
 	int fd;
@@ -1755,6 +3868,15 @@ do_bind(const char *host, int port, int protocol, int *family) {
 	struct addrinfo ai_hints;
 	struct addrinfo *ai_list = NULL;
 	char portstr[16];
+#ifdef HAVE_UNIX_SOCKET
+	struct sockaddr_un un;
+	socklen_t unlen = 0;
+	int isunix = unix_address(host, &un, &unlen);
+	if (isunix != 0) {
+		*family = AF_UNIX;
+		return isunix < 0 ? -1 : do_bind_unix(&un, unlen, protocol);
+	}
+#endif
 	if (host == NULL || host[0] == 0) {
 		host = "0.0.0.0";	// INADDR_ANY
 	}
@@ -1795,12 +3917,15 @@ _failed_fd:
 }
 
 static int
-do_listen(const char * host, int port, int backlog) {
+do_listen(const char * host, int port, int backlog, const struct socket_option *option) {
 	int family = 0;
 	int listen_fd = do_bind(host, port, IPPROTO_TCP, &family);
 	if (listen_fd < 0) {
 		return -1;
 	}
+	if (option && option->mask) {
+		socket_option_apply(listen_fd, option);
+	}
 	if (listen(listen_fd, backlog) == -1) {
 		socket_close(listen_fd);
 		return -1;
@@ -1863,6 +3988,9 @@ socket_server_udp_send(struct socket_server *ss, int id, const struct socket_udp
 	case PROTOCOL_UDPv6:
 		addrsz = 1+2+16;	// 1 type, 2 port, 16 ipv6
 		break;
+	case PROTOCOL_UNIX:
+		addrsz = 1;
+		break;
 	default:
 		free_buffer(ss, buffer, sz);
 		return -1;
@@ -1884,7 +4012,7 @@ socket_server_udp_send(struct socket_server *ss, int id, const struct socket_udp
 				so.free_func((void *)buffer);
 				return -1;
 			}
-			int n = sendto(s->fd, (char*)so.buffer, so.sz, 0, &sa.s, sasz);
+			int n = udp_sendto(s->fd, so.buffer, so.sz, &sa, sasz);
 			if (n >= 0) {
 				// sendto succ
 				stat_write(ss,s,n);
@@ -1914,6 +4042,14 @@ socket_server_udp_connect(struct socket_server *ss, int id, const char * addr, i
 	if (s->id != id || s->type == SOCKET_TYPE_INVALID) {
 		return -1;
 	}
+#ifdef HAVE_UNIX_SOCKET
+	struct sockaddr_un un;
+	socklen_t unlen = 0;
+	int isunix = unix_address(addr, &un, &unlen);
+	if (isunix < 0) {
+		return -1;
+	}
+#endif
 	struct socket_lock l;
 	socket_lock_init(s, &l);
 	socket_lock(&l);
@@ -1923,6 +4059,19 @@ socket_server_udp_connect(struct socket_server *ss, int id, const char * addr, i
 	}
 	ATOM_INC(&s->udpconnecting);
 	socket_unlock(&l);
+#ifdef HAVE_UNIX_SOCKET
+	if (isunix) {
+		// type, length, then the sockaddr_un, connected on the socket thread
+		struct request_package request = {0};
+		request.u.set_udp.id = id;
+		request.u.set_udp.address[0] = PROTOCOL_UNIX;
+		request.u.set_udp.address[1] = (uint8_t)unlen;
+		int offset = (int)offsetof(struct request_setudp, address) + 2;
+		memcpy(request.u.buffer + offset, &un, unlen);
+		send_request(ss, &request, 'C', offset + unlen);
+		return 0;
+	}
+#endif
 
 	int status;
 	struct addrinfo ai_hints;
@@ -1967,12 +4116,54 @@ socket_server_udp_address(struct socket_server *ss, struct socket_message *msg,
 	case PROTOCOL_UDPv6:
 		*addrsz = 1+2+16;
 		break;
+	case PROTOCOL_UNIX:
+		*addrsz = 1;
+		break;
 	default:
 		return NULL;
 	}
 	return (const struct socket_udp_address *)address;
 }
 
+#ifdef OPENSOCKET_BENCH
+#include "socket_bench.h"
+
+int
+socket_bench_reserve_id(struct socket_server *ss) {
+	return reserve_id(ss);
+}
+
+void
+socket_bench_release_id(struct socket_server *ss, int id) {
+	release_id(ss, id);
+}
+
+void
+socket_bench_ctrl(struct socket_server *ss) {
+	struct request_package request;
+	memset(&request, 0, sizeof(request));
+	request.u.setopt.id = -1;
+	struct socket_message result;
+	send_request(ss, &request, 'T', sizeof(request.u.setopt));
+	ctrl_cmd(ss, &result);
+}
+
+void
+socket_bench_connected(struct socket_server *ss, int id) {
+	ss->slot[HASH_ID(id)].type = SOCKET_TYPE_CONNECTED;
+}
+
+struct spinlock *
+socket_bench_dw_lock(struct socket_server *ss, int id) {
+	return &ss->slot[HASH_ID(id)].dw_lock;
+}
+
+int
+socket_bench_sent(struct socket_server *ss, int id) {
+	return nomore_sending_data(&ss->slot[HASH_ID(id)]);
+}
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -1981,6 +4172,7 @@ socket_server_udp_address(struct socket_server *ss, struct socket_message *msg,
 #include "opensocket.h"
 #include <time.h>
 #include <map>
+#include <utility>
 
 #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
 #ifdef __cplusplus
@@ -2018,36 +4210,88 @@ static int pthread_create(pthread_t* thread, const pthread_attr_t* attr, void* (
 #include<arpa/inet.h>
 #endif
 
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+#include "socket_affinity.h"
+
 namespace open
 {
 
+//tid 0 is the calling thread. Empty vectCpu allows every cpu again.
+static bool ApplyAffinity(int tid, const std::vector<int>& vectCpu)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	SocketCpuSet(&set, vectCpu);
+	return sched_setaffinity(tid, sizeof(set), &set) == 0;
+#else
+	(void)tid;
+	(void)vectCpu;
+	return false;
+#endif
+}
+
 OpenSocket::Msg::Msg()
 	:type_(ESocketClose)
 	, fd_(0)
 	, uid_(0)
+	, context_(0)
 	, ud_(0)
 	, buffer_(0)
 	, size_(0)
 	, option_(0)
+	, chunk_(0)
+	, ready_(0)
+	, forward_(0)
 {
 }
 
 OpenSocket::Msg::~Msg()
 {
-	if (buffer_)
+	if (chunk_)
+	{
+		socket_server_chunk_release(chunk_);
+	}
+	else if (buffer_)
 	{
 		free(buffer_);
 	}
 }
 
+void OpenSocket::Msg::swap(Msg& that)
+{
+	std::swap(type_, that.type_);
+	std::swap(fd_, that.fd_);
+	std::swap(uid_, that.uid_);
+	std::swap(context_, that.context_);
+	std::swap(ud_, that.ud_);
+	std::swap(buffer_, that.buffer_);
+	std::swap(size_, that.size_);
+	std::swap(option_, that.option_);
+	std::swap(chunk_, that.chunk_);
+	std::swap(ready_, that.ready_);
+	std::swap(forward_, that.forward_);
+}
+
 OpenSocket::OpenSocket()
 	:socket_server_(0)
 {
 	cb_ = 0;
+	cbRef_ = 0;
 	isRunning_ = false;
 	isClose_ = true;
-	socket_server_ = (void*)socket_server_create(time(NULL));
+	tid_ = 0;
+	colocateCb_ = 0;
+	colocateThreshold_ = 1024;
+	socket_server_ = (void*)socket_server_create(ClockMs());
 	assert(socket_server_);
+	if (socket_server_)
+	{
+		((struct socket_server*)socket_server_)->inline_cb = &OpenSocket::InlineMsg;
+		((struct socket_server*)socket_server_)->inline_ud = this;
+	}
 }
 
 OpenSocket::~OpenSocket()
@@ -2056,7 +4300,8 @@ OpenSocket::~OpenSocket()
 	{
 		if (isRunning_)
 		{
-			socket_server_close((struct socket_server*)socket_server_);
+			//closing the poll fd does not wake a blocked epoll_wait, ask the thread to exit.
+			socket_server_exit((struct socket_server*)socket_server_);
 			isRunning_ = false;
 			while (!isClose_)
 			{
@@ -2086,6 +4331,29 @@ bool OpenSocket::run(void (*cb)(const Msg*))
 		return false;
 	}
 	cb_ = cb;
+	cbRef_ = 0;
+	return startThread();
+}
+
+bool OpenSocket::run(void (*cb)(Msg&))
+{
+	if (!cb)
+	{
+		assert(false);
+		return false;
+	}
+	if (isRunning_)
+	{
+		assert(false);
+		return false;
+	}
+	cb_ = 0;
+	cbRef_ = cb;
+	return startThread();
+}
+
+bool OpenSocket::startThread()
+{
 	pthread_t thread;
 	int ret = pthread_create(&thread, NULL, &OpenSocket::ThreadSocket, this);
 	if (ret != 0)
@@ -2122,6 +4390,14 @@ void* OpenSocket::ThreadSocket(void* p)
 	prctl(PR_SET_NAME, (unsigned long)"OpenSocket");
 #endif
 #endif
+	//pin before the first read buffer is allocated, first touch then keeps them on the local node.
+	//Under affinityMutex_, a setAffinity() of the moment applies its mask after this one.
+	that->affinityMutex_.lock();
+#ifdef __linux__
+	that->tid_ = (int)syscall(SYS_gettid);
+#endif
+	if (!that->vectCpu_.empty()) ApplyAffinity(0, that->vectCpu_);
+	that->affinityMutex_.unlock();
 	that->isRunning_ = true;
 	that->isClose_ = false;
 	int r = 0;
@@ -2131,17 +4407,74 @@ void* OpenSocket::ThreadSocket(void* p)
 		if (r == 0) break;
 	}
 	that->isClose_ = true;
+	that->affinityMutex_.lock();
+	that->tid_ = 0;
+	that->affinityMutex_.unlock();
 	return 0;
 }
 
+bool OpenSocket::setAffinity(const std::vector<int>& vectCpu)
+{
+	std::lock_guard<std::mutex> lock(affinityMutex_);
+	vectCpu_ = vectCpu;
+	if (tid_ <= 0) return true;
+	return ApplyAffinity(tid_, vectCpu_);
+}
+
+void OpenSocket::setColocate(void (*cb)(uintptr_t uid, int cpu), size_t threshold)
+{
+	colocateThreshold_ = threshold > 0 ? threshold : 1;
+	colocateCb_ = cb;
+}
+
+void OpenSocket::setTrace(bool trace)
+{
+	struct socket_server* ss = (struct socket_server*)socket_server_;
+	if (ss) ss->trace = trace ? 1 : 0;
+}
+
+bool OpenSocket::dumpFlight(const std::string& path, int seconds)
+{
+	struct socket_server* ss = (struct socket_server*)socket_server_;
+	if (!ss) return false;
+	return socket_server_flight_dump(ss, path.c_str(), seconds) == 0;
+}
+
+bool OpenSocket::DumpFlightOnSignal(int signo, const std::string& path, int seconds)
+{
+	return socket_server_flight_signal(signo, path.c_str(), seconds) == 0;
+}
+
+//counted in the slot of the socket, reset with it: no lookup, and nothing left to count once fired.
+void OpenSocket::colocate(int fd, uintptr_t uid)
+{
+	struct socket_server* ss = (struct socket_server*)socket_server_;
+	struct socket* s = &ss->slot[HASH_ID(fd)];
+	if (s->id != fd || s->dispatched >= colocateThreshold_) return;
+	if (++s->dispatched < colocateThreshold_) return;
+#ifdef __linux__
+	int cpu = sched_getcpu();
+	if (cpu >= 0 && colocateCb_) colocateCb_(uid, cpu);
+#endif
+}
+
 void OpenSocket::forwardMsg(EMsgType type, bool padding, struct socket_message* result)
 {
-	if (!cb_) return;
-	Msg* msg = new Msg;
+	if (!cb_ && !cbRef_) return;
+	if (colocateCb_) colocate(result->id, result->opaque);
+	Msg stackMsg;
+	Msg* msg = cb_ ? new Msg : &stackMsg;
 	msg->type_ = type;
 	msg->fd_ = result->id;
 	msg->ud_ = result->ud;
 	msg->uid_ = result->opaque;
+	msg->context_ = result->context;
+	struct socket_server* ss = (struct socket_server*)socket_server_;
+	if (ss->trace) {
+		// 0 until the first batch after setTrace(true)
+		msg->ready_ = ss->ready;
+		msg->forward_ = trace_now();
+	}
 	if (padding) {
 		if (result->data) {
 			size_t msg_sz = strlen(result->data);
@@ -2163,13 +4496,17 @@ void OpenSocket::forwardMsg(EMsgType type, bool padding, struct socket_message*
 	}
 	else {
 		msg->buffer_ = result->data;
+		msg->chunk_ = result->chunk;
 		msg->size_ = result->ud;
 		if (msg->type_ == ESocketUdp) {
 			msg->option_ = msg->buffer_ + msg->ud_;
 		}
 		msg->ud_ = 0;
 	}
-	cb_(msg);
+	if (cb_)
+		cb_(msg);
+	else
+		cbRef_(stackMsg);
 }
 
 int OpenSocket::poll()
@@ -2178,6 +4515,8 @@ int OpenSocket::poll()
 	assert(ss);
 	int more = 1;
 	struct socket_message result;
+	result.context = 0;
+	result.chunk = 0;
 	int type = socket_server_poll(ss, &result, &more);
 	switch (type)
 	{
@@ -2204,6 +4543,9 @@ int OpenSocket::poll()
 	case SOCKET_WARNING:
 		forwardMsg(ESocketWarning, false, &result);
 		break;
+	case SOCKET_FD:
+		forwardMsg(ESocketFd, true, &result);
+		break;
 	default:
 		if (type != -1) {
 			fprintf(stderr, "Unknown socket message type %d.\n", type);
@@ -2234,20 +4576,118 @@ int OpenSocket::sendLowpriority(int fd, const void* buffer, int sz)
 	return socket_server_send_lowpriority(ss, fd, sbuffer, sz);
 }
 
+int OpenSocket::broadcast(const int* fds, int n, const void* buffer, int sz)
+{
+	struct socket_server* ss = (struct socket_server*)socket_server_;
+	return socket_server_broadcast(ss, fds, n, buffer, sz);
+}
+
+int OpenSocket::sendInline(int fd, const void* buffer, int sz)
+{
+	struct socket_server* ss = (struct socket_server*)socket_server_;
+	return socket_server_send_inline(ss, fd, buffer, sz);
+}
+
+void OpenSocket::setInline(int fd, InlineHandler handler)
+{
+	struct socket_server* ss = (struct socket_server*)socket_server_;
+	struct request_package request = {0};
+	request.u.inline_.id = fd;
+	request.u.inline_.handler = (void*)handler;
+	send_request(ss, &request, 'I', sizeof(request.u.inline_));
+}
+
+void OpenSocket::InlineMsg(void* ud, void* handler, struct socket_message* result)
+{
+	OpenSocket* that = (OpenSocket*)ud;
+	Msg msg;
+	msg.type_ = ESocketData;
+	msg.fd_ = result->id;
+	msg.uid_ = result->opaque;
+	msg.context_ = result->context;
+	msg.buffer_ = result->data;
+	msg.size_ = result->ud;
+	((InlineHandler)handler)(*that, msg);
+	msg.buffer_ = 0;
+}
+
+int OpenSocket::sendv(int fd, const struct iovec* iov, int count)
+{
+	struct socket_server* ss = (struct socket_server*)socket_server_;
+	return socket_server_sendv(ss, fd, iov, count);
+}
+
+int OpenSocket::sendvLowpriority(int fd, const struct iovec* iov, int count)
+{
+	int sz = 0;
+	for (int i = 0; i < count; i++) sz += (int)iov[i].iov_len;
+	if (sz <= 0) return 0;
+	char* sbuffer = copy_iovec(iov, count, 0, sz);
+	if (!sbuffer) return -1;
+	struct socket_server* ss = (struct socket_server*)socket_server_;
+	return socket_server_send_lowpriority(ss, fd, sbuffer, sz);
+}
+
 void OpenSocket::nodelay(int fd)
 {
+	setOption(fd, EOptionNodelay, 1);
+}
+
+static_assert(sizeof(OpenSocket::Option) == sizeof(struct socket_option) && OpenSocket::EOptionMax == SOCKET_OPT_MAX,
+	"OpenSocket::Option must match struct socket_option");
+
+int OpenSocket::setOption(int fd, EOption option, int value)
+{
+	if (option < 0 || option >= EOptionMax || socket_option_name[option].level == -1) {
+		return -1;
+	}
 	struct socket_server* ss = (struct socket_server*)socket_server_;
+	struct socket* s = &ss->slot[HASH_ID(fd)];
+	if (s->id != fd || s->type == SOCKET_TYPE_INVALID) {
+		return -1;
+	}
 	struct request_package request = {0};
 	request.u.setopt.id = fd;
-	request.u.setopt.what = TCP_NODELAY;
-	request.u.setopt.value = 1;
+	request.u.setopt.what = option;
+	request.u.setopt.value = value;
 	send_request(ss, &request, 'T', sizeof(request.u.setopt));
+	return 0;
+}
+
+bool OpenSocket::getOption(int fd, EOption option, int& value)
+{
+	struct socket_server* ss = (struct socket_server*)socket_server_;
+	return socket_server_getopt(ss, fd, option, &value) == 0;
+}
+
+int OpenSocket::listen(uintptr_t uid, const std::string& host, int port, int backlog, const Option* option)
+{
+	struct socket_server* ss = (struct socket_server*)socket_server_;
+	int fd = do_listen(host.c_str(), port, backlog, (const struct socket_option*)option);
+	if (fd < 0) {
+		return -1;
+	}
+	struct request_package request = {0};
+	int id = reserve_id(ss);
+	if (id < 0) {
+		socket_close(fd);
+		return id;
+	}
+	request.u.listen.opaque = uid;
+	request.u.listen.id = id;
+	request.u.listen.fd = fd;
+	if (option) {
+		memcpy(&request.u.listen.option, option, sizeof(request.u.listen.option));
+	}
+	send_request(ss, &request, 'L', sizeof(request.u.listen));
+	return id;
 }
 
-int OpenSocket::listen(uintptr_t uid, const std::string& host, int port, int backlog)
+int OpenSocket::listenShm(uintptr_t uid, const std::string& name, int ringSize)
 {
+#ifdef __linux__
 	struct socket_server* ss = (struct socket_server*)socket_server_;
-	int fd = do_listen(host.c_str(), port, backlog);
+	int fd = do_listen_shm(name.c_str(), 64);
 	if (fd < 0) {
 		return -1;
 	}
@@ -2260,22 +4700,89 @@ int OpenSocket::listen(uintptr_t uid, const std::string& host, int port, int bac
 	request.u.listen.opaque = uid;
 	request.u.listen.id = id;
 	request.u.listen.fd = fd;
+	request.u.listen.protocol = PROTOCOL_SHM;
+	request.u.listen.ring = ringSize;
 	send_request(ss, &request, 'L', sizeof(request.u.listen));
 	return id;
+#else
+	return -1;
+#endif
+}
+
+int OpenSocket::connectShm(uintptr_t uid, const std::string& name, uintptr_t context)
+{
+#ifdef __linux__
+	struct socket_server* ss = (struct socket_server*)socket_server_;
+	int fd = do_connect_shm(name.c_str());
+	if (fd < 0) {
+		return -1;
+	}
+	struct request_package request = {0};
+	int id = reserve_id(ss);
+	if (id < 0) {
+		socket_close(fd);
+		return id;
+	}
+	request.u.bind.opaque = uid;
+	request.u.bind.context = context;
+	request.u.bind.id = id;
+	request.u.bind.fd = fd;
+	send_request(ss, &request, 'H', sizeof(request.u.bind));
+	return id;
+#else
+	return -1;
+#endif
+}
+
+int OpenSocket::connect(uintptr_t uid, const std::string& host, int port, uintptr_t context, const Option* option)
+{
+	struct socket_server* ss = (struct socket_server*)socket_server_;
+	struct request_package request;
+	int len = open_request(ss, &request, uid, context, (const struct socket_option*)option, host.c_str(), port, NULL);
+	if (len < 0)
+		return -1;
+	send_request(ss, &request, 'O', sizeof(request.u.open) + len);
+	return request.u.open.id;
+}
+
+int OpenSocket::connectFrom(uintptr_t uid, const std::string& host, int port, const std::string& local,
+	uintptr_t context, const Option* option)
+{
+	if (local.empty()) {
+		return connect(uid, host, port, context, option);
+	}
+	struct socket_server* ss = (struct socket_server*)socket_server_;
+	struct request_package request;
+	int len = open_request(ss, &request, uid, context, (const struct socket_option*)option, host.c_str(), port, local.c_str());
+	if (len < 0)
+		return -1;
+	send_request(ss, &request, 'O', sizeof(request.u.open) + len);
+	return request.u.open.id;
 }
 
-int OpenSocket::connect(uintptr_t uid, const std::string& host, int port)
+int OpenSocket::connect(uintptr_t uid, const std::string& host, int port, const void* buffer, int sz,
+	uintptr_t context, const Option* option)
 {
+	if (!buffer || sz <= 0) {
+		return connect(uid, host, port, context, option);
+	}
 	struct socket_server* ss = (struct socket_server*)socket_server_;
 	struct request_package request;
-	int len = open_request(ss, &request, uid, host.c_str(), port);
+	int len = open_request(ss, &request, uid, context, (const struct socket_option*)option, host.c_str(), port, NULL);
 	if (len < 0)
 		return -1;
+	request.u.open.buffer = (char*)malloc(sz);
+	if (!request.u.open.buffer) {
+		release_id(ss, request.u.open.id);
+		return -1;
+	}
+	memcpy(request.u.open.buffer, buffer, sz);
+	request.u.open.sz = sz;
 	send_request(ss, &request, 'O', sizeof(request.u.open) + len);
 	return request.u.open.id;
 }
 
-int OpenSocket::bind(uintptr_t uid, int fd)
+int OpenSocket::bind(uintptr_t uid, int fd, uintptr_t context)
 {
 	struct socket_server* ss = (struct socket_server*)socket_server_;
 	struct request_package request = {0};
@@ -2283,6 +4790,7 @@ int OpenSocket::bind(uintptr_t uid, int fd)
 	if (id < 0)
 		return -1;
 	request.u.bind.opaque = uid;
+	request.u.bind.context = context;
 	request.u.bind.id = id;
 	request.u.bind.fd = fd;
 	send_request(ss, &request, 'B', sizeof(request.u.bind));
@@ -2309,15 +4817,26 @@ void OpenSocket::shutdown(uintptr_t uid, int fd)
 	send_request(ss, &request, 'K', sizeof(request.u.close));
 }
 
-void OpenSocket::start(uintptr_t uid, int fd)
+void OpenSocket::start(uintptr_t uid, int fd, uintptr_t context)
 {
 	struct socket_server* ss = (struct socket_server*)socket_server_;
 	struct request_package request = {0};
 	request.u.start.id = fd;
 	request.u.start.opaque = uid;
+	request.u.start.context = context;
 	send_request(ss, &request, 'S', sizeof(request.u.start));
 }
 
+int OpenSocket::sendFd(int fd, int passFd)
+{
+#ifdef HAVE_UNIX_SOCKET
+	struct socket_server* ss = (struct socket_server*)socket_server_;
+	return socket_server_sendfd(ss, fd, passFd);
+#else
+	return -1;
+#endif
+}
+
 int OpenSocket::udp(uintptr_t uid, const char* addr, int port)
 {
 	struct socket_server* ss = (struct socket_server*)socket_server_;
@@ -2372,6 +4891,14 @@ int OpenSocket::UDPAddress(const char* address, std::string& ip , int& po)
 static int getname(union sockaddr_all* u, std::string& name) 
 {
 	char tmp[INET6_ADDRSTRLEN];
+#ifdef HAVE_UNIX_SOCKET
+	if (u->s.sa_family == AF_UNIX) {
+		char path[sizeof(u->un.sun_path) + 1];
+		getname(u, path, sizeof(path));
+		name = path;
+		return 1;
+	}
+#endif
 	void* sin_addr = (u->s.sa_family == AF_INET) ? (void*)&u->v4.sin_addr : (void*)&u->v6.sin6_addr;
 	int sin_port = ntohs((u->s.sa_family == AF_INET) ? u->v4.sin_port : u->v6.sin6_port);
 	char buffer[256] = {};
@@ -2407,6 +4934,24 @@ static int query_info(struct socket* s, OpenSocket::Info& info)
 			if (getpeername(s->fd, &u.s, &slen) == 0) {
 				getname(&u, info.name_);
 			}
+#ifdef TCPI_OPT_SYN_DATA
+			{
+				struct tcp_info ti;
+				socklen_t tlen = sizeof(ti);
+				if (getsockopt(s->fd, IPPROTO_TCP, TCP_INFO, &ti, &tlen) == 0) {
+					info.fastopen_ = (ti.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+					info.rtt_ = ti.tcpi_rtt;
+					info.rttvar_ = ti.tcpi_rttvar;
+					info.retrans_ = ti.tcpi_total_retrans;
+					info.cwnd_ = ti.tcpi_snd_cwnd;
+					info.unacked_ = ti.tcpi_unacked;
+				}
+			}
+#endif
+		}
+		else if (s->protocol == PROTOCOL_SHM) {
+			info.type_ = OpenSocket::EInfoShm;
+			info.name_ = "shm";
 		}
 		else {
 			info.type_ = OpenSocket::EInfoUdp;
@@ -2420,11 +4965,14 @@ static int query_info(struct socket* s, OpenSocket::Info& info)
 	}
 	info.id_ = s->id;
 	info.opaque_ = (uint64_t)s->opaque;
-	info.read_ = s->stat.read;
-	info.write_ = s->stat.write;
-	info.rtime_ = s->stat.rtime;
-	info.wtime_ = s->stat.wtime;
+	info.read_ = s->rstat.bytes;
+	info.write_ = s->wstat.bytes;
+	info.rtime_ = s->rstat.time;
+	info.wtime_ = s->wstat.time;
 	info.wbuffer_ = s->wb_size;
+	info.lock_ = s->dw_lock.acquire;
+	info.lockSpin_ = s->dw_lock.spin;
+	info.lockPark_ = s->dw_lock.park;
 	return 1;
 }
 
@@ -2487,6 +5035,11 @@ void OpenSocket::socketInfo(std::vector<Info>& vectInfo)
 	}
 }
 
+uint64_t OpenSocket::ClockMs()
+{
+	return (uint64_t)(socket_clock_ns() / 1000000);
+}
+
 void OpenSocket::Sleep(int64_t milliSecond)
 {
 #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
@@ -2506,6 +5059,16 @@ void OpenSocket::Start(void (*cb)(const Msg*))
 	Instance_.run(cb);
 }
 
+void OpenSocket::Start(void (*cb)(Msg&))
+{
+	if (Instance_.isRunning())
+	{
+		assert(false);
+		return;
+	}
+	Instance_.run(cb);
+}
+
 OpenSocket OpenSocket::Instance_;
 
 };
\ No newline at end of file
@@ -4,10 +4,28 @@
 #include <stdint.h>
 #include <string>
 #include <vector>
+#include <map>
+#include <mutex>
+
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+#ifndef OPEN_IOVEC
+#define OPEN_IOVEC
+struct iovec {
+	void* iov_base;
+	size_t iov_len;
+};
+#endif
+#else
+#include <sys/uio.h>
+#endif
 
 
 #define UDP_ADDRESS_SIZE 19	// ipv6 128bit + port 16bit + 1 byte type
 
+#ifdef OPENSOCKET_BENCH
+struct socket_server;
+#endif
+
 namespace open
 {
 
@@ -23,6 +41,8 @@ public:
 		ESocketError,
 		ESocketUdp,
 		ESocketWarning,
+		//ud_ is a descriptor from sendFd() of the peer, the receiver owns it.
+		ESocketFd,
 	};
 	class Msg
 	{
@@ -30,16 +50,31 @@ public:
 		EMsgType type_;
 		int fd_;
 		uintptr_t uid_;
+		//what start/bind/connect attached to fd_, 0 if nothing.
+		uintptr_t context_;
 		int ud_;
 		char* buffer_;
 		size_t size_;
 		char* option_;
+		//buffer_ is a slice of a receive chunk (EOptionRecvChunk), released with the Msg.
+		void* chunk_;
+		//setTrace(true) only, steady_clock nanoseconds: ready_ when the socket thread saw
+		//the event (epoll_wait returned) or read the request that produced the message
+		//(open, close, error of connect/listen/close), forward_ when the callback was
+		//entered. 0 otherwise.
+		int64_t ready_;
+		int64_t forward_;
 
 		inline const char* info() const { return buffer_; }
 		inline const char* data() const { return buffer_; }
 		inline size_t size() const { return size_; }
+		//exchange contents, a Msg owns buffer_ so it is moved, never copied.
+		void swap(Msg& that);
 		Msg();
 		~Msg();
+	private:
+		Msg(const Msg&);
+		void operator=(const Msg&);
 	};
 	enum EInfoType
 	{
@@ -47,7 +82,8 @@ public:
 		EInfoListen,
 		EInfoTcp,
 		EInfoUdp,
-		EInfoBing
+		EInfoBing,
+		EInfoShm
 	};
 	struct Info 
 	{
@@ -56,9 +92,26 @@ public:
 		uint64_t opaque_;
 		uint64_t read_;
 		uint64_t write_;
+		//last read/write, ClockMs() of the socket thread's loop iteration.
 		uint64_t rtime_;
 		uint64_t wtime_;
 		int64_t wbuffer_;
+		//data in the SYN was accepted (TCP Fast Open). Linux only.
+		bool fastopen_;
+		//TCP_INFO of a tcp connection, Linux only, 0 elsewhere: smoothed rtt and its
+		//variance in microseconds, retransmitted segments since the connection opened,
+		//congestion window and segments in flight not acknowledged yet.
+		uint32_t rtt_;
+		uint32_t rttvar_;
+		uint32_t retrans_;
+		uint32_t cwnd_;
+		uint32_t unacked_;
+		//lock of the direct writes, taken by the sending threads and the socket thread:
+		//acquisitions, pause rounds spent waiting for it, and sleeps on it.
+		//Spins or sleeps growing with lock_ mean threads contend for this socket.
+		uint64_t lock_;
+		uint64_t lockSpin_;
+		uint64_t lockPark_;
 		std::string name_;
 		Info() :id_(0),
 		opaque_(0),
@@ -67,6 +120,15 @@ public:
 		rtime_(0),
 		wtime_(0),
 		wbuffer_(0),
+		fastopen_(false),
+		rtt_(0),
+		rttvar_(0),
+		retrans_(0),
+		cwnd_(0),
+		unacked_(0),
+		lock_(0),
+		lockSpin_(0),
+		lockPark_(0),
 		type_(EInfoUnknow){}
 		void clear()
 		{
@@ -77,27 +139,131 @@ public:
 			rtime_  = 0;
 			wtime_  = 0;
 			wbuffer_ = 0;
+			fastopen_ = false;
+			rtt_ = 0;
+			rttvar_ = 0;
+			retrans_ = 0;
+			cwnd_ = 0;
+			unacked_ = 0;
+			lock_ = 0;
+			lockSpin_ = 0;
+			lockPark_ = 0;
 			type_ = EInfoUnknow;
 			name_.clear();
 		}
 	};
+	enum EOption
+	{
+		EOptionNodelay,
+		EOptionSndbuf,
+		EOptionRcvbuf,
+		EOptionQuickack,
+		EOptionNotsentLowat,
+		EOptionBusyPoll,
+		EOptionUserTimeout,
+		EOptionKeepalive,
+		EOptionKeepIdle,
+		EOptionKeepIntvl,
+		EOptionKeepCnt,
+		//TCP_FASTOPEN on a listener, value is the queue of pending fast open requests
+		EOptionFastOpen,
+		//reads go into a per-connection chunk of value bytes and are delivered as
+		//slices of it, no malloc per read. 0 turns it off. Not a kernel option.
+		EOptionRecvChunk,
+		//unix stream sockets: take descriptors sent with sendFd(), as ESocketFd.
+		//Both ends must turn it on: sendFd() fails without it, and a reader without it
+		//gets the byte that carried the descriptor as a '\0' in its data while the
+		//kernel drops the descriptor. Stays off on other sockets. Not a kernel option.
+		EOptionPassFd,
+		EOptionMax
+	};
+	//Socket defaults for listen()/connect(), applied before the handshake and,
+	//for a listener, to every accepted socket. No extra command round trip.
+	struct Option
+	{
+		uint32_t mask_;
+		int value_[EOptionMax];
+		Option() :mask_(0)
+		{
+			for (int i = 0; i < EOptionMax; i++) value_[i] = 0;
+		}
+		inline Option& set(EOption option, int value)
+		{
+			mask_ |= 1u << option;
+			value_[option] = value;
+			return *this;
+		}
+		inline void clear() { mask_ = 0; }
+	};
+	//Inline handler, runs on the socket thread for every ESocketData of its fd.
+	//msg.buffer_ is borrowed and reused after the call, copy what must be kept.
+	typedef void (*InlineHandler)(OpenSocket& openSocket, const Msg& msg);
+
 	OpenSocket();
 	~OpenSocket();
 
 	bool run(void (*cb)(const Msg*));
+	//cb gets a Msg that lives on the socket thread's stack, it must swap() out
+	//whatever it keeps. Saves the per-message new Msg.
+	bool run(void (*cb)(Msg&));
 	int send(int fd, const void* buffer, int sz);
 	int sendLowpriority(int fd, const void* buffer, int sz);
+	//Gather send, header + payload + trailer without a temporary. An idle socket is
+	//written with writev and nothing is copied; otherwise the segments are copied
+	//into one queued buffer. The low priority queue is never written directly.
+	int sendv(int fd, const struct iovec* iov, int count);
+	int sendvLowpriority(int fd, const struct iovec* iov, int count);
+	//Same bytes to n tcp sockets: one copy with a refcount and one control command
+	//for the whole fan-out. Sockets that can not take it are skipped.
+	int broadcast(const int* fds, int n, const void* buffer, int sz);
+	//Unix stream sockets: passFd goes to the peer (SCM_RIGHTS) in order with the
+	//data sent before and after. A duplicate is sent, the caller keeps passFd.
+	//-1 unless EOptionPassFd is on for fd, and the peer must have it on too.
+	//setOption() is applied by the socket thread: pass it in the Option of
+	//listen()/connect(), or wait until getOption() reports it.
+	int sendFd(int fd, int passFd);
+	//Only from an InlineHandler: writes at once, no control pipe round trip.
+	//-1 on error, 0 when sent or queued, n > 0 while n KB are queued for fd, past
+	//the threshold of ESocketWarning: the backpressure, the callback is not told.
+	int sendInline(int fd, const void* buffer, int sz);
+	//Data of fd goes to handler instead of run()'s callback, NULL switches back.
+	//Open, close and error messages still go to the callback.
+	void setInline(int fd, InlineHandler handler);
 	void nodelay(int fd);
+	//Applied on the socket thread. On a listener it is also inherited by the sockets
+	//accepted afterwards. -1 when the option does not exist on this platform or fd
+	//is not open.
+	int setOption(int fd, EOption option, int value);
+	bool getOption(int fd, EOption option, int& value);
 
-	//tcp part
-	int listen(uintptr_t uid, const std::string& host, int port, int backlog);
-	int connect(uintptr_t uid, const std::string& host, int port);
-	int bind(uintptr_t uid, int fd);
+	//tcp part. A host of "/path" or "@name" (abstract, Linux) is a unix stream
+	//socket instead, port is then ignored. A socket file at path is replaced.
+	int listen(uintptr_t uid, const std::string& host, int port, int backlog, const Option* option = 0);
+	//context is handed back as Msg::context_ in every message of the socket, so the
+	//owner needs no fd lookup. Keep it alive until ESocketClose/ESocketError arrives.
+	int connect(uintptr_t uid, const std::string& host, int port, uintptr_t context = 0, const Option* option = 0);
+	//Connect with initial data. It goes out in the SYN (TCP Fast Open) when the kernel
+	//has a cookie of the peer, otherwise right after the handshake, like a queued send().
+	int connect(uintptr_t uid, const std::string& host, int port, const void* buffer, int sz,
+		uintptr_t context = 0, const Option* option = 0);
+	//Connect from local, an address of this host, instead of the one the route picks.
+	//Ephemeral ports are per source address, several sources get past their limit.
+	int connectFrom(uintptr_t uid, const std::string& host, int port, const std::string& local,
+		uintptr_t context = 0, const Option* option = 0);
+	int bind(uintptr_t uid, int fd, uintptr_t context = 0);
 	void close(uintptr_t uid, int fd);
 	void shutdown(uintptr_t uid, int fd);
-	void start(uintptr_t uid, int fd);
+	void start(uintptr_t uid, int fd, uintptr_t context = 0);
 
-	//udp part
+	//shm part, Linux only. Same-host peers exchange bytes through a shared memory
+	//ring per direction; name is the rendezvous, an abstract unix socket that also
+	//carries the wakeups. Ids, start/send/close and messages are those of tcp.
+	int listenShm(uintptr_t uid, const std::string& name, int ringSize = 1 << 20);
+	int connectShm(uintptr_t uid, const std::string& name, uintptr_t context = 0);
+
+	//udp part. "/path" or "@name" binds a unix datagram socket ("@" alone: any free
+	//name). It only sends to the peer set by udpConnect(); the address of an
+	//ESocketUdp from it stands for that peer.
 	int udp(uintptr_t uid, const char* addr, int port);
 	int udpConnect(int fd, const char* addr, int port);
 	int udpSend(int fd, const char* address, const void* buffer, int sz);
@@ -106,19 +272,59 @@ public:
 	void socketInfo(std::vector<Info>& vectInfo);
 	inline bool isRunning() { return isRunning_; }
 
+	//Pin the socket thread to vectCpu, empty clears the mask. Linux only.
+	//Set before run() it is applied before the thread allocates anything.
+	bool setAffinity(const std::vector<int>& vectCpu);
+	//Co-location: cb(uid, cpu) is called once for every socket that has dispatched
+	//threshold messages, uid being its owner and cpu where the socket thread runs, so
+	//the consumer of uid can move next to it. Set it before run(); NULL turns it off.
+	void setColocate(void (*cb)(uintptr_t uid, int cpu), size_t threshold = 1024);
+	//Stamp Msg::ready_ and Msg::forward_. Off: one branch per message.
+	//Any thread, ready_ is stamped from the next batch of events on.
+	void setTrace(bool trace);
+	//Flight recorder, always on: the socket thread keeps its last 8192 loop iterations
+	//(sp_wait time, events, commands, bytes, slowest operation and its fd). Writes the
+	//last seconds of them to path; tools/flightdecode prints the file. Not on Windows.
+	bool dumpFlight(const std::string& path, int seconds = 10);
+	//On signo (e.g. SIGUSR2) every OpenSocket of the process is dumped into path by the
+	//signal handler, so a socket thread that hangs is caught too. Not on Windows.
+	static bool DumpFlightOnSignal(int signo, const std::string& path, int seconds = 10);
+
+	//Monotonic milliseconds, the clock of Info::rtime_/wtime_.
+	static uint64_t ClockMs();
 	static void Sleep(int64_t milliSecond);
 	static const std::string DomainNameToIp(const std::string& domain);
 	static OpenSocket& Instance() { return Instance_; }
 	static void Start(void (*cb)(const Msg*));
+	static void Start(void (*cb)(Msg&));
+#ifdef OPENSOCKET_BENCH
+	//Test hook of test/microbench.cpp, see src/socket_bench.h. An OpenSocket that is
+	//never run(): cb is set here and the reactor polled on the caller's thread.
+	inline struct socket_server* benchServer() { return (struct socket_server*)socket_server_; }
+	inline void benchCallback(void (*cb)(Msg&)) { cb_ = 0; cbRef_ = cb; }
+	inline void benchCallback(void (*cb)(const Msg*)) { cbRef_ = 0; cb_ = cb; }
+	inline int benchPoll() { return poll(); }
+#endif
 private:
 	int poll();
 	void forwardMsg(EMsgType type, bool padding, struct socket_message* result);
+	bool startThread();
+	void colocate(int fd, uintptr_t uid);
 	static void* ThreadSocket(void* p);
+	static void InlineMsg(void* ud, void* handler, struct socket_message* result);
 
 	void (*cb_)(const Msg*);
+	void (*cbRef_)(Msg&);
 	bool isRunning_;
 	bool isClose_;
 	void* socket_server_;
+
+	//tid_ and vectCpu_, shared by setAffinity() and the socket thread.
+	std::mutex affinityMutex_;
+	int tid_;
+	std::vector<int> vectCpu_;
+	void (*colocateCb_)(uintptr_t uid, int cpu);
+	size_t colocateThreshold_;
 	static OpenSocket Instance_;
 };
 
@@ -0,0 +1,29 @@
+#ifndef SOCKET_AFFINITY_h
+#define SOCKET_AFFINITY_h
+
+// CPU masks of the socket thread (OpenSocket::setAffinity) and of OpenThread
+// (OpenThread::setAffinity, OpenThreadGroup::setAffinity). Linux only.
+#ifdef __linux__
+
+#include <sched.h>
+#include <unistd.h>
+#include <vector>
+
+// the cpus of vectCpu, every configured cpu when it is empty
+static inline void SocketCpuSet(cpu_set_t* set, const std::vector<int>& vectCpu)
+{
+	CPU_ZERO(set);
+	if (vectCpu.empty())
+	{
+		long count = sysconf(_SC_NPROCESSORS_CONF);
+		for (long i = 0; i < count && i < CPU_SETSIZE; ++i) CPU_SET(i, set);
+	}
+	for (size_t i = 0; i < vectCpu.size(); ++i)
+	{
+		if (vectCpu[i] >= 0 && vectCpu[i] < CPU_SETSIZE) CPU_SET(vectCpu[i], set);
+	}
+}
+
+#endif
+
+#endif
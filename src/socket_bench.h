@@ -0,0 +1,36 @@
+#ifndef SOCKET_BENCH_h
+#define SOCKET_BENCH_h
+
+// Reactor internals reached by test/microbench.cpp, which builds src/opensocket.cpp
+// with OPENSOCKET_BENCH. Not part of the library: without the macro there is nothing here.
+// The OpenSocket side of the hook (benchPoll, benchCallback) is in opensocket.h.
+
+#ifdef OPENSOCKET_BENCH
+
+#include "socket_os.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct socket_server;
+
+// reserve_id / release_id. -1 when every slot is taken
+int socket_bench_reserve_id(struct socket_server *ss);
+void socket_bench_release_id(struct socket_server *ss, int id);
+// a setopt of no socket, through the control pipe and ctrl_cmd: a command that does nothing
+void socket_bench_ctrl(struct socket_server *ss);
+// a bound fd only reads, this makes it writable like an accepted one
+void socket_bench_connected(struct socket_server *ss, int id);
+// dw_lock of the socket, held: its sends go through the pipe and the write list
+struct spinlock * socket_bench_dw_lock(struct socket_server *ss, int id);
+// 1 when the write lists of the socket are empty
+int socket_bench_sent(struct socket_server *ss, int id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+#endif
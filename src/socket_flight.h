@@ -0,0 +1,52 @@
+#ifndef SOCKET_FLIGHT_h
+#define SOCKET_FLIGHT_h
+
+#include <stdint.h>
+
+// Flight recorder of a socket thread: one record per loop iteration, from the return
+// of sp_wait to the next sp_wait. The last FLIGHT_RECORDS are kept in a ring.
+// A dump file is a sequence of sections, one per socket server: a flight_header and
+// count flight_records, oldest first, native byte order. tools/flightdecode prints it.
+
+#define FLIGHT_MAGIC "OSFR"
+#define FLIGHT_VERSION 1
+
+// flight_record.flags
+#define FLIGHT_PARTIAL 1	// the iteration in progress at the dump, counted so far
+#define FLIGHT_OVERWRITTEN 2	// reused by the socket thread while it was copied, skip it
+
+// flight_record.slowest_op: the letter of a control command ('O' open, 'D' send, 'K' close...
+// see ctrl_cmd in opensocket.cpp) or one of the socket events
+#define FLIGHT_OP_READ 'r'
+#define FLIGHT_OP_WRITE 'w'
+#define FLIGHT_OP_ACCEPT 'a'
+#define FLIGHT_OP_CONNECT 'c'
+#define FLIGHT_OP_ERROR 'e'
+
+struct flight_header {
+	char magic[4];	// FLIGHT_MAGIC
+	uint32_t version;	// FLIGHT_VERSION
+	uint32_t record_size;	// sizeof(struct flight_record)
+	uint32_t count;	// records that follow
+	int64_t now;	// socket_clock_ns() of the dump
+	int32_t server;	// socket servers of the process numbered in order of creation
+	int32_t reserved;
+};
+
+// Times are socket_clock_ns() nanoseconds. An operation lasts until the next one starts,
+// so it includes the callback that consumed its message.
+struct flight_record {
+	int64_t time;	// sp_wait returned
+	int64_t wait;	// blocked in sp_wait
+	int64_t busy;	// from time to the next sp_wait
+	int64_t slowest;	// the slowest operation of the iteration
+	uint64_t bytes;	// read and flushed by the socket thread
+	int32_t slowest_id;	// socket id of the slowest operation, -1 none
+	uint32_t events;	// returned by sp_wait
+	uint32_t cmds;	// control commands drained
+	uint8_t slowest_op;	// FLIGHT_OP_* or a command letter, 0 none
+	uint8_t flags;	// FLIGHT_PARTIAL, FLIGHT_OVERWRITTEN
+	uint8_t reserved[2];
+};
+
+#endif
@@ -50,9 +50,9 @@ void sp_write(int efd, int sock, void* ud, bool enable) {
 	epoll_ctl(efd, EPOLL_CTL_MOD, sock, &ev);
 }
 
-int sp_wait(int efd, struct event* e, const int max) {
+int sp_wait(int efd, struct event* e, const int max, int timeout) {
 	struct epoll_event ev[max];
-	int n = epoll_wait(efd, ev, max, -1);
+	int n = epoll_wait(efd, ev, max, timeout);
 	int i = 0;
 	unsigned flag = 0;
 	for (i = 0; i < n; ++i) {
@@ -126,10 +126,10 @@ void sp_write(poll_fd efd, SOCKET sock, void* ud, bool enable) {
 	epoll_ctl(efd, EPOLL_CTL_MOD, sock, &ev);
 }
 
-int sp_wait(poll_fd efd, struct event* e, const int max) {
+int sp_wait(poll_fd efd, struct event* e, const int max, int timeout) {
 	struct epoll_event* ev = (struct epoll_event*)malloc(sizeof(struct epoll_event) * max);
 	if (!ev) return 0;
-	int n = epoll_wait(efd, ev, max, -1);
+	int n = epoll_wait(efd, ev, max, timeout);
 	int i = 0;
 	unsigned flag = 0;
 	for (i = 0; i < n; ++i) {
@@ -211,9 +211,10 @@ void sp_write(int kfd, int sock, void* ud, bool enable) {
 	}
 }
 
-int sp_wait(int kfd, struct event* e, int max) {
+int sp_wait(int kfd, struct event* e, int max, int timeout) {
 	struct kevent ev[max];
-	int n = kevent(kfd, NULL, 0, ev, max, NULL);
+	struct timespec ts = { timeout / 1000, (timeout % 1000) * 1000000 };
+	int n = kevent(kfd, NULL, 0, ev, max, timeout < 0 ? NULL : &ts);
 	int i = 0;
 	bool eof = false;
 	unsigned filter = 0;
@@ -343,7 +344,7 @@ void sp_write(int efd, int sock, void* ud, bool enable) {
 	// assert(false);
 }
 
-int sp_wait(int efd, struct event* e, int max) {
+int sp_wait(int efd, struct event* e, int max, int timeout) {
 	FD_ZERO(&ctx->read_fds);
 	FD_ZERO(&ctx->write_fds);
 	FD_ZERO(&ctx->except_fds);
@@ -366,6 +367,10 @@ int sp_wait(int efd, struct event* e, int max) {
 		}
 	}
 	struct timeval tv = { 2019030810, 0 };
+	if (timeout >= 0) {
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+	}
 	int ret = select(FD_SETSIZE, &ctx->read_fds, &ctx->write_fds, &ctx->except_fds, (struct timeval*)&tv);
 	if (ret == 0) {
 		return 0;
@@ -441,6 +446,33 @@ int write(fd, buffer, sz) { return 0; }
 int read(fd, buffer, sz) { return 0; }
 int close(fd, buffer, sz) { return 0; }
 
+int64_t socket_clock_ns()
+{
+    static LARGE_INTEGER frequency = { 0 };
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (int64_t)(counter.QuadPart / frequency.QuadPart * 1000000000
+        + counter.QuadPart % frequency.QuadPart * 1000000000 / frequency.QuadPart);
+}
+
+#include <malloc.h>
+
+int socket_file_create(const char *path)
+{
+    return -1;
+}
+
+void* socket_aligned_alloc(size_t align, size_t sz)
+{
+    return _aligned_malloc(sz, align);
+}
+
+void socket_aligned_free(void* p)
+{
+    _aligned_free(p);
+}
+
 int socket_write(int fd, const void* buffer, size_t sz)
 {
     int ret = socket_send(fd, (const char*)buffer, (int)sz, 0);
@@ -449,6 +481,39 @@ int socket_write(int fd, const void* buffer, size_t sz)
     return ret;
 }
 
+int socket_writev(int fd, const struct iovec* iov, int count)
+{
+    WSABUF vectBuf[64];
+    DWORD sent = 0;
+    int i = 0;
+    if (count > 64) count = 64;
+    for (i = 0; i < count; ++i)
+    {
+        vectBuf[i].buf = (char*)iov[i].iov_base;
+        vectBuf[i].len = (ULONG)iov[i].iov_len;
+    }
+    if (WSASend(fd, vectBuf, count, &sent, 0, NULL, NULL) == SOCKET_ERROR)
+        return -1;
+    return (int)sent;
+}
+
+int socket_readv(int fd, const struct iovec* iov, int count)
+{
+    WSABUF vectBuf[64];
+    DWORD received = 0;
+    DWORD flags = 0;
+    int i = 0;
+    if (count > 64) count = 64;
+    for (i = 0; i < count; ++i)
+    {
+        vectBuf[i].buf = (char*)iov[i].iov_base;
+        vectBuf[i].len = (ULONG)iov[i].iov_len;
+    }
+    if (WSARecv(fd, vectBuf, count, &received, &flags, NULL, NULL) == SOCKET_ERROR)
+        return -1;
+    return (int)received;
+}
+
 int socket_read(int fd, void* buffer, size_t sz)
 {
     int ret = socket_recv(fd, (char*)buffer, (int)sz, 0);
@@ -613,6 +678,38 @@ failed:
 
 #else
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+int64_t socket_clock_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int socket_file_create(const char *path) {
+	return open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+void* socket_aligned_alloc(size_t align, size_t sz) {
+	void *p = NULL;
+	return posix_memalign(&p, align, sz) == 0 ? p : NULL;
+}
+
+void socket_aligned_free(void* p) {
+	free(p);
+}
+
+// not inherited across exec
+int socket_dup(int fd) {
+#ifdef F_DUPFD_CLOEXEC
+	return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+#else
+	return dup(fd);
+#endif
+}
+
 //int socket_pipe(int fds[2])
 //{
 //	int err = socket_start();
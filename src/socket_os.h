@@ -2,6 +2,7 @@
 #define SOCKET_OS_h
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -30,7 +31,7 @@ extern void sp_release(poll_fd fd);
 extern int sp_add(poll_fd fd, SOCKET sock, void* ud);
 extern void sp_del(poll_fd fd, SOCKET sock);
 extern void sp_write(poll_fd, SOCKET sock, void* ud, bool enable);
-extern int sp_wait(poll_fd, struct event* e, int max);
+extern int sp_wait(poll_fd, struct event* e, int max, int timeout);	// timeout ms, -1 blocks
 extern void sp_nonblocking(SOCKET sock);
 
 #else
@@ -50,7 +51,7 @@ extern void sp_release(poll_fd fd);
 extern int sp_add(poll_fd fd, int sock, void* ud);
 extern void sp_del(poll_fd fd, int sock);
 extern void sp_write(poll_fd, int sock, void* ud, bool enable);
-extern int sp_wait(poll_fd, struct event* e, int max);
+extern int sp_wait(poll_fd, struct event* e, int max, int timeout);	// timeout ms, -1 blocks
 extern void sp_nonblocking(int sock);
 
 #endif
@@ -92,6 +93,7 @@ static inline long __sync_and_and_fetch(long* ptr, long n) {
 #define ATOM_ADD(ptr,n) __sync_add_and_fetch(ptr, n)
 #define ATOM_SUB(ptr,n) __sync_sub_and_fetch(ptr, n)
 #define ATOM_AND(ptr,n) __sync_and_and_fetch(ptr, n)
+#define ATOM_SYNC() MemoryBarrier()
 
 #else
 
@@ -104,10 +106,22 @@ static inline long __sync_and_and_fetch(long* ptr, long n) {
 #define ATOM_ADD(ptr,n) __sync_add_and_fetch(ptr, n)
 #define ATOM_SUB(ptr,n) __sync_sub_and_fetch(ptr, n)
 #define ATOM_AND(ptr,n) __sync_and_and_fetch(ptr, n)
+#define ATOM_SYNC() __sync_synchronize()
 
 #endif
 // ////////////atomic//////////////
 
+// ////////////cache line//////////////
+// Members written by different threads go on lines of their own. A struct that holds
+// such members has to come from socket_aligned_alloc when it is on the heap.
+#define SOCKET_CACHE_LINE 64
+#if defined(_MSC_VER)
+#define SOCKET_CACHE_ALIGNED __declspec(align(SOCKET_CACHE_LINE))
+#else
+#define SOCKET_CACHE_ALIGNED __attribute__((aligned(SOCKET_CACHE_LINE)))
+#endif
+// ////////////cache line//////////////
+
 
 //////////////spinlock//////////////
 
@@ -116,6 +130,12 @@ static inline long __sync_and_and_fetch(long* ptr, long n) {
 #define SPIN_UNLOCK(q) spinlock_unlock(&(q)->lock);
 #define SPIN_DESTROY(q) spinlock_destroy(&(q)->lock);
 
+// Every variant counts, written by the holder only, so without atomics:
+//   acquire  lock and successful trylock
+//   spin     pause rounds spent waiting for the holder
+//   park     times a waiter slept (futex, sched_yield, or a contended mutex / critical section)
+// They are read without the lock, for statistics.
+
 #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
 
 #include <windows.h>
@@ -123,6 +143,9 @@ static inline long __sync_and_and_fetch(long* ptr, long n) {
 
 struct spinlock {
     CRITICAL_SECTION lock;
+	uint64_t acquire;
+	uint64_t spin;
+	uint64_t park;
 };
 
 static inline void spinlock_init(struct spinlock *lock) {
@@ -131,14 +154,24 @@ static inline void spinlock_init(struct spinlock *lock) {
 	{
 		assert(false);
 	}
+	lock->acquire = 0;
+	lock->spin = 0;
+	lock->park = 0;
 }
 
 static inline void spinlock_lock(struct spinlock *lock) {
-	EnterCriticalSection(&lock->lock);
+	if (!TryEnterCriticalSection(&lock->lock)) {
+		EnterCriticalSection(&lock->lock);
+		++lock->park;
+	}
+	++lock->acquire;
 }
 
 static inline int spinlock_trylock(struct spinlock *lock) {
-	return TryEnterCriticalSection(&lock->lock);
+	if (!TryEnterCriticalSection(&lock->lock))
+		return 0;
+	++lock->acquire;
+	return 1;
 }
 
 static inline void spinlock_unlock(struct spinlock *lock) {
@@ -153,24 +186,105 @@ static inline void spinlock_destroy(struct spinlock *lock) {
 
 #ifndef USE_PTHREAD_LOCK
 
+// Adaptive lock. The holders are short (a send() of a direct write, a flush of the
+// reactor), so a waiter first spins with a pause and an exponential backoff, re-reading
+// the word before trying it again. Past SPINLOCK_SPIN pause rounds the holder is
+// likely descheduled or in a long write, and the waiter sleeps on a futex instead of
+// burning the core. lock: 0 free, 1 held, 2 held and someone may sleep on it,
+// the unlock of a 2 wakes one sleeper (Drepper, "Futexes Are Tricky", mutex 3).
+// Without futex (not Linux) the sleep is a sched_yield.
+
+#include <sched.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define SPINLOCK_SPIN 256	// pause rounds before sleeping
+#define SPINLOCK_BACKOFF 32	// most pause rounds between two reads of the lock
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SPIN_PAUSE() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define SPIN_PAUSE() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define SPIN_PAUSE() __asm__ __volatile__("" ::: "memory")
+#endif
+
 struct spinlock {
 	int lock;
+	uint64_t acquire;
+	uint64_t spin;
+	uint64_t park;
 };
 
 static inline void spinlock_init(struct spinlock *lock) {
 	lock->lock = 0;
+	lock->acquire = 0;
+	lock->spin = 0;
+	lock->park = 0;
 }
 
-static inline void spinlock_lock(struct spinlock *lock) {
-	while (__sync_lock_test_and_set(&lock->lock,1)) {}
+static inline void spinlock_sleep(struct spinlock *lock) {
+#ifdef __linux__
+	syscall(SYS_futex, &lock->lock, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+#else
+	(void) lock;
+	sched_yield();
+#endif
+}
+
+static inline void spinlock_wake(struct spinlock *lock) {
+#ifdef __linux__
+	syscall(SYS_futex, &lock->lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+	(void) lock;
+#endif
 }
 
 static inline int spinlock_trylock(struct spinlock *lock) {
-	return __sync_lock_test_and_set(&lock->lock,1) == 0;
+	int c = 0;
+	if (!__atomic_compare_exchange_n(&lock->lock, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 0;
+	++lock->acquire;
+	return 1;
+}
+
+static inline void spinlock_lock(struct spinlock *lock) {
+	int c = 0;
+	if (__atomic_compare_exchange_n(&lock->lock, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		++lock->acquire;
+		return;
+	}
+	unsigned int spin = 0;
+	unsigned int park = 0;
+	unsigned int backoff = 1;
+	unsigned int i;
+	while (spin < SPINLOCK_SPIN) {
+		for (i = 0; i < backoff; i++)
+			SPIN_PAUSE();
+		spin += backoff;
+		if (backoff < SPINLOCK_BACKOFF)
+			backoff <<= 1;
+		c = __atomic_load_n(&lock->lock, __ATOMIC_RELAXED);
+		if (c == 0 && __atomic_compare_exchange_n(&lock->lock, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			goto acquired;
+	}
+	// 2 from here on: the unlock cannot tell whether other sleepers are left
+	while (__atomic_exchange_n(&lock->lock, 2, __ATOMIC_ACQUIRE) != 0) {
+		spinlock_sleep(lock);
+		++park;
+	}
+acquired:
+	++lock->acquire;
+	lock->spin += spin;
+	lock->park += park;
 }
 
 static inline void spinlock_unlock(struct spinlock *lock) {
-	__sync_lock_release(&lock->lock);
+	if (__atomic_exchange_n(&lock->lock, 0, __ATOMIC_RELEASE) == 2)
+		spinlock_wake(lock);
 }
 
 static inline void spinlock_destroy(struct spinlock *lock) {
@@ -183,18 +297,31 @@ static inline void spinlock_destroy(struct spinlock *lock) {
 
 struct spinlock {
 	pthread_mutex_t lock;
+	uint64_t acquire;
+	uint64_t spin;
+	uint64_t park;
 };
 
 static inline void spinlock_init(struct spinlock *lock) {
 	pthread_mutex_init(&lock->lock, NULL);
+	lock->acquire = 0;
+	lock->spin = 0;
+	lock->park = 0;
 }
 
 static inline void spinlock_lock(struct spinlock *lock) {
-	pthread_mutex_lock(&lock->lock);
+	if (pthread_mutex_trylock(&lock->lock) != 0) {
+		pthread_mutex_lock(&lock->lock);
+		++lock->park;
+	}
+	++lock->acquire;
 }
 
 static inline int spinlock_trylock(struct spinlock *lock) {
-	return pthread_mutex_trylock(&lock->lock) == 0;
+	if (pthread_mutex_trylock(&lock->lock) != 0)
+		return 0;
+	++lock->acquire;
+	return 1;
 }
 
 static inline void spinlock_unlock(struct spinlock *lock) {
@@ -222,8 +349,18 @@ static inline void spinlock_destroy(struct spinlock *lock) {
 #include <ws2tcpip.h> /* for struct sock_addr used in zookeeper.h */
 #undef near
 
+#ifndef OPEN_IOVEC
+#define OPEN_IOVEC
+struct iovec {
+	void* iov_base;
+	size_t iov_len;
+};
+#endif
+
 int socket_write(int fd, const void* buffer, size_t sz);
+int socket_writev(int fd, const struct iovec* iov, int count);
 int socket_read(int fd, void* buffer, size_t sz);
+int socket_readv(int fd, const struct iovec* iov, int count);
 int socket_close(int fd);
 int socket_connect(SOCKET s, const struct sockaddr* name, int namelen);
 int socket_send(SOCKET s, const char* buffer, int sz, int flag);
@@ -236,10 +373,17 @@ int socket_stop();
 int socket_getsockopt(SOCKET s, int level, int optname, void* optval, int* optlen);
 int socket_setsockopt(SOCKET s, int level, int optname, const void* optval, int optlen);
 int socket_pipe(int fds[2]);
+// monotonic clock in nanoseconds
+int64_t socket_clock_ns();
+// not supported, -1
+int socket_file_create(const char *path);
+void* socket_aligned_alloc(size_t align, size_t sz);
+void socket_aligned_free(void* p);
 
 #else
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -271,7 +415,9 @@ static inline int socket_close(int fd) {
 //	return recvfrom(s, buf, len, flags, from, fromlen);
 //}
 #define socket_write write
+#define socket_writev writev
 #define socket_read read
+#define socket_readv readv
 //#define socket_close close
 
 #define socket_connect connect
@@ -284,6 +430,14 @@ static inline int socket_close(int fd) {
 
 #define socket_pipe pipe
 //int socket_pipe(int fds[2]);
+int socket_dup(int fd);
+// monotonic clock in nanoseconds, CLOCK_MONOTONIC like std::chrono::steady_clock
+int64_t socket_clock_ns();
+// write only, truncated, not inherited across exec. Async-signal-safe.
+int socket_file_create(const char *path);
+// align is a power of 2, a multiple of sizeof(void*). Released with socket_aligned_free.
+void* socket_aligned_alloc(size_t align, size_t sz);
+void socket_aligned_free(void* p);
 
 inline int socket_start() { return 0; }
 inline int socket_stop() { return 0; }
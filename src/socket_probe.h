@@ -0,0 +1,40 @@
+#ifndef SOCKET_PROBE_h
+#define SOCKET_PROBE_h
+
+// USDT probes of provider "opensocket", see tools/*.bt.
+// Compiled in with cmake -DOPENSOCKET_USDT=ON, which needs <sys/sdt.h> (systemtap-sdt-dev).
+// sdt.h is header only: a probe is one nop plus an ELF note, bpftrace patches the nop
+// when it attaches, nothing is linked and nothing runs while nobody listens.
+// Otherwise the macros are empty.
+//
+//   accept(listen_id, id, fd)             connection accepted, before SOCKET_ACCEPT
+//   connect(id, fd)                       outgoing connection established
+//   read(id, fd, bytes)                   bytes read from the socket
+//   write(id, fd, bytes, remaining)       bytes written, remaining still queued (wb_size)
+//   warning(id, fd, queued)               backpressure, SOCKET_WARNING with queued bytes
+//   close(id, fd, reason)                 force_close, reason is one of SOCKET_CLOSE_*
+//   ctrl(type, len)                       control command read from the pipe, type is its letter
+#if defined(OPENSOCKET_USDT) && defined(__linux__)
+
+#include <sys/sdt.h>
+
+#define SOCKET_PROBE2(name, a, b) DTRACE_PROBE2(opensocket, name, a, b)
+#define SOCKET_PROBE3(name, a, b, c) DTRACE_PROBE3(opensocket, name, a, b, c)
+#define SOCKET_PROBE4(name, a, b, c, d) DTRACE_PROBE4(opensocket, name, a, b, c, d)
+
+#else
+
+#define SOCKET_PROBE2(name, a, b)
+#define SOCKET_PROBE3(name, a, b, c)
+#define SOCKET_PROBE4(name, a, b, c, d)
+
+#endif
+
+// reason of the close probe
+#define SOCKET_CLOSE_RELEASE 0	// socket_server_release / socket_server_close
+#define SOCKET_CLOSE_USER 1	// close or shutdown requested
+#define SOCKET_CLOSE_EOF 2	// peer closed
+#define SOCKET_CLOSE_ERROR 3	// read, write, connect or add error
+#define SOCKET_CLOSE_HALFCLOSE 4	// half closed socket done with its write buffer
+
+#endif
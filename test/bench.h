@@ -0,0 +1,222 @@
+#ifndef BENCH_HEADER_H
+#define BENCH_HEADER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <chrono>
+#include <string>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#if !defined(WIN32) && !defined(_WIN32) && !defined(WIN64) && !defined(_WIN64)
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+
+namespace open
+{
+
+////////////BenchHistogram//////////////////////
+//Latency histogram in the HDR way: log2 ranges split into 32 linear buckets,
+//so every recorded value is kept within 1/32 (~3%) and a record is an index
+//computation and an increment. Not thread safe, one writer.
+class BenchHistogram
+{
+    enum { SubBits = 5, SubCount = 1 << SubBits, BucketCount = (64 - SubBits + 1) * SubCount };
+    uint64_t counts_[BucketCount];
+    uint64_t total_;
+    uint64_t min_;
+    uint64_t max_;
+    double sum_;
+
+    static inline int Index(uint64_t value)
+    {
+        if (value < SubCount) return (int)value;
+#ifdef _MSC_VER
+        unsigned long bit = 0;
+        _BitScanReverse64(&bit, value);
+        int msb = (int)bit;
+#else
+        int msb = 63 - __builtin_clzll(value);
+#endif
+        int shift = msb - SubBits;
+        return (shift + 1) * SubCount + (int)((value >> shift) & (SubCount - 1));
+    }
+    //middle of the bucket, what a percentile reports.
+    static inline uint64_t Value(int index)
+    {
+        if (index < SubCount) return (uint64_t)index;
+        int shift = index / SubCount - 1;
+        uint64_t low = (uint64_t)(SubCount + index % SubCount) << shift;
+        return low + (((uint64_t)1 << shift) >> 1);
+    }
+public:
+    BenchHistogram() { clear(); }
+    void clear()
+    {
+        memset(counts_, 0, sizeof(counts_));
+        total_ = 0;
+        min_ = UINT64_MAX;
+        max_ = 0;
+        sum_ = 0;
+    }
+    inline void record(int64_t value)
+    {
+        uint64_t v = value > 0 ? (uint64_t)value : 0;
+        ++counts_[Index(v)];
+        ++total_;
+        sum_ += (double)v;
+        if (v < min_) min_ = v;
+        if (v > max_) max_ = v;
+    }
+    void merge(const BenchHistogram& that)
+    {
+        for (int i = 0; i < BucketCount; ++i) counts_[i] += that.counts_[i];
+        total_ += that.total_;
+        sum_ += that.sum_;
+        if (that.min_ < min_) min_ = that.min_;
+        if (that.max_ > max_) max_ = that.max_;
+    }
+    //percentile in [0, 100].
+    uint64_t percentile(double percent) const
+    {
+        if (total_ == 0) return 0;
+        uint64_t rank = (uint64_t)(percent / 100.0 * total_ + 0.5);
+        if (rank < 1) rank = 1;
+        if (rank > total_) rank = total_;
+        uint64_t count = 0;
+        for (int i = 0; i < BucketCount; ++i)
+        {
+            count += counts_[i];
+            if (count >= rank) return Value(i) < max_ ? Value(i) : max_;
+        }
+        return max_;
+    }
+    inline uint64_t count() const { return total_; }
+    inline uint64_t min() const { return total_ ? min_ : 0; }
+    inline uint64_t max() const { return max_; }
+    inline double mean() const { return total_ ? sum_ / total_ : 0; }
+};
+
+////////////BenchClock//////////////////////
+class BenchClock
+{
+public:
+    static inline int64_t NowNs()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    //cpu of every thread of the process, user + system.
+    static inline int64_t CpuNs()
+    {
+#ifdef CLOCK_PROCESS_CPUTIME_ID
+        struct timespec ts;
+        if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) == 0)
+            return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+        return (int64_t)((double)clock() * 1e9 / CLOCKS_PER_SEC);
+    }
+};
+
+#if !defined(WIN32) && !defined(_WIN32) && !defined(WIN64) && !defined(_WIN64)
+////////////BenchConnect//////////////////////
+//Blocking tcp client outside the library, for the benches that drive a
+//server with plain read()/write(). -1 on error.
+static inline int BenchConnect(const char* ip, int port, bool nodelay)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(ip);
+    if (::connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        ::close(fd);
+        return -1;
+    }
+    int flag = 1;
+    if (nodelay) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    return fd;
+}
+#endif
+
+////////////BenchJson//////////////////////
+//One flat JSON object per line: {"bench":"tcp_echo","size":64,...}
+class BenchJson
+{
+    std::string line_;
+    void key(const char* name)
+    {
+        line_ += line_.empty() ? "{\"" : ",\"";
+        line_ += name;
+        line_ += "\":";
+    }
+public:
+    BenchJson& add(const char* name, const char* value)
+    {
+        key(name);
+        line_ += '"';
+        for (const char* p = value; *p; ++p)
+        {
+            if (*p == '"' || *p == '\\') line_ += '\\';
+            line_ += *p;
+        }
+        line_ += '"';
+        return *this;
+    }
+    BenchJson& add(const char* name, int64_t value)
+    {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%lld", (long long)value);
+        key(name);
+        line_ += buffer;
+        return *this;
+    }
+    BenchJson& add(const char* name, int value) { return add(name, (int64_t)value); }
+    BenchJson& add(const char* name, uint64_t value) { return add(name, (int64_t)value); }
+    BenchJson& add(const char* name, double value)
+    {
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "%.3f", value);
+        key(name);
+        line_ += buffer;
+        return *this;
+    }
+    //p50/p99/p999/max of the histogram in microseconds, the histogram holds nanoseconds.
+    BenchJson& latency(const BenchHistogram& histogram)
+    {
+        add("p50_us", histogram.percentile(50) / 1000.0);
+        add("p99_us", histogram.percentile(99) / 1000.0);
+        add("p999_us", histogram.percentile(99.9) / 1000.0);
+        add("max_us", histogram.max() / 1000.0);
+        return *this;
+    }
+    //msgs/s, MB/s and cpu ns per message over a window of cost nanoseconds.
+    BenchJson& rate(int64_t msgs, int64_t bytes, int64_t cost, int64_t cpu)
+    {
+        add("msgs", msgs);
+        add("msgs_per_sec", cost > 0 ? msgs * 1e9 / cost : 0.0);
+        add("mb_per_sec", cost > 0 ? bytes * 1e9 / cost / (1024 * 1024) : 0.0);
+        add("cpu_ns_per_msg", msgs > 0 ? (double)cpu / msgs : 0.0);
+        return *this;
+    }
+    void print()
+    {
+        line_ += line_.empty() ? "{}" : "}";
+        printf("%s\n", line_.c_str());
+        fflush(stdout);
+        line_.clear();
+    }
+};
+
+};
+
+#endif
@@ -0,0 +1,177 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "opensocket.h"
+#include "open/openthread.h"
+#include "socketdispatch.h"
+#include "bench.h"
+using namespace open;
+
+// One update pushed to every subscriber: a send() per socket against
+// a single broadcast() with the shared payload.
+// ./broadcastbench [subscribers] [rounds] [size]
+
+static int Subscribers_ = 10000;
+static int Rounds_ = 100;
+static int Size_ = 256;
+static OpenSocket* Socket_ = 0;
+static std::mutex Mutex_;
+static std::vector<int> VectFd_;
+static std::atomic<int> Closed_(0);
+
+static void Publisher(OpenThreadMsg& msg)
+{
+    if (msg.state_ != OpenThread::RUN) return;
+    const SocketProto* proto = msg.data<SocketProto>();
+    if (!proto) return;
+    const OpenSocketMsg& socketMsg = proto->data_;
+    switch (socketMsg.type_)
+    {
+    case OpenSocket::ESocketAccept:
+        Socket_->start((uintptr_t)msg.pid(), socketMsg.ud_);
+        {
+            std::lock_guard<std::mutex> lock(Mutex_);
+            VectFd_.push_back(socketMsg.ud_);
+        }
+        break;
+    case OpenSocket::ESocketClose:
+    case OpenSocket::ESocketError:
+        ++Closed_;
+        break;
+    default:
+        break;
+    }
+}
+
+static bool Drain(int fd, char* buffer)
+{
+    int offset = 0;
+    while (offset < Size_)
+    {
+        int n = (int)read(fd, buffer + offset, Size_ - offset);
+        if (n <= 0) return false;
+        offset += n;
+    }
+    return true;
+}
+
+static size_t Subscribed()
+{
+    std::lock_guard<std::mutex> lock(Mutex_);
+    return VectFd_.size();
+}
+
+static void Bench(bool isBroadcast, int port)
+{
+    OpenSocket openSocket;
+    Socket_ = &openSocket;
+    OpenSocketDispatch::Run(openSocket);
+    OpenThreadRef publisher = OpenThread::Create(isBroadcast ? "broadcastpub" : "sendpub", Publisher);
+    int listenFd = openSocket.listen((uintptr_t)publisher.pid(), "127.0.0.1", port, 1024);
+    if (listenFd < 0)
+    {
+        printf("listen 127.0.0.1:%d faild\n", port);
+        return;
+    }
+    openSocket.start((uintptr_t)publisher.pid(), listenFd);
+    OpenThread::Sleep(100);
+
+    std::vector<int> vectClient;
+    for (int i = 0; i < Subscribers_; ++i)
+    {
+        int fd = BenchConnect("127.0.0.1", port, false);
+        if (fd < 0)
+        {
+            printf("connect 127.0.0.1:%d faild after %d subscribers\n", port, i);
+            break;
+        }
+        vectClient.push_back(fd);
+    }
+    while (Subscribed() < vectClient.size()) OpenThread::Sleep(10);
+    std::vector<int> vectFd;
+    {
+        std::lock_guard<std::mutex> lock(Mutex_);
+        vectFd.swap(VectFd_);
+    }
+
+    std::vector<char> buffer(Size_, 'b');
+    std::vector<char> reply(Size_);
+    int64_t submit = 0;
+    int64_t deliver = 0;
+    int rounds = 0;
+    for (; rounds < Rounds_; ++rounds)
+    {
+        int64_t start = BenchClock::NowNs();
+        if (isBroadcast)
+        {
+            openSocket.broadcast(vectFd.data(), (int)vectFd.size(), buffer.data(), Size_);
+        }
+        else
+        {
+            for (size_t i = 0; i < vectFd.size(); ++i)
+                openSocket.send(vectFd[i], buffer.data(), Size_);
+        }
+        int64_t submitted = BenchClock::NowNs();
+        bool ok = true;
+        for (size_t i = 0; i < vectClient.size() && ok; ++i)
+            ok = Drain(vectClient[i], reply.data());
+        if (!ok) break;
+        submit += submitted - start;
+        deliver += BenchClock::NowNs() - start;
+    }
+    if (rounds > 0)
+    {
+        printf("fanout %-9s subscribers=%zu size=%d rounds=%d  submit=%8.1fus  deliver=%8.1fus  per socket=%6.1fns\n",
+            isBroadcast ? "broadcast" : "send", vectFd.size(), Size_, rounds,
+            submit / 1000.0 / rounds, deliver / 1000.0 / rounds, (double)deliver / rounds / vectFd.size());
+    }
+
+    Closed_ = 0;
+    for (size_t i = 0; i < vectClient.size(); ++i) ::close(vectClient[i]);
+    while (Closed_ < (int)vectFd.size()) OpenThread::Sleep(10);
+    openSocket.close((uintptr_t)publisher.pid(), listenFd);
+    OpenThread::Sleep(100);
+    publisher.stop();
+    Socket_ = 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) Subscribers_ = atoi(argv[1]);
+    if (argc > 2) Rounds_ = atoi(argv[2]);
+    if (argc > 3) Size_ = atoi(argv[3]);
+    if (Subscribers_ <= 0) Subscribers_ = 10000;
+    if (Rounds_ <= 0) Rounds_ = 100;
+    if (Size_ <= 0) Size_ = 256;
+
+    //both ends of every connection live in this process.
+    struct rlimit limit;
+    limit.rlim_cur = limit.rlim_max = RLIM_INFINITY;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (limit.rlim_cur != RLIM_INFINITY)
+    {
+        int most = (int)((limit.rlim_cur - 128) / 2);
+        if (Subscribers_ > most)
+        {
+            printf("RLIMIT_NOFILE %d, subscribers %d -> %d\n", (int)limit.rlim_cur, Subscribers_, most);
+            Subscribers_ = most;
+        }
+    }
+
+    Bench(false, 18095);
+    Bench(true, 18096);
+
+    OpenThread::StopAll();
+    return 0;
+}
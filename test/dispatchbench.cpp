@@ -0,0 +1,154 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <new>
+#include "opensocket.h"
+#include "open/openthread.h"
+#include "socketdispatch.h"
+#include "bench.h"
+using namespace open;
+
+// Socket -> OpenThread dispatch: heap allocations and time per received chunk,
+// the old per-demo SocketFunc bridge against OpenSocketDispatch.
+// ./dispatchbench [messages]
+
+static std::atomic<size_t> Allocs_(0);
+void* operator new(size_t size)
+{
+    ++Allocs_;
+    void* ptr = malloc(size ? size : 1);
+    if (!ptr) throw std::bad_alloc();
+    return ptr;
+}
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+
+////////////LegacyBridge//////////////////////
+// What the demos used to do: new Msg in OpenSocket, then new proto,
+// a shared_ptr for the proto and another one for the Msg.
+struct LegacyProto : public OpenThreadProto
+{
+    std::shared_ptr<OpenSocketMsg> data_;
+    static inline int ProtoType() { return 1; }
+    virtual inline int protoType() const { return LegacyProto::ProtoType(); }
+};
+
+static void LegacySocketFunc(const OpenSocketMsg* msg)
+{
+    if (!msg) return;
+    if ((int)msg->uid_ >= 0)
+    {
+        auto proto = std::shared_ptr<LegacyProto>(new LegacyProto);
+        proto->srcPid_ = -1;
+        proto->srcName_ = "OpenSocket";
+        proto->data_ = std::shared_ptr<OpenSocketMsg>((OpenSocketMsg*)msg);
+        if (!OpenThread::Send((int)msg->uid_, proto))
+            printf("LegacySocketFunc dispatch faild pid = %d\n", (int)msg->uid_);
+        return;
+    }
+    delete msg;
+}
+
+////////////Sink//////////////////////
+static int Messages_ = 20000;
+static OpenSocket* Socket_ = 0;
+static std::atomic<int> Received_(0);
+static std::atomic<int> ClientFd_(-1);
+
+static void OnSocketMsg(const OpenSocketMsg& msg)
+{
+    switch (msg.type_)
+    {
+    case OpenSocket::ESocketAccept:
+        Socket_->start((uintptr_t)msg.uid_, msg.ud_);
+        break;
+    case OpenSocket::ESocketOpen:
+        if (msg.fd_ != ClientFd_) break;
+        Socket_->nodelay(msg.fd_);
+        break;
+    case OpenSocket::ESocketData:
+        ++Received_;
+        break;
+    default:
+        break;
+    }
+}
+
+static void Sink(OpenThreadMsg& msg)
+{
+    if (msg.state_ != OpenThread::RUN) return;
+    const OpenThreadProto* proto = msg.data<OpenThreadProto>();
+    if (!proto) return;
+    const LegacyProto* legacy = dynamic_cast<const LegacyProto*>(proto);
+    if (legacy)
+    {
+        OnSocketMsg(*legacy->data_);
+        return;
+    }
+    const SocketProto* pooled = dynamic_cast<const SocketProto*>(proto);
+    if (pooled) OnSocketMsg(pooled->data_);
+}
+
+static void Client(OpenThreadMsg& msg)
+{
+}
+
+//legacy selects the bridge, port must be free on 127.0.0.1.
+static void Bench(bool legacy, int port)
+{
+    OpenSocket openSocket;
+    Socket_ = &openSocket;
+    if (legacy)
+        openSocket.run(LegacySocketFunc);
+    else
+        OpenSocketDispatch::Run(openSocket);
+
+    OpenThreadRef sink = OpenThread::Create(legacy ? "legacysink" : "pooledsink", Sink);
+    OpenThreadRef client = OpenThread::Create(legacy ? "legacyclient" : "pooledclient", Client);
+    int listenFd = openSocket.listen((uintptr_t)sink.pid(), "127.0.0.1", port, 64);
+    if (listenFd < 0)
+    {
+        printf("listen 127.0.0.1:%d faild\n", port);
+        return;
+    }
+    openSocket.start((uintptr_t)sink.pid(), listenFd);
+    ClientFd_ = openSocket.connect((uintptr_t)client.pid(), "127.0.0.1", port);
+    OpenThread::Sleep(200);
+
+    //one chunk in flight at a time, so every send shows up as one ESocketData.
+    char buffer[64];
+    memset(buffer, 'a', sizeof(buffer));
+    Received_ = 0;
+    size_t allocs = Allocs_;
+    int64_t start = BenchClock::NowNs();
+    for (int i = 0; i < Messages_; ++i)
+    {
+        openSocket.send(ClientFd_, buffer, sizeof(buffer));
+        while (Received_ <= i) OpenThread::Sleep(0);
+    }
+    int64_t cost = BenchClock::NowNs() - start;
+    allocs = Allocs_ - allocs;
+    printf("dispatch %-7s messages=%d  %6.2f allocs/msg  %8.1f ns/msg\n",
+        legacy ? "legacy" : "pooled", Messages_, (double)allocs / Messages_, (double)cost / Messages_);
+
+    openSocket.close((uintptr_t)client.pid(), ClientFd_);
+    openSocket.close((uintptr_t)sink.pid(), listenFd);
+    OpenThread::Sleep(100);
+    sink.stop();
+    client.stop();
+    Socket_ = 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) Messages_ = atoi(argv[1]);
+    if (Messages_ <= 0) Messages_ = 20000;
+
+    Bench(true, 18091);
+    Bench(false, 18092);
+
+    OpenThread::StopAll();
+    return 0;
+}
@@ -0,0 +1,132 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <unistd.h>
+#include "opensocket.h"
+#include "open/openthread.h"
+#include "socketdispatch.h"
+#include "bench.h"
+using namespace open;
+
+// Loopback echo round trip: reads echoed by an OpenThread worker
+// against reads echoed by an inline handler on the socket thread.
+// With trace, where the worker round trip goes: OpenTrace stages.
+// ./echobench [rounds] [size] [trace]
+
+static int Rounds_ = 20000;
+static int Size_ = 64;
+static bool Trace_ = false;
+static OpenSocket* Socket_ = 0;
+static bool Inline_ = false;
+
+static void EchoInline(OpenSocket& openSocket, const OpenSocketMsg& msg)
+{
+    openSocket.sendInline(msg.fd_, msg.data(), (int)msg.size());
+}
+
+static void EchoWorker(OpenThreadMsg& msg)
+{
+    if (msg.state_ != OpenThread::RUN) return;
+    const SocketProto* proto = msg.data<SocketProto>();
+    if (!proto) return;
+    const OpenSocketMsg& socketMsg = proto->data_;
+    switch (socketMsg.type_)
+    {
+    case OpenSocket::ESocketAccept:
+        //before start(), so no read slips through to the worker.
+        if (Inline_) Socket_->setInline(socketMsg.ud_, EchoInline);
+        Socket_->start((uintptr_t)msg.pid(), socketMsg.ud_);
+        Socket_->nodelay(socketMsg.ud_);
+        break;
+    case OpenSocket::ESocketData:
+        Socket_->send(socketMsg.fd_, socketMsg.data(), (int)socketMsg.size());
+        break;
+    default:
+        break;
+    }
+}
+
+static bool RoundTrip(int fd, const char* buffer, char* reply)
+{
+    if (write(fd, buffer, Size_) != Size_) return false;
+    int offset = 0;
+    while (offset < Size_)
+    {
+        int n = (int)read(fd, reply + offset, Size_ - offset);
+        if (n <= 0) return false;
+        offset += n;
+    }
+    return true;
+}
+
+static void Bench(bool isInline, int port)
+{
+    OpenSocket openSocket;
+    Socket_ = &openSocket;
+    Inline_ = isInline;
+    OpenSocketDispatch::Run(openSocket);
+    OpenSocketDispatch::Trace(openSocket, Trace_);
+    OpenTrace::Clear();
+    OpenThreadRef worker = OpenThread::Create(isInline ? "inlineecho" : "workerecho", EchoWorker);
+    int listenFd = openSocket.listen((uintptr_t)worker.pid(), "127.0.0.1", port, 64);
+    if (listenFd < 0)
+    {
+        printf("listen 127.0.0.1:%d faild\n", port);
+        return;
+    }
+    openSocket.start((uintptr_t)worker.pid(), listenFd);
+    OpenThread::Sleep(100);
+    int fd = BenchConnect("127.0.0.1", port, true);
+    if (fd < 0)
+    {
+        printf("connect 127.0.0.1:%d faild\n", port);
+        return;
+    }
+    std::vector<char> buffer(Size_, 'e');
+    std::vector<char> reply(Size_);
+    for (int i = 0; i < 1000; ++i) RoundTrip(fd, buffer.data(), reply.data());
+
+    BenchHistogram histogram;
+    for (int i = 0; i < Rounds_; ++i)
+    {
+        int64_t start = BenchClock::NowNs();
+        if (!RoundTrip(fd, buffer.data(), reply.data())) break;
+        histogram.record(BenchClock::NowNs() - start);
+    }
+    ::close(fd);
+    if (histogram.count() > 0)
+    {
+        printf("echo %-6s size=%d rounds=%llu  p50=%6.1fus p99=%6.1fus p999=%6.1fus\n",
+            isInline ? "inline" : "worker", Size_, (unsigned long long)histogram.count(),
+            histogram.percentile(50) / 1000.0, histogram.percentile(99) / 1000.0, histogram.percentile(99.9) / 1000.0);
+    }
+    for (int i = 0; Trace_ && i < OpenTrace::EStageMax; ++i)
+    {
+        OpenTrace::Summary summary;
+        OpenTrace::Summarize((OpenTrace::Stage)i, summary);
+        printf("  stage %-8s count=%-8llu p50=%6.1fus p99=%6.1fus p999=%6.1fus max=%7.1fus\n",
+            OpenTrace::StageName((OpenTrace::Stage)i), (unsigned long long)summary.count_,
+            summary.p50_ / 1000.0, summary.p99_ / 1000.0, summary.p999_ / 1000.0, summary.max_ / 1000.0);
+    }
+    openSocket.close((uintptr_t)worker.pid(), listenFd);
+    OpenThread::Sleep(100);
+    worker.stop();
+    Socket_ = 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) Rounds_ = atoi(argv[1]);
+    if (argc > 2) Size_ = atoi(argv[2]);
+    if (argc > 3) Trace_ = strcmp(argv[3], "trace") == 0;
+    if (Rounds_ <= 0) Rounds_ = 20000;
+    if (Size_ <= 0) Size_ = 64;
+
+    Bench(false, 18093);
+    Bench(true, 18094);
+
+    OpenThread::StopAll();
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <vector>
+#include "opensocket.h"
+#include "bench.h"
+using namespace open;
+
+// Short-lived RPC on loopback: connect, one request, one reply, close.
+// connect() + send() against connect() with the request as initial data,
+// which rides in the SYN when TCP Fast Open is on.
+// Linux: sysctl -w net.ipv4.tcp_fastopen=3 (client and server).
+// ./fastopenbench [rounds]
+
+static int Rounds_ = 2000;
+static OpenSocket* Socket_ = 0;
+static std::atomic<int> Replied_(0);
+static const uintptr_t ServerUid = 1;
+static const uintptr_t ClientUid = 2;
+static const uintptr_t ProbeUid = 3;
+static const char Request_[] = "GET /rpc";
+
+static void OnSocketMsg(OpenSocket::Msg& msg)
+{
+    switch (msg.type_)
+    {
+    case OpenSocket::ESocketAccept:
+        Socket_->start(ServerUid, msg.ud_);
+        break;
+    case OpenSocket::ESocketData:
+        if (msg.uid_ == ServerUid)
+        {
+            Socket_->send(msg.fd_, msg.data(), (int)msg.size());
+        }
+        else if (msg.uid_ == ClientUid)
+        {
+            Socket_->close(ClientUid, msg.fd_);
+            ++Replied_;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void Bench(bool fastOpen, int port)
+{
+    OpenSocket openSocket;
+    Socket_ = &openSocket;
+    openSocket.run(OnSocketMsg);
+    OpenSocket::Option option;
+    option.set(OpenSocket::EOptionFastOpen, 256);
+    int listenFd = openSocket.listen(ServerUid, "127.0.0.1", port, 256, &option);
+    if (listenFd < 0)
+    {
+        printf("listen 127.0.0.1:%d faild\n", port);
+        return;
+    }
+    openSocket.start(ServerUid, listenFd);
+    OpenSocket::Sleep(100);
+
+    BenchHistogram histogram;
+    Replied_ = 0;
+    //the first rounds fetch the cookie.
+    for (int i = 0; i < Rounds_ + 100; ++i)
+    {
+        int64_t start = BenchClock::NowNs();
+        if (fastOpen)
+        {
+            openSocket.connect(ClientUid, "127.0.0.1", port, Request_, (int)sizeof(Request_));
+        }
+        else
+        {
+            int fd = openSocket.connect(ClientUid, "127.0.0.1", port);
+            openSocket.send(fd, Request_, (int)sizeof(Request_));
+        }
+        int64_t deadline = start + 1000000000LL;
+        while (Replied_ <= i && BenchClock::NowNs() < deadline) OpenSocket::Sleep(0);
+        if (Replied_ <= i)
+        {
+            printf("no reply after %d rounds\n", i);
+            break;
+        }
+        if (i >= 100) histogram.record(BenchClock::NowNs() - start);
+    }
+
+    //one kept open, to see whether the SYN data was taken.
+    int fastOpened = -1;
+    int fd = fastOpen ? openSocket.connect(ProbeUid, "127.0.0.1", port, Request_, (int)sizeof(Request_))
+        : openSocket.connect(ProbeUid, "127.0.0.1", port);
+    OpenSocket::Sleep(100);
+    std::vector<OpenSocket::Info> vectInfo;
+    openSocket.socketInfo(vectInfo);
+    for (size_t i = 0; i < vectInfo.size(); ++i)
+    {
+        if (vectInfo[i].id_ == fd) fastOpened = vectInfo[i].fastopen_ ? 1 : 0;
+    }
+    if (histogram.count() > 0)
+    {
+        printf("rpc %-8s rounds=%llu  p50=%6.1fus p99=%6.1fus  syn data accepted=%s\n",
+            fastOpen ? "fastopen" : "connect", (unsigned long long)histogram.count(),
+            histogram.percentile(50) / 1000.0, histogram.percentile(99) / 1000.0,
+            fastOpened < 0 ? "?" : (fastOpened ? "yes" : "no"));
+    }
+    openSocket.close(ProbeUid, fd);
+    openSocket.close(ServerUid, listenFd);
+    OpenSocket::Sleep(100);
+    Socket_ = 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) Rounds_ = atoi(argv[1]);
+    if (Rounds_ <= 0) Rounds_ = 2000;
+
+    Bench(false, 18097);
+    Bench(true, 18098);
+    return 0;
+}
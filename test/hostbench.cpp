@@ -0,0 +1,207 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "opensocket.h"
+#include "bench.h"
+using namespace open;
+
+// Same-host transports behind the same listen/connect/send calls: loopback tcp,
+// a unix domain socket (host is a path) and the shared memory rings.
+// Echo round trip and one-way throughput, one JSON object per case on stdout.
+// ./hostbench [all|tcp|unix|shm] [rounds] [size] [megabytes]
+
+enum ETransport
+{
+    ETcp,
+    EUnix,
+    EShm,
+    ETransportMax
+};
+static const char* TransportName_[ETransportMax] = { "tcp", "unix", "shm" };
+
+static int Rounds_ = 20000;
+static int Size_ = 64;
+static int Megabytes_ = 256;
+static OpenSocket* Socket_ = 0;
+static const uintptr_t ServerUid = 1;
+static const uintptr_t ClientUid = 2;
+static const int Port_ = 18101;
+static const char* UnixPath_ = "/tmp/opensocket.hostbench.sock";
+static const char* ShmName_ = "hostbench";
+static std::atomic<int> ClientFd_(-1);
+static std::atomic<int64_t> Echoed_(0);
+static std::atomic<int64_t> Received_(0);
+static bool Echo_ = true;
+
+static void OnSocketMsg(OpenSocket::Msg& msg)
+{
+    switch (msg.type_)
+    {
+    case OpenSocket::ESocketAccept:
+        Socket_->start(ServerUid, msg.ud_);
+        break;
+    case OpenSocket::ESocketOpen:
+        if (msg.uid_ == ClientUid) ClientFd_ = msg.fd_;
+        break;
+    case OpenSocket::ESocketData:
+        if (msg.uid_ == ServerUid)
+        {
+            if (Echo_) Socket_->send(msg.fd_, msg.data(), (int)msg.size());
+            else Received_ += (int64_t)msg.size();
+        }
+        else if (msg.uid_ == ClientUid)
+        {
+            Echoed_ += (int64_t)msg.size();
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static bool Wait(std::atomic<int64_t>& value, int64_t expect)
+{
+    int64_t deadline = BenchClock::NowNs() + 5000000000LL;
+    while (value < expect)
+    {
+        if (BenchClock::NowNs() > deadline) return false;
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+static int Listen(OpenSocket& openSocket, ETransport transport)
+{
+    if (transport == EShm) return openSocket.listenShm(ServerUid, ShmName_);
+    OpenSocket::Option option;
+    option.set(OpenSocket::EOptionNodelay, 1);
+    return openSocket.listen(ServerUid, transport == EUnix ? UnixPath_ : "127.0.0.1", Port_, 64, &option);
+}
+
+static int Connect(OpenSocket& openSocket, ETransport transport)
+{
+    if (transport == EShm) return openSocket.connectShm(ClientUid, ShmName_);
+    OpenSocket::Option option;
+    option.set(OpenSocket::EOptionNodelay, 1);
+    return openSocket.connect(ClientUid, transport == EUnix ? UnixPath_ : "127.0.0.1", Port_, 0, &option);
+}
+
+//round trip, the reply is echoed on the socket thread.
+static void BenchEcho(OpenSocket& openSocket, ETransport transport, int fd)
+{
+    Echo_ = true;
+    Echoed_ = 0;
+    std::vector<char> buffer(Size_, 's');
+    BenchHistogram histogram;
+    int64_t expect = 0;
+    int64_t begin = 0;
+    int64_t cpu = 0;
+    for (int i = 0; i < Rounds_ + 1000; ++i)
+    {
+        if (i == 1000)
+        {
+            begin = BenchClock::NowNs();
+            cpu = BenchClock::CpuNs();
+        }
+        int64_t start = BenchClock::NowNs();
+        openSocket.send(fd, buffer.data(), Size_);
+        expect += Size_;
+        if (!Wait(Echoed_, expect))
+        {
+            fprintf(stderr, "%s: no echo after %d rounds\n", TransportName_[transport], i);
+            break;
+        }
+        if (i >= 1000) histogram.record(BenchClock::NowNs() - start);
+    }
+    if (histogram.count() == 0) return;
+    int64_t msgs = (int64_t)histogram.count();
+    BenchJson().add("bench", "host_echo").add("transport", TransportName_[transport]).add("size", Size_)
+        .rate(msgs, msgs * Size_, BenchClock::NowNs() - begin, BenchClock::CpuNs() - cpu)
+        .latency(histogram).print();
+}
+
+//one way, the server only counts.
+static void BenchStream(OpenSocket& openSocket, ETransport transport, int fd)
+{
+    Echo_ = false;
+    Received_ = 0;
+    const int piece = 64 * 1024;
+    std::vector<char> block(piece, 't');
+    int64_t total = (int64_t)Megabytes_ * 1024 * 1024;
+    int64_t start = BenchClock::NowNs();
+    int64_t cpu = BenchClock::CpuNs();
+    for (int64_t sent = 0; sent < total; sent += piece)
+    {
+        openSocket.send(fd, block.data(), piece);
+    }
+    if (!Wait(Received_, total))
+    {
+        fprintf(stderr, "%s: stream stalled at %lld bytes\n", TransportName_[transport], (long long)(int64_t)Received_);
+        return;
+    }
+    BenchJson().add("bench", "host_stream").add("transport", TransportName_[transport]).add("size", piece)
+        .rate(total / piece, total, BenchClock::NowNs() - start, BenchClock::CpuNs() - cpu).print();
+}
+
+static void Bench(ETransport transport)
+{
+    OpenSocket openSocket;
+    Socket_ = &openSocket;
+    openSocket.run(OnSocketMsg);
+    ClientFd_ = -1;
+    int listenFd = Listen(openSocket, transport);
+    if (listenFd < 0)
+    {
+        fprintf(stderr, "listen %s faild\n", TransportName_[transport]);
+        return;
+    }
+    openSocket.start(ServerUid, listenFd);
+    OpenSocket::Sleep(100);
+    int fd = Connect(openSocket, transport);
+    while (fd >= 0 && ClientFd_ != fd) OpenSocket::Sleep(1);
+    if (fd < 0)
+    {
+        fprintf(stderr, "connect %s faild\n", TransportName_[transport]);
+        openSocket.close(ServerUid, listenFd);
+        return;
+    }
+    BenchEcho(openSocket, transport, fd);
+    BenchStream(openSocket, transport, fd);
+
+    openSocket.close(ClientUid, fd);
+    openSocket.close(ServerUid, listenFd);
+    OpenSocket::Sleep(100);
+    if (transport == EUnix) unlink(UnixPath_);
+    Socket_ = 0;
+}
+
+int main(int argc, char** argv)
+{
+    std::string name = argc > 1 ? argv[1] : "all";
+    if (argc > 2) Rounds_ = atoi(argv[2]);
+    if (argc > 3) Size_ = atoi(argv[3]);
+    if (argc > 4) Megabytes_ = atoi(argv[4]);
+    if (Rounds_ <= 0) Rounds_ = 20000;
+    if (Size_ <= 0) Size_ = 64;
+    if (Megabytes_ <= 0) Megabytes_ = 256;
+
+    bool found = false;
+    for (int i = 0; i < ETransportMax; ++i)
+    {
+        if (name != "all" && name != TransportName_[i]) continue;
+        found = true;
+        Bench((ETransport)i);
+    }
+    if (!found)
+    {
+        fprintf(stderr, "usage: hostbench [all|tcp|unix|shm] [rounds] [size] [megabytes]\n");
+        return 1;
+    }
+    return 0;
+}
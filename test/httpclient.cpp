@@ -5,6 +5,7 @@
 #include <string.h>
 #include "open/openthread.h"
 #include "opensocket.h"
+#include "socketdispatch.h"
 using namespace open;
 
 ////////////HttpRequest//////////////////////
@@ -43,13 +44,6 @@ public:
 };
 
 ////////////Proto//////////////////////
-struct SocketProto : public OpenThreadProto
-{
-    std::shared_ptr<OpenSocketMsg> data_;
-    static inline int ProtoType() { return 1; }
-    virtual inline int protoType() const { return SocketProto::ProtoType(); }
-};
-
 struct TaskProto : public OpenThreadProto
 {
     int fd_;
@@ -63,23 +57,9 @@ struct TaskProto : public OpenThreadProto
 ////////////App//////////////////////
 class App
 {
-    static void SocketFunc(const OpenSocketMsg* msg)
-    {
-        if (!msg) return;
-        if (msg->uid_ >= 0)
-        {
-            auto proto = std::shared_ptr<SocketProto>(new SocketProto);
-            proto->srcPid_  = -1;
-            proto->srcName_ = "OpenSocket";
-            proto->data_ = std::shared_ptr<OpenSocketMsg>((OpenSocketMsg*)msg);
-            if (!OpenThread::Send((int)msg->uid_, proto))
-                printf("SocketFunc dispatch faild pid = %d\n", (int)msg->uid_);
-        }
-        else delete msg;
-    }
 public:
     static App Instance_;
-    App() {  OpenSocket::Start(App::SocketFunc); }
+    App() { OpenSocketDispatch::Start(); }
 };
 App App::Instance_;
 
@@ -131,7 +111,7 @@ private:
         request->response_.body_.clear();
         mapFdToTask_[proto.fd_] = proto;
     }
-    void onSendHttp(const std::shared_ptr<OpenSocketMsg>& data)
+    void onSendHttp(const OpenSocketMsg* data)
     {
         auto iter = mapFdToTask_.find(data->fd_);
         if (iter == mapFdToTask_.end())
@@ -159,7 +139,7 @@ private:
         }
         OpenSocket::Instance().send(task.fd_, buffer.data(), (int)buffer.size());
     }
-    void onReadHttp(const std::shared_ptr<OpenSocketMsg>& data)
+    void onReadHttp(const OpenSocketMsg* data)
     {
         auto iter = mapFdToTask_.find(data->fd_);
         if (iter == mapFdToTask_.end())
@@ -174,7 +154,7 @@ private:
             OpenSocket::Instance().close(pid(), data->fd_);
         }
     }
-    void onCloseHttp(const std::shared_ptr<OpenSocketMsg>& data)
+    void onCloseHttp(const OpenSocketMsg* data)
     {
         auto iter = mapFdToTask_.find(data->fd_);
         if (iter != mapFdToTask_.end())
@@ -185,7 +165,7 @@ private:
     }
     void onSocketProto(const SocketProto& proto)
     {
-        const auto& msg = proto.data_;
+        const OpenSocketMsg* msg = &proto.data_;
         switch (msg->type_)
         {
         case OpenSocket::ESocketData:
@@ -5,61 +5,31 @@
 #include <string.h>
 #include "opensocket.h"
 #include "open/openthread.h"
+#include "socketdispatch.h"
 using namespace open;
 
 const std::string TestServerIp_ = "0.0.0.0";
 const int TestServerPort_ = 8888;
 
-//msgType == 1
-struct SocketProto : public OpenThreadProto
-{
-    std::shared_ptr<OpenSocketMsg> data_;
-    static inline int ProtoType() { return 1; }
-    virtual inline int protoType() const { return SocketProto::ProtoType(); }
-};
-
-//msgType == 2
-struct RegisterProto : public OpenThreadProto
+struct RegisterProto : public OpenThreadTypedProto<RegisterProto>
 {
     int srcPid_;
-    static inline int ProtoType() { return 2; }
-    virtual inline int protoType() const { return RegisterProto::ProtoType(); }
     RegisterProto() :srcPid_(-1) {}
 };
 
-//msgType == 3
-struct NewClientProto : public OpenThreadProto
+struct NewClientProto : public OpenThreadTypedProto<NewClientProto>
 {
     int accept_fd_;
     std::string addr_;
-    static inline int ProtoType() { return 3; }
-    virtual inline int protoType() const { return NewClientProto::ProtoType(); }
     NewClientProto() : accept_fd_(-1) {}
 };
 
 ////////////App//////////////////////
 class App
 {
-    static void SocketFunc(const OpenSocketMsg* msg)
-    {
-        if (!msg) return;
-        if (msg->uid_ >= 0)
-        {
-            auto proto = std::shared_ptr<SocketProto>(new SocketProto);
-            proto->srcPid_ = -1;
-            proto->srcName_ = "OpenSocket";
-            proto->data_ = std::shared_ptr<OpenSocketMsg>((OpenSocketMsg*)msg);
-            if (!OpenThread::Send((int)msg->uid_, proto))
-                printf("SocketFunc dispatch faild pid = %d\n", (int)msg->uid_);
-        }
-        else
-        {
-            delete msg;
-        }
-    }
 public:
     static App Instance_;
-    App() { OpenSocket::Start(App::SocketFunc); }
+    App() { OpenSocketDispatch::Start(); }
 };
 App App::Instance_;
 
@@ -76,8 +46,8 @@ public:
         listen_fd_(-1)
     {
         balance_ = 0;
-        registers(SocketProto::ProtoType(), (OpenThreadHandle)&Listener::onSocketProto);
-        registers(RegisterProto::ProtoType(), (OpenThreadHandle)&Listener::onRegisterProto);
+        registers(&Listener::onSocketProto);
+        registers(&Listener::onRegisterProto);
     }
     virtual ~Listener() {}
     virtual void onStart()
@@ -126,7 +96,7 @@ public:
     }
     void onSocketProto(const SocketProto& proto)
     {
-        const auto& msg = proto.data_;
+        const OpenSocketMsg* msg = &proto.data_;
         switch (msg->type_)
         {
         case OpenSocket::ESocketAccept:
@@ -185,15 +155,15 @@ public:
         :OpenThreadWorker(name),
         listenId_(-1)
     {
-        registers(SocketProto::ProtoType(), (OpenThreadHandle)&Accepter::onSocketProto);
-        registers(NewClientProto::ProtoType(), (OpenThreadHandle)&Accepter::onNewClientProto);
+        registers(&Accepter::onSocketProto);
+        registers(&Accepter::onNewClientProto);
     }
     virtual ~Accepter() {}
     virtual void onStart() 
     { 
-        while (listenId_ < 0)
+        //on a group this would hold up a shared pthread, so only sleep while the listener is missing.
+        while ((listenId_ = ThreadId("listener")) < 0)
         {
-            listenId_ = ThreadId("listener");
             OpenThread::Sleep(1000);
         }
         auto proto = std::shared_ptr<RegisterProto>(new RegisterProto);
@@ -218,19 +188,22 @@ public:
             auto& client = mapClient_[accept_fd];
             client.fd_ = accept_fd;
             client.addr_ = proto.addr_;
-            OpenSocket::Instance().start(pid_, accept_fd);
+            //map nodes do not move, every message of accept_fd carries &client back.
+            //The node is erased on ESocketClose/ESocketError, the last message of accept_fd.
+            OpenSocket::Instance().start(pid_, accept_fd, (uintptr_t)&client);
         }
     }
     //GET /xx/xx HTTP/x.x
-    void onReadHttp(const std::shared_ptr<OpenSocketMsg> msg)
+    void onReadHttp(const OpenSocketMsg* msg)
     {
-        auto iter = mapClient_.find(msg->fd_);
-        if (iter == mapClient_.end())
+        //the data of a socket arrives before its close in this mailbox, the node is still there.
+        HttpRequest* client = (HttpRequest*)msg->context_;
+        if (!client)
         {
             OpenSocket::Instance().close(pid_, msg->fd_);
             return;
         }
-        auto& request = iter->second;
+        auto& request = *client;
         if (!request.pushData(msg->data(), msg->size()))
         {
             //Header too large.close connet.
@@ -241,12 +214,17 @@ public:
         printf("new client:url = %s\n", request.url_.c_str());
         std::string content;
         content.append("<div>It's work!</div><br/>" + request.addr_ + "request:" + request.url_);
-        std::string buffer = "HTTP/1.1 200 OK\r\ncontent-length:" + std::to_string(content.size()) + "\r\n\r\n" + content;
-        OpenSocket::Instance().send(msg->fd_, buffer.data(), (int)buffer.size());
+        std::string head = "HTTP/1.1 200 OK\r\ncontent-length:" + std::to_string(content.size()) + "\r\n\r\n";
+        struct iovec iov[2];
+        iov[0].iov_base = (void*)head.data();
+        iov[0].iov_len = head.size();
+        iov[1].iov_base = (void*)content.data();
+        iov[1].iov_len = content.size();
+        OpenSocket::Instance().sendv(msg->fd_, iov, 2);
     }
     virtual void onSocketProto(const SocketProto& proto)
     {
-        const auto& msg = proto.data_;
+        const OpenSocketMsg* msg = &proto.data_;
         switch (msg->type_)
         {
         case OpenSocket::ESocketData:
@@ -263,14 +241,8 @@ public:
             printf("Accepter::onStart [%s]ESocketWarning:%s\n", ThreadName((int)msg->uid_).c_str(), msg->info());
             break;
         case OpenSocket::ESocketOpen:
-        {
-            auto iter = mapClient_.find(msg->fd_);
-            if (iter == mapClient_.end())
-            {
+            if (!msg->context_)
                 OpenSocket::Instance().close(pid_, msg->fd_);
-                return;
-            }
-        }
             break;
         case OpenSocket::ESocketAccept:
         case OpenSocket::ESocketUdp:
@@ -291,8 +263,13 @@ int main()
         new Accepter("accepter3"),
         new Accepter("accepter4")
     };
-    for (size_t i = 0; i < vectServer.size(); ++i)
-        vectServer[i]->start();
+    //the accepters are actors on a work-stealing group, so one busy accepter
+    //no longer leaves its connections waiting while other pthreads idle.
+    OpenThreadGroup group;
+    group.start(4, "accepter");
+    vectServer[0]->start();
+    for (size_t i = 1; i < vectServer.size(); ++i)
+        vectServer[i]->start(group);
 
     printf("wait close==>>\n");
     OpenThread::ThreadJoinAll();
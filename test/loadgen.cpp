@@ -0,0 +1,379 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include "opensocket.h"
+#include "bench.h"
+using namespace open;
+
+// Load generator on OpenSocket reactors, for servers that echo what they get.
+// Connections open at rate per second from the source addresses in turn, each
+// source has its own ephemeral ports. Messages go out open loop at msgrate per
+// second over the open connections; a message carries its length and the time it
+// was due, latency is measured from that time, so a slow server can not hold the
+// generator back and hide its own delay (no coordinated omission).
+// One JSON line per second, a summary line at the end.
+//
+// ./loadgen [serve] key=value...
+//   host=127.0.0.1 port=18150 conns=1000 rate=1000 msgrate=10000 size=64[:max]
+//   seconds=10 reactors=1 sources=127.0.0.1,127.0.0.2-127.0.0.9
+// serve: an OpenSocket echo server on host:port, for trying it on one box.
+//   Loopback has every 127.x.y.z, other sources need an address alias.
+
+static const uintptr_t ServerUid = 1;
+static const uintptr_t ClientUid = 2;
+static const int HeadSize = 12;
+static std::map<std::string, std::string> Args_;
+
+static std::string Arg(const char* key, const char* value)
+{
+    std::map<std::string, std::string>::iterator iter = Args_.find(key);
+    return iter != Args_.end() ? iter->second : value;
+}
+
+static int ArgInt(const char* key, int value)
+{
+    std::map<std::string, std::string>::iterator iter = Args_.find(key);
+    return iter != Args_.end() ? atoi(iter->second.c_str()) : value;
+}
+
+////////////serve//////////////////////
+static OpenSocket* Server_ = 0;
+
+static void OnServerMsg(OpenSocket::Msg& msg)
+{
+    switch (msg.type_)
+    {
+    case OpenSocket::ESocketAccept:
+        Server_->start(ServerUid, msg.ud_);
+        break;
+    case OpenSocket::ESocketData:
+        Server_->send(msg.fd_, msg.data(), (int)msg.size());
+        break;
+    default:
+        break;
+    }
+}
+
+static int Serve()
+{
+    std::string host = Arg("host", "127.0.0.1");
+    int port = ArgInt("port", 18150);
+    OpenSocket server;
+    Server_ = &server;
+    server.run(OnServerMsg);
+    OpenSocket::Option option;
+    option.set(OpenSocket::EOptionNodelay, 1);
+    int listenFd = server.listen(ServerUid, host, port, 4096, &option);
+    if (listenFd < 0)
+    {
+        printf("listen %s:%d faild\n", host.c_str(), port);
+        return 1;
+    }
+    server.start(ServerUid, listenFd);
+    printf("echo on %s:%d\n", host.c_str(), port);
+    for (;;) OpenSocket::Sleep(1000);
+    return 0;
+}
+
+////////////generator//////////////////////
+//one connection, handed to connect() as context. fd_ is -1 until it is open.
+struct Conn
+{
+    std::atomic<int> fd_;
+    OpenSocket* socket_;
+    //frame being read: its header, then the bytes left of it.
+    char head_[HeadSize];
+    int headSize_;
+    uint32_t left_;
+    int64_t due_;
+    int64_t connect_;
+    Conn() :fd_(-1), socket_(0), headSize_(0), left_(0), due_(0), connect_(0) {}
+};
+
+static std::atomic<int> Opened_(0);
+static std::atomic<int> Closed_(0);
+static std::atomic<int64_t> ConnectErrors_(0);
+static std::atomic<int64_t> Received_(0);
+static std::atomic<int64_t> ReceivedBytes_(0);
+//filled on the reactors, swapped out every second by the main thread.
+static std::mutex Mutex_;
+static BenchHistogram Second_;
+static BenchHistogram Connect_;
+
+static void Frame(Conn* conn)
+{
+    int64_t latency = BenchClock::NowNs() - conn->due_;
+    ++Received_;
+    std::lock_guard<std::mutex> lock(Mutex_);
+    Second_.record(latency);
+}
+
+static void OnData(Conn* conn, const char* data, size_t size)
+{
+    ReceivedBytes_ += (int64_t)size;
+    while (size > 0)
+    {
+        if (conn->left_ == 0)
+        {
+            size_t n = HeadSize - conn->headSize_;
+            if (n > size) n = size;
+            memcpy(conn->head_ + conn->headSize_, data, n);
+            conn->headSize_ += (int)n;
+            data += n;
+            size -= n;
+            if (conn->headSize_ < HeadSize) break;
+            conn->headSize_ = 0;
+            uint32_t len = 0;
+            memcpy(&len, conn->head_, sizeof(len));
+            memcpy(&conn->due_, conn->head_ + sizeof(len), sizeof(conn->due_));
+            conn->left_ = len > (uint32_t)HeadSize ? len - HeadSize : 0;
+            if (conn->left_ == 0) Frame(conn);
+            continue;
+        }
+        size_t n = conn->left_ < size ? conn->left_ : size;
+        conn->left_ -= (uint32_t)n;
+        data += n;
+        size -= n;
+        if (conn->left_ == 0) Frame(conn);
+    }
+}
+
+static void OnClientMsg(OpenSocket::Msg& msg)
+{
+    Conn* conn = (Conn*)msg.context_;
+    if (!conn) return;
+    switch (msg.type_)
+    {
+    case OpenSocket::ESocketOpen:
+        conn->fd_ = msg.fd_;
+        ++Opened_;
+        {
+            std::lock_guard<std::mutex> lock(Mutex_);
+            Connect_.record(BenchClock::NowNs() - conn->connect_);
+        }
+        break;
+    case OpenSocket::ESocketData:
+        OnData(conn, msg.data(), msg.size());
+        break;
+    case OpenSocket::ESocketClose:
+        conn->fd_ = -1;
+        ++Closed_;
+        break;
+    case OpenSocket::ESocketError:
+        //never opened: a failed connect.
+        if (conn->fd_ < 0) ++ConnectErrors_;
+        else ++Closed_;
+        conn->fd_ = -1;
+        break;
+    default:
+        break;
+    }
+}
+
+//"a,b,c" and "a-b" ranges of IPv4 addresses (last part counts up).
+static void Sources(const std::string& text, std::vector<std::string>& vectSource)
+{
+    size_t start = 0;
+    while (start <= text.size())
+    {
+        size_t end = text.find(',', start);
+        if (end == std::string::npos) end = text.size();
+        std::string item = text.substr(start, end - start);
+        start = end + 1;
+        if (item.empty()) continue;
+        size_t dash = item.find('-');
+        struct in_addr first, last;
+        if (dash != std::string::npos
+            && inet_pton(AF_INET, item.substr(0, dash).c_str(), &first) == 1
+            && inet_pton(AF_INET, item.substr(dash + 1).c_str(), &last) == 1)
+        {
+            for (uint32_t ip = ntohl(first.s_addr); ip <= ntohl(last.s_addr); ++ip)
+            {
+                struct in_addr addr;
+                char buffer[INET_ADDRSTRLEN];
+                addr.s_addr = htonl(ip);
+                if (inet_ntop(AF_INET, &addr, buffer, sizeof(buffer))) vectSource.push_back(buffer);
+            }
+            continue;
+        }
+        vectSource.push_back(item);
+    }
+}
+
+static inline uint32_t Random(uint32_t& state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static int Generate()
+{
+    std::string host = Arg("host", "127.0.0.1");
+    int port = ArgInt("port", 18150);
+    int conns = ArgInt("conns", 1000);
+    int rate = ArgInt("rate", 1000);
+    int msgrate = ArgInt("msgrate", 10000);
+    int seconds = ArgInt("seconds", 10);
+    int reactors = ArgInt("reactors", 1);
+    std::string size = Arg("size", "64");
+    int minSize = atoi(size.c_str());
+    int maxSize = size.find(':') != std::string::npos ? atoi(size.c_str() + size.find(':') + 1) : minSize;
+    if (minSize < HeadSize) minSize = HeadSize;
+    if (maxSize < minSize) maxSize = minSize;
+    if (conns <= 0 || rate <= 0 || seconds <= 0 || reactors <= 0 || msgrate < 0) return 1;
+    std::vector<std::string> vectSource;
+    Sources(Arg("sources", ""), vectSource);
+
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+        if (limit.rlim_cur != RLIM_INFINITY && conns > (int)limit.rlim_cur - 64)
+        {
+            conns = (int)limit.rlim_cur - 64;
+            fprintf(stderr, "RLIMIT_NOFILE %d, conns -> %d\n", (int)limit.rlim_cur, conns);
+        }
+    }
+
+    std::vector<Conn> vectConn(conns);
+    std::vector<OpenSocket*> vectSocket;
+    for (int i = 0; i < reactors; ++i)
+    {
+        vectSocket.push_back(new OpenSocket);
+        vectSocket.back()->run(OnClientMsg);
+    }
+    OpenSocket::Option option;
+    option.set(OpenSocket::EOptionNodelay, 1);
+    std::vector<char> buffer(maxSize, 'g');
+    uint32_t state = 2463534242u;
+
+    BenchHistogram total;
+    BenchHistogram second;
+    int64_t start = BenchClock::NowNs();
+    int64_t end = start + seconds * 1000000000LL;
+    int64_t cpu = BenchClock::CpuNs();
+    int64_t nextReport = start + 1000000000LL;
+    int64_t nextMsg = start;
+    int64_t interval = msgrate > 0 ? 1000000000LL / msgrate : 0;
+    int connected = 0;
+    int64_t sent = 0, sentBytes = 0, unsent = 0;
+    int64_t lastSent = 0, lastReceived = 0, lastBytes = 0;
+    int lastOpened = 0;
+    size_t cursor = 0;
+    for (int64_t now = start; now < end; now = BenchClock::NowNs())
+    {
+        //connects due by now.
+        while (connected < conns && start + connected * 1000000000LL / rate <= now)
+        {
+            Conn& conn = vectConn[connected];
+            conn.socket_ = vectSocket[connected % reactors];
+            conn.connect_ = now;
+            int fd = vectSource.empty()
+                ? conn.socket_->connect(ClientUid, host, port, (uintptr_t)&conn, &option)
+                : conn.socket_->connectFrom(ClientUid, host, port, vectSource[connected % vectSource.size()], (uintptr_t)&conn, &option);
+            if (fd < 0) ++ConnectErrors_;
+            ++connected;
+        }
+        //messages due by now, each stamped with the time it was due.
+        while (interval > 0 && nextMsg <= now)
+        {
+            int sz = minSize + (maxSize > minSize ? (int)(Random(state) % (uint32_t)(maxSize - minSize + 1)) : 0);
+            bool ok = false;
+            for (int k = 0; k < connected && !ok; ++k)
+            {
+                Conn& conn = vectConn[cursor++ % connected];
+                int fd = conn.fd_;
+                if (fd < 0) continue;
+                uint32_t len = (uint32_t)sz;
+                memcpy(buffer.data(), &len, sizeof(len));
+                memcpy(buffer.data() + sizeof(len), &nextMsg, sizeof(nextMsg));
+                ok = conn.socket_->send(fd, buffer.data(), sz) >= 0;
+            }
+            if (ok)
+            {
+                ++sent;
+                sentBytes += sz;
+            }
+            else
+            {
+                ++unsent;
+            }
+            nextMsg += interval;
+        }
+        if (now >= nextReport)
+        {
+            {
+                std::lock_guard<std::mutex> lock(Mutex_);
+                second = Second_;
+                Second_.clear();
+            }
+            total.merge(second);
+            int64_t received = Received_, bytes = ReceivedBytes_;
+            int opened = Opened_;
+            BenchJson json;
+            json.add("t", (int)((now - start + 500000000LL) / 1000000000LL));
+            json.add("open", opened - Closed_).add("connects", opened - lastOpened);
+            json.add("connect_errors", (int64_t)ConnectErrors_).add("closed", (int)Closed_);
+            json.add("sent", sent - lastSent).add("recv", received - lastReceived).add("unsent", unsent);
+            json.add("mb_per_sec_in", (bytes - lastBytes) / (1024.0 * 1024.0));
+            json.latency(second).print();
+            lastSent = sent;
+            lastReceived = received;
+            lastBytes = bytes;
+            lastOpened = opened;
+            nextReport += 1000000000LL;
+        }
+        OpenSocket::Sleep(1);
+    }
+    int64_t cost = BenchClock::NowNs() - start;
+    cpu = BenchClock::CpuNs() - cpu;
+    {
+        std::lock_guard<std::mutex> lock(Mutex_);
+        total.merge(Second_);
+        Second_.clear();
+    }
+    BenchJson json;
+    json.add("bench", "loadgen").add("host", host.c_str()).add("port", port);
+    json.add("sources", (int)(vectSource.empty() ? 1 : vectSource.size())).add("reactors", reactors);
+    json.add("conns", conns).add("opened", (int)Opened_).add("connect_errors", (int64_t)ConnectErrors_);
+    json.add("sent", sent).add("sent_bytes", sentBytes).add("unsent", unsent);
+    {
+        std::lock_guard<std::mutex> lock(Mutex_);
+        json.add("connect_p50_us", Connect_.percentile(50) / 1000.0);
+        json.add("connect_p99_us", Connect_.percentile(99) / 1000.0);
+    }
+    json.rate(Received_, ReceivedBytes_, cost, cpu).latency(total).print();
+
+    for (size_t i = 0; i < vectConn.size(); ++i)
+    {
+        int fd = vectConn[i].fd_;
+        if (fd >= 0) vectConn[i].socket_->close(ClientUid, fd);
+    }
+    OpenSocket::Sleep(500);
+    for (size_t i = 0; i < vectSocket.size(); ++i) delete vectSocket[i];
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    bool serve = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* eq = strchr(argv[i], '=');
+        if (eq) Args_[std::string(argv[i], eq - argv[i])] = eq + 1;
+        else if (strcmp(argv[i], "serve") == 0) serve = true;
+    }
+    return serve ? Serve() : Generate();
+}
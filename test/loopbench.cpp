@@ -0,0 +1,480 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include "opensocket.h"
+#include "bench.h"
+using namespace open;
+
+// Library benchmark on loopback, one JSON object per case on stdout:
+//   tcp     echo, conns x inflight messages kept in flight, per message size
+//   udp     ping-pong, one datagram in flight per socket
+//   churn   connect, open, close, conns connects in flight
+//   fanout  broadcast() to subscribers, delivery latency of every copy
+// Server and client are two OpenSocket reactors of this process, so
+// cpu_ns_per_msg is the cost of both ends of a message.
+// ./loopbench [all|tcp|udp|churn|fanout] [seconds] [conns] [inflight] [subscribers]
+
+static const uintptr_t ServerUid = 1;
+static const uintptr_t ClientUid = 2;
+static const char* Host_ = "127.0.0.1";
+static int Seconds_ = 2;
+static int Conns_ = 16;
+static int Inflight_ = 8;
+static int Subscribers_ = 1000;
+
+enum EBench
+{
+    ETcp,
+    EUdp,
+    EChurn,
+    EFanout
+};
+static EBench Bench_ = ETcp;
+static int Size_ = 64;
+static int Port_ = 0;
+static OpenSocket* Server_ = 0;
+static OpenSocket* Client_ = 0;
+
+//shared between the main thread and the client reactor.
+static std::atomic<bool> Recording_(false);
+static std::atomic<bool> Stop_(false);
+static std::atomic<int> Opened_(0);
+static std::atomic<int> Pending_(0);
+static std::atomic<int64_t> Msgs_(0);
+static std::atomic<int64_t> Bytes_(0);
+static std::atomic<int64_t> Errors_(0);
+static std::atomic<int64_t> RoundStart_(0);
+static std::atomic<int> Delivered_(0);
+static std::mutex Mutex_;
+static std::vector<int> VectAccepted_;
+//client reactor only.
+static BenchHistogram Histogram_;
+static std::vector<char> Payload_;
+
+//one client connection, handed to connect() as context.
+struct Conn
+{
+    int fd_;
+    size_t received_;
+    int64_t start_;
+    //send time of every message in flight, tcp keeps them in order.
+    std::deque<int64_t> sent_;
+    Conn() :fd_(-1), received_(0), start_(0) {}
+};
+
+static inline void Done(int64_t start, int size)
+{
+    if (!Recording_) return;
+    Histogram_.record(BenchClock::NowNs() - start);
+    Msgs_.fetch_add(1, std::memory_order_relaxed);
+    Bytes_.fetch_add(size, std::memory_order_relaxed);
+}
+
+static void SendEcho(Conn* conn)
+{
+    ++Pending_;
+    conn->sent_.push_back(BenchClock::NowNs());
+    Client_->send(conn->fd_, Payload_.data(), Size_);
+}
+
+//the datagram carries its send time.
+static void SendPing(int fd, std::vector<char>& buffer)
+{
+    ++Pending_;
+    int64_t now = BenchClock::NowNs();
+    memcpy(buffer.data(), &now, sizeof(now));
+    Client_->send(fd, buffer.data(), Size_);
+}
+
+static void Churn(Conn* conn)
+{
+    ++Pending_;
+    conn->start_ = BenchClock::NowNs();
+    if (Client_->connect(ClientUid, Host_, Port_, (uintptr_t)conn) < 0)
+    {
+        ++Errors_;
+        --Pending_;
+    }
+}
+
+static void OnServerMsg(OpenSocket::Msg& msg)
+{
+    switch (msg.type_)
+    {
+    case OpenSocket::ESocketAccept:
+        Server_->start(ServerUid, msg.ud_);
+        if (Bench_ == EFanout)
+        {
+            std::lock_guard<std::mutex> lock(Mutex_);
+            VectAccepted_.push_back(msg.ud_);
+        }
+        break;
+    case OpenSocket::ESocketData:
+        Server_->send(msg.fd_, msg.data(), (int)msg.size());
+        break;
+    case OpenSocket::ESocketUdp:
+        Server_->udpSend(msg.fd_, msg.option_, msg.data(), (int)msg.size());
+        break;
+    default:
+        break;
+    }
+}
+
+static void OnClientMsg(OpenSocket::Msg& msg)
+{
+    Conn* conn = (Conn*)msg.context_;
+    switch (msg.type_)
+    {
+    case OpenSocket::ESocketOpen:
+        if (Bench_ == EChurn)
+        {
+            Done(conn->start_, 0);
+            Client_->close(ClientUid, msg.fd_);
+            --Pending_;
+            if (!Stop_) Churn(conn);
+            break;
+        }
+        conn->fd_ = msg.fd_;
+        if (Bench_ == ETcp)
+        {
+            for (int i = 0; i < Inflight_; ++i) SendEcho(conn);
+        }
+        ++Opened_;
+        break;
+    case OpenSocket::ESocketData:
+        if (!conn) break;
+        conn->received_ += msg.size();
+        while (conn->received_ >= (size_t)Size_)
+        {
+            conn->received_ -= Size_;
+            if (Bench_ == EFanout)
+            {
+                Done(RoundStart_, Size_);
+                ++Delivered_;
+                continue;
+            }
+            if (conn->sent_.empty()) break;
+            Done(conn->sent_.front(), Size_);
+            conn->sent_.pop_front();
+            --Pending_;
+            if (!Stop_) SendEcho(conn);
+        }
+        break;
+    case OpenSocket::ESocketUdp:
+        if (msg.size() >= sizeof(int64_t))
+        {
+            int64_t start = 0;
+            memcpy(&start, msg.data(), sizeof(start));
+            Done(start, (int)msg.size());
+            --Pending_;
+            if (!Stop_) SendPing(msg.fd_, Payload_);
+        }
+        break;
+    case OpenSocket::ESocketError:
+        ++Errors_;
+        if (Bench_ == EChurn && conn)
+        {
+            --Pending_;
+            if (!Stop_) Churn(conn);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+//warm up, then record for Seconds_. Leaves the traffic stopped and drained.
+static void Measure(BenchJson& json)
+{
+    OpenSocket::Sleep(200);
+    Histogram_.clear();
+    Msgs_ = 0;
+    Bytes_ = 0;
+    int64_t cpu = BenchClock::CpuNs();
+    int64_t start = BenchClock::NowNs();
+    Recording_ = true;
+    OpenSocket::Sleep(Seconds_ * 1000);
+    Recording_ = false;
+    int64_t cost = BenchClock::NowNs() - start;
+    cpu = BenchClock::CpuNs() - cpu;
+    Stop_ = true;
+    int64_t deadline = BenchClock::NowNs() + 2000000000LL;
+    while (Pending_ > 0 && BenchClock::NowNs() < deadline) OpenSocket::Sleep(1);
+    json.rate(Msgs_, Bytes_, cost, cpu).latency(Histogram_);
+}
+
+static void Reset(int size)
+{
+    Size_ = size;
+    Payload_.assign(size, 'l');
+    Recording_ = false;
+    Stop_ = false;
+    Opened_ = 0;
+    Pending_ = 0;
+    Errors_ = 0;
+    Delivered_ = 0;
+    VectAccepted_.clear();
+}
+
+static bool WaitFor(std::atomic<int>& value, int expect)
+{
+    int64_t deadline = BenchClock::NowNs() + 5000000000LL;
+    while (value < expect)
+    {
+        if (BenchClock::NowNs() > deadline) return false;
+        OpenSocket::Sleep(1);
+    }
+    return true;
+}
+
+static int Listen(OpenSocket& server, int port, int backlog)
+{
+    OpenSocket::Option option;
+    option.set(OpenSocket::EOptionNodelay, 1);
+    int listenFd = server.listen(ServerUid, Host_, port, backlog, &option);
+    if (listenFd < 0)
+    {
+        printf("{\"error\":\"listen %s:%d faild\"}\n", Host_, port);
+        return -1;
+    }
+    server.start(ServerUid, listenFd);
+    OpenSocket::Sleep(100);
+    return listenFd;
+}
+
+static void Connect(OpenSocket& client, std::vector<Conn>& vectConn, int port)
+{
+    OpenSocket::Option option;
+    option.set(OpenSocket::EOptionNodelay, 1);
+    for (size_t i = 0; i < vectConn.size(); ++i)
+    {
+        if (client.connect(ClientUid, Host_, port, (uintptr_t)&vectConn[i], &option) < 0) ++Errors_;
+    }
+}
+
+static void Close(OpenSocket& client, std::vector<Conn>& vectConn)
+{
+    for (size_t i = 0; i < vectConn.size(); ++i)
+    {
+        if (vectConn[i].fd_ >= 0) client.close(ClientUid, vectConn[i].fd_);
+    }
+}
+
+static void BenchTcp(int size, int port)
+{
+    Reset(size);
+    Bench_ = ETcp;
+    //outlives the reactors, it is the context of their messages.
+    std::vector<Conn> vectConn(Conns_);
+    OpenSocket server, client;
+    Server_ = &server;
+    Client_ = &client;
+    server.run(OnServerMsg);
+    client.run(OnClientMsg);
+    int listenFd = Listen(server, port, 1024);
+    if (listenFd < 0) return;
+    Connect(client, vectConn, port);
+    BenchJson json;
+    json.add("bench", "tcp_echo").add("conns", Conns_).add("inflight", Inflight_).add("size", size);
+    if (!WaitFor(Opened_, Conns_))
+    {
+        json.add("error", "connect").print();
+    }
+    else
+    {
+        Measure(json);
+        json.add("errors", (int64_t)Errors_).print();
+    }
+    Close(client, vectConn);
+    server.close(ServerUid, listenFd);
+    OpenSocket::Sleep(100);
+}
+
+static void BenchUdp(int size, int port)
+{
+    Reset(size < (int)sizeof(int64_t) ? (int)sizeof(int64_t) : size);
+    Bench_ = EUdp;
+    OpenSocket server, client;
+    Server_ = &server;
+    Client_ = &client;
+    server.run(OnServerMsg);
+    client.run(OnClientMsg);
+    int serverFd = server.udp(ServerUid, Host_, port);
+    BenchJson json;
+    json.add("bench", "udp_pingpong").add("conns", Conns_).add("inflight", 1).add("size", Size_);
+    if (serverFd < 0)
+    {
+        json.add("error", "udp").print();
+        return;
+    }
+    std::vector<int> vectFd;
+    for (int i = 0; i < Conns_; ++i)
+    {
+        int fd = client.udp(ClientUid, Host_, 0);
+        if (fd < 0 || client.udpConnect(fd, Host_, port) != 0) continue;
+        vectFd.push_back(fd);
+    }
+    OpenSocket::Sleep(100);
+    std::vector<char> buffer(Size_, 'u');
+    for (size_t i = 0; i < vectFd.size(); ++i) SendPing((int)vectFd[i], buffer);
+    Measure(json);
+    //a datagram dropped on the way never comes back.
+    json.add("lost", (int)Pending_).add("errors", (int64_t)Errors_).print();
+    for (size_t i = 0; i < vectFd.size(); ++i) client.close(ClientUid, vectFd[i]);
+    server.close(ServerUid, serverFd);
+    OpenSocket::Sleep(100);
+}
+
+static void BenchChurn(int port)
+{
+    Reset(0);
+    Bench_ = EChurn;
+    //outlives the reactors, it is the context of their messages.
+    std::vector<Conn> vectConn(Conns_);
+    OpenSocket server, client;
+    Server_ = &server;
+    Client_ = &client;
+    server.run(OnServerMsg);
+    client.run(OnClientMsg);
+    int listenFd = Listen(server, port, 1024);
+    if (listenFd < 0) return;
+    //Churn() reconnects from the client reactor.
+    Port_ = port;
+    for (size_t i = 0; i < vectConn.size(); ++i) Churn(&vectConn[i]);
+    BenchJson json;
+    json.add("bench", "connect_churn").add("conns", Conns_);
+    Measure(json);
+    json.add("errors", (int64_t)Errors_).print();
+    server.close(ServerUid, listenFd);
+    OpenSocket::Sleep(300);
+}
+
+static void BenchFanout(int size, int port)
+{
+    Reset(size);
+    Bench_ = EFanout;
+    //outlives the reactors, it is the context of their messages.
+    std::vector<Conn> vectConn(Subscribers_);
+    OpenSocket server, client;
+    Server_ = &server;
+    Client_ = &client;
+    server.run(OnServerMsg);
+    client.run(OnClientMsg);
+    int listenFd = Listen(server, port, 4096);
+    if (listenFd < 0) return;
+    Connect(client, vectConn, port);
+    BenchJson json;
+    json.add("bench", "broadcast_fanout").add("subscribers", Subscribers_).add("size", size);
+    bool ready = WaitFor(Opened_, Subscribers_);
+    int64_t deadline = BenchClock::NowNs() + 5000000000LL;
+    while (ready)
+    {
+        std::lock_guard<std::mutex> lock(Mutex_);
+        if ((int)VectAccepted_.size() >= Subscribers_) break;
+        if (BenchClock::NowNs() > deadline) ready = false;
+    }
+    if (!ready)
+    {
+        json.add("error", "connect").print();
+        Close(client, vectConn);
+        server.close(ServerUid, listenFd);
+        OpenSocket::Sleep(300);
+        return;
+    }
+    std::vector<int> vectFd;
+    {
+        std::lock_guard<std::mutex> lock(Mutex_);
+        vectFd.swap(VectAccepted_);
+    }
+    //rounds back to back, each waits for every copy.
+    Histogram_.clear();
+    int64_t cpu = 0;
+    int64_t start = 0;
+    int64_t warmup = BenchClock::NowNs() + 200000000LL;
+    int64_t end = 0;
+    int rounds = 0;
+    for (;;)
+    {
+        int64_t now = BenchClock::NowNs();
+        if (!Recording_ && now >= warmup && end == 0)
+        {
+            Msgs_ = 0;
+            Bytes_ = 0;
+            cpu = BenchClock::CpuNs();
+            start = now;
+            end = now + Seconds_ * 1000000000LL;
+            Recording_ = true;
+        }
+        else if (end != 0 && now >= end)
+        {
+            break;
+        }
+        Delivered_ = 0;
+        RoundStart_ = BenchClock::NowNs();
+        server.broadcast(vectFd.data(), (int)vectFd.size(), Payload_.data(), Size_);
+        if (!WaitFor(Delivered_, (int)vectFd.size()))
+        {
+            ++Errors_;
+            break;
+        }
+        if (Recording_) ++rounds;
+    }
+    Recording_ = false;
+    int64_t cost = BenchClock::NowNs() - start;
+    cpu = BenchClock::CpuNs() - cpu;
+    json.add("rounds", rounds).rate(Msgs_, Bytes_, cost, cpu).latency(Histogram_);
+    json.add("errors", (int64_t)Errors_).print();
+    Close(client, vectConn);
+    server.close(ServerUid, listenFd);
+    OpenSocket::Sleep(300);
+}
+
+int main(int argc, char** argv)
+{
+    std::string bench = argc > 1 ? argv[1] : "all";
+    if (argc > 2) Seconds_ = atoi(argv[2]);
+    if (argc > 3) Conns_ = atoi(argv[3]);
+    if (argc > 4) Inflight_ = atoi(argv[4]);
+    if (argc > 5) Subscribers_ = atoi(argv[5]);
+    if (Seconds_ <= 0) Seconds_ = 2;
+    if (Conns_ <= 0) Conns_ = 16;
+    if (Inflight_ <= 0) Inflight_ = 8;
+    if (Subscribers_ <= 0) Subscribers_ = 1000;
+
+    //both ends of every connection live in this process.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+        if (limit.rlim_cur != RLIM_INFINITY)
+        {
+            int most = (int)((limit.rlim_cur - 128) / 2);
+            if (Subscribers_ > most) Subscribers_ = most;
+            if (Conns_ > most) Conns_ = most;
+        }
+    }
+
+    bool all = bench == "all";
+    if (all || bench == "tcp")
+    {
+        const int sizes[] = { 64, 1024, 16384 };
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) BenchTcp(sizes[i], 18110 + (int)i);
+    }
+    if (all || bench == "udp")
+    {
+        const int sizes[] = { 64, 1024 };
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) BenchUdp(sizes[i], 18120 + (int)i);
+    }
+    if (all || bench == "churn") BenchChurn(18130);
+    if (all || bench == "fanout") BenchFanout(256, 18140);
+    return 0;
+}
@@ -0,0 +1,444 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <unistd.h>
+//built with OPENSOCKET_BENCH, the reactor internals it drives are in src/socket_bench.h.
+#include "opensocket.h"
+#include "socket_bench.h"
+#include "open/openthread.h"
+#include "bench.h"
+using namespace open;
+
+// Internal paths one at a time, single threaded unless said otherwise. The reactor
+// is polled by hand on the main thread. One JSON object per case: ns_per_op and
+// allocs_per_op (every malloc of the process, glibc only).
+//   reserve_id    slot reservation, 1/2/4 threads on the same server, then 99% of the slots in use
+//   ctrl          send_request -> ctrl_cmd round trip through the control pipe
+//   send          socket_server_send direct write against the queued path
+//   send_threads  1/2/4 threads, each sending to its own socket, the sockets in adjacent slots
+//   send_shared   1/2/4 threads sending to one socket with the reactor polled, dw_lock counters
+//   forward       forward_message_tcp read + forwardMsg, Msg& / Msg* / recv chunk
+//   thread        OpenThread::Send -> run callback
+//   worker        OpenThreadWorker::onMsg, typed jump table / protoType map
+// ./microbench [ops]
+
+static std::atomic<size_t> Mallocs_(0);
+#ifdef __GLIBC__
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* malloc(size_t size)
+{
+    Mallocs_.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+#endif
+
+static int64_t Ops_ = 200000;
+
+////////////SocketBench//////////////////////
+//An OpenSocket that is never run(), poll() is called by the bench.
+struct SocketBench
+{
+    OpenSocket openSocket_;
+    struct socket_server* ss_;
+    SocketBench() { ss_ = openSocket_.benchServer(); }
+    void setCallback(void (*cb)(OpenSocket::Msg&)) { openSocket_.benchCallback(cb); }
+    void setCallback(void (*cb)(const OpenSocket::Msg*)) { openSocket_.benchCallback(cb); }
+    inline int poll() { return openSocket_.benchPoll(); }
+};
+
+////////////Probe//////////////////////
+class Probe
+{
+    int64_t start_;
+    size_t mallocs_;
+public:
+    Probe() { start_ = BenchClock::NowNs(); mallocs_ = Mallocs_; }
+    //lock: its counters are added, see struct spinlock.
+    void report(const char* bench, const char* variant, int64_t ops, int threads = 1,
+        const struct spinlock* lock = 0)
+    {
+        int64_t cost = BenchClock::NowNs() - start_;
+        size_t mallocs = Mallocs_ - mallocs_;
+        BenchJson json;
+        json.add("bench", bench).add("variant", variant).add("threads", threads).add("ops", ops);
+        //time of one op as seen by one of the threads.
+        json.add("ns_per_op", ops > 0 ? (double)cost * threads / ops : 0.0);
+        json.add("allocs_per_op", ops > 0 ? (double)mallocs / ops : 0.0);
+        if (lock)
+        {
+            json.add("lock_acquire", lock->acquire).add("lock_spin", lock->spin).add("lock_park", lock->park);
+        }
+        json.print();
+    }
+};
+
+static void BenchReserveId(int threads)
+{
+    SocketBench bench;
+    struct socket_server* ss = bench.ss_;
+    int64_t ops = Ops_ / threads * threads;
+    std::vector<std::thread> vectThread;
+    std::atomic<bool> go(false);
+    for (int i = 0; i < threads; ++i)
+    {
+        vectThread.push_back(std::thread([ss, ops, threads, &go]() {
+            while (!go) std::this_thread::yield();
+            for (int64_t k = ops / threads; k > 0; --k)
+            {
+                int id = socket_bench_reserve_id(ss);
+                assert(id >= 0);
+                socket_bench_release_id(ss, id);
+            }
+        }));
+    }
+    Probe probe;
+    go = true;
+    for (size_t i = 0; i < vectThread.size(); ++i) vectThread[i].join();
+    probe.report("reserve_id", "reserve+release", ops, threads);
+}
+
+//the free ones scattered among the ones in use, the state of a busy server.
+static void BenchReserveFull()
+{
+    SocketBench bench;
+    struct socket_server* ss = bench.ss_;
+    std::vector<int> vectId;
+    for (;;)
+    {
+        int id = socket_bench_reserve_id(ss);
+        if (id < 0) break;
+        vectId.push_back(id);
+    }
+    for (size_t i = 0; i < vectId.size(); i += 100) socket_bench_release_id(ss, vectId[i]);
+    Probe probe;
+    for (int64_t i = 0; i < Ops_; ++i)
+    {
+        int id = socket_bench_reserve_id(ss);
+        assert(id >= 0);
+        socket_bench_release_id(ss, id);
+    }
+    probe.report("reserve_id", "reserve+release, 99% in use", Ops_);
+    for (size_t i = 0; i < vectId.size(); ++i)
+    {
+        if (i % 100 != 0) socket_bench_release_id(ss, vectId[i]);
+    }
+}
+
+static void BenchCtrl()
+{
+    SocketBench bench;
+    struct socket_server* ss = bench.ss_;
+    Probe probe;
+    for (int64_t i = 0; i < Ops_; ++i)
+    {
+        socket_bench_ctrl(ss);
+    }
+    probe.report("ctrl", "send_request+ctrl_cmd", Ops_);
+}
+
+////////////socketpair cases//////////////////////
+static int Opened_ = 0;
+static int64_t Received_ = 0;
+
+static void OnMsgRef(OpenSocket::Msg& msg)
+{
+    if (msg.type_ == OpenSocket::ESocketOpen) ++Opened_;
+    else if (msg.type_ == OpenSocket::ESocketData) Received_ += (int64_t)msg.size();
+}
+
+static void OnMsgPtr(const OpenSocket::Msg* msg)
+{
+    if (msg->type_ == OpenSocket::ESocketOpen) ++Opened_;
+    else if (msg->type_ == OpenSocket::ESocketData) Received_ += (int64_t)msg->size();
+    delete msg;
+}
+
+//one end bound in bench, the other end returned in peer.
+static int Pair(SocketBench& bench, int& peer)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return -1;
+    peer = fds[1];
+    Opened_ = 0;
+    Received_ = 0;
+    int id = bench.openSocket_.bind(1, fds[0]);
+    while (Opened_ < 1) bench.poll();
+    socket_bench_connected(bench.ss_, id);
+    return id;
+}
+
+static void Drain(int peer)
+{
+    char buffer[4096];
+    while (recv(peer, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {}
+}
+
+static void BenchSend(bool direct)
+{
+    SocketBench bench;
+    bench.setCallback(OnMsgRef);
+    int peer = -1;
+    int id = Pair(bench, peer);
+    if (id < 0) return;
+    struct spinlock* lock = socket_bench_dw_lock(bench.ss_, id);
+    char buffer[64] = { 0 };
+    Probe probe;
+    for (int64_t i = 0; i < Ops_; ++i)
+    {
+        if (direct)
+        {
+            bench.openSocket_.send(id, buffer, sizeof(buffer));
+        }
+        else
+        {
+            //the reactor holds the lock: the send goes through the pipe and the write list.
+            spinlock_lock(lock);
+            bench.openSocket_.send(id, buffer, sizeof(buffer));
+            spinlock_unlock(lock);
+            while (!socket_bench_sent(bench.ss_, id)) bench.poll();
+        }
+        if ((i & 63) == 63) Drain(peer);
+    }
+    probe.report("send", direct ? "direct" : "queued", Ops_);
+    Drain(peer);
+    ::close(peer);
+}
+
+//Direct sends of several threads, nothing shared but the neighbouring slots of ss->slot:
+//what is left is false sharing between the sockets, and the syscalls.
+static void BenchSendThreads(int threads)
+{
+    SocketBench bench;
+    bench.setCallback(OnMsgRef);
+    std::vector<int> vectId;
+    std::vector<int> vectPeer;
+    for (int i = 0; i < threads; ++i)
+    {
+        int peer = -1;
+        int id = Pair(bench, peer);
+        if (id < 0) return;
+        vectId.push_back(id);
+        vectPeer.push_back(peer);
+    }
+    int64_t ops = Ops_ / threads * threads;
+    std::vector<std::thread> vectThread;
+    std::atomic<bool> go(false);
+    for (int i = 0; i < threads; ++i)
+    {
+        int id = vectId[i];
+        int peer = vectPeer[i];
+        vectThread.push_back(std::thread([&bench, id, peer, ops, threads, &go]() {
+            char buffer[64] = { 0 };
+            while (!go) std::this_thread::yield();
+            for (int64_t k = 0; k < ops / threads; ++k)
+            {
+                bench.openSocket_.send(id, buffer, sizeof(buffer));
+                if ((k & 63) == 63) Drain(peer);
+            }
+        }));
+    }
+    Probe probe;
+    go = true;
+    for (size_t i = 0; i < vectThread.size(); ++i) vectThread[i].join();
+    probe.report("send_threads", "direct, adjacent slots", ops, threads);
+    for (int i = 0; i < threads; ++i)
+    {
+        Drain(vectPeer[i]);
+        ::close(vectPeer[i]);
+    }
+}
+
+//Direct sends of several threads to the same socket while the socket thread runs:
+//they all queue on its dw_lock, the case of a hot connection fed by a worker pool.
+static void BenchSendShared(int threads)
+{
+    SocketBench bench;
+    bench.setCallback(OnMsgRef);
+    int peer = -1;
+    int id = Pair(bench, peer);
+    if (id < 0) return;
+    //a byte on it returns poll(), the socket thread would sleep through commands.
+    int bell = -1;
+    if (Pair(bench, bell) < 0) return;
+    struct socket_server* ss = bench.ss_;
+    int64_t ops = Ops_ / threads * threads;
+    std::vector<std::thread> vectThread;
+    std::atomic<bool> go(false);
+    std::atomic<int> done(0);
+    for (int i = 0; i < threads; ++i)
+    {
+        vectThread.push_back(std::thread([&bench, id, peer, bell, ops, threads, &go, &done]() {
+            char buffer[64] = { 0 };
+            while (!go) std::this_thread::yield();
+            for (int64_t k = 0; k < ops / threads; ++k)
+            {
+                bench.openSocket_.send(id, buffer, sizeof(buffer));
+                if ((k & 63) == 63) Drain(peer);
+            }
+            ++done;
+            if (::write(bell, buffer, 1) != 1) abort();
+        }));
+    }
+    Probe probe;
+    go = true;
+    while (done < threads) bench.poll();
+    for (size_t i = 0; i < vectThread.size(); ++i) vectThread[i].join();
+    probe.report("send_shared", "direct, one socket", ops, threads, socket_bench_dw_lock(ss, id));
+    //what is still queued is freed with the server.
+    Drain(peer);
+    ::close(peer);
+    ::close(bell);
+}
+
+static void BenchForward(const char* variant)
+{
+    SocketBench bench;
+    bool isPtr = strcmp(variant, "Msg*") == 0;
+    if (isPtr) bench.setCallback(OnMsgPtr);
+    else bench.setCallback(OnMsgRef);
+    int peer = -1;
+    int id = Pair(bench, peer);
+    if (id < 0) return;
+    if (strcmp(variant, "chunk") == 0)
+    {
+        bench.openSocket_.setOption(id, OpenSocket::EOptionRecvChunk, 64 * 1024);
+    }
+    char buffer[64] = { 0 };
+    //the first reads size the read buffer.
+    for (int i = 0; i < 1000; ++i)
+    {
+        if (write(peer, buffer, sizeof(buffer)) != (ssize_t)sizeof(buffer)) return;
+        while (Received_ < (int64_t)sizeof(buffer) * (i + 1)) bench.poll();
+    }
+    Received_ = 0;
+    Probe probe;
+    for (int64_t i = 0; i < Ops_; ++i)
+    {
+        if (write(peer, buffer, sizeof(buffer)) != (ssize_t)sizeof(buffer)) break;
+        while (Received_ < (int64_t)sizeof(buffer) * (i + 1)) bench.poll();
+    }
+    probe.report("forward", variant, Ops_);
+    ::close(peer);
+}
+
+//what the forward cases spend outside the reactor.
+static void BenchPairBaseline()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return;
+    char buffer[64] = { 0 };
+    Probe probe;
+    for (int64_t i = 0; i < Ops_; ++i)
+    {
+        if (write(fds[1], buffer, sizeof(buffer)) != (ssize_t)sizeof(buffer)) break;
+        if (read(fds[0], buffer, sizeof(buffer)) <= 0) break;
+    }
+    probe.report("forward", "write+read only", Ops_);
+    ::close(fds[0]);
+    ::close(fds[1]);
+}
+
+////////////OpenThread cases//////////////////////
+struct TypedProto : public OpenThreadTypedProto<TypedProto>
+{
+    static inline int ProtoType() { return 2; }
+    virtual inline int protoType() const { return TypedProto::ProtoType(); }
+};
+
+struct MapProto : public OpenThreadProto
+{
+    static inline int ProtoType() { return 3; }
+    virtual inline int protoType() const { return MapProto::ProtoType(); }
+};
+
+static std::atomic<int64_t> Handled_(0);
+
+static void OnThreadMsg(const OpenThreadMsg& msg)
+{
+    if (msg.state_ == OpenThread::RUN) Handled_.fetch_add(1, std::memory_order_relaxed);
+}
+
+class BenchWorker : public OpenThreadWorker
+{
+public:
+    BenchWorker(const std::string& name)
+        :OpenThreadWorker(name)
+    {
+        registers(&BenchWorker::onTypedProto);
+        registers(MapProto::ProtoType(), (OpenThreadHandle)&BenchWorker::onMapProto);
+    }
+    void onTypedProto(const TypedProto&) { Handled_.fetch_add(1, std::memory_order_relaxed); }
+    void onMapProto(const MapProto&) { Handled_.fetch_add(1, std::memory_order_relaxed); }
+};
+
+//batches of 64, each waited for, so the mailbox never grows.
+template <class T>
+static void Pump(int pid, bool pooled, const char* bench, const char* variant)
+{
+    Handled_ = 0;
+    Probe probe;
+    int64_t sent = 0;
+    while (sent < Ops_)
+    {
+        for (int i = 0; i < 64 && sent < Ops_; ++i, ++sent)
+        {
+            std::shared_ptr<T> proto = pooled ? OpenThread::MakePooled<T>() : OpenThread::MakeShared<T>();
+            OpenThread::Send(pid, proto);
+        }
+        while (Handled_ < sent) std::this_thread::yield();
+    }
+    probe.report(bench, variant, Ops_);
+}
+
+static void BenchThread()
+{
+    OpenThreadRef ref = OpenThread::Create("microthread", OnThreadMsg);
+    OpenThread::Sleep(10);
+    Pump<TypedProto>(ref.pid(), false, "thread", "send->run MakeShared");
+    Pump<TypedProto>(ref.pid(), true, "thread", "send->run MakePooled");
+    ref.stop();
+}
+
+static void BenchWorkerDispatch()
+{
+    BenchWorker worker("microworker");
+    worker.start();
+    OpenThread::Sleep(10);
+    Pump<TypedProto>(worker.pid(), true, "worker", "onMsg typed");
+    Pump<MapProto>(worker.pid(), true, "worker", "onMsg protoType map");
+    worker.stop();
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) Ops_ = atoll(argv[1]);
+    if (Ops_ <= 0) Ops_ = 200000;
+
+    BenchReserveId(1);
+    BenchReserveId(2);
+    BenchReserveId(4);
+    BenchReserveFull();
+    BenchCtrl();
+    BenchSend(true);
+    BenchSend(false);
+    BenchSendThreads(1);
+    BenchSendThreads(2);
+    BenchSendThreads(4);
+    BenchSendShared(1);
+    BenchSendShared(2);
+    BenchSendShared(4);
+    BenchPairBaseline();
+    BenchForward("Msg&");
+    BenchForward("Msg*");
+    BenchForward("chunk");
+    BenchThread();
+    BenchWorkerDispatch();
+
+    OpenThread::StopAll();
+    return 0;
+}
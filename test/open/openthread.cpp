@@ -11,6 +11,9 @@
 #include <assert.h>
 #include <stdio.h>
 #include <string>
+#include <new>
+#include <thread>
+#include <chrono>
 #include <stdint.h>
 #include <time.h>
 #include <assert.h>
@@ -33,6 +36,24 @@ extern "C" {
 #include <sys/time.h>
 #endif
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <dirent.h>
+#endif
+#include "socket_affinity.h"
+
+//USDT probes of provider "openthread", built like the "opensocket" ones (src/socket_probe.h):
+//  enqueue(pid, node)  message pushed to the mailbox of thread pid
+//  dequeue(pid, node)  message taken by thread pid, node pairs it with its enqueue
+#if defined(OPENSOCKET_USDT) && defined(__linux__)
+#include <sys/sdt.h>
+#define OPENTHREAD_PROBE2(name, a, b) DTRACE_PROBE2(openthread, name, a, b)
+#else
+#define OPENTHREAD_PROBE2(name, a, b)
+#endif
+
 namespace open
 {
 
@@ -62,93 +83,141 @@ const std::string& OpenThread::Msg::name() const
     return empty;
 }
 
-// SafeQueue
-OpenThread::SafeQueue::SafeQueue()
+// Mailbox
+OpenThread::Mailbox::Mailbox()
+    :head_(&stub_),
+    tail_(&stub_),
+    popCount_(0),
+    capacity_(0),
+    size_(0)
 {
-    head_.next_ = 0;
-    tail_ = &head_;
-    writeId_ = 0;
-    readId_  = 0;
 }
 
-OpenThread::SafeQueue::~SafeQueue()
+OpenThread::Mailbox::Mailbox(const Mailbox&)
+    :head_(&stub_),
+    tail_(&stub_),
+    popCount_(0),
+    capacity_(0),
+    size_(0)
+{
+    assert(false);
+}
+
+OpenThread::Mailbox::~Mailbox()
 {
     clear();
-    assert(vectCache_.empty());
 }
 
-void OpenThread::SafeQueue::clear()
+void OpenThread::Mailbox::clear()
 {
-    popAll();
-    for (size_t i = 0; i < vectCache_.size(); i++)
+    Node* node = 0;
+    while ((node = pop()))
     {
-        if (vectCache_[i]->id_ != readId_)
-        {
-            assert(false);
-        }
-        ++readId_;
-        delete vectCache_[i];
+        OpenThread::DeleteNode(node);
     }
-    vectCache_.clear();
-    readId_  = 0;
-    writeId_ = 0;
 }
 
-void OpenThread::SafeQueue::popAll()
+void OpenThread::Mailbox::link(Node* node)
 {
-    //spinLock_.lock();
-    Node* node = head_.next_;
-    head_.next_ = 0;
-    tail_ = &head_;
-    //spinLock_.unlock();
-    if (node)
+    node->next_.store(0, std::memory_order_relaxed);
+    Node* prev = head_.exchange(node);
+    prev->next_.store(node, std::memory_order_release);
+}
+
+bool OpenThread::Mailbox::push(Node* node, bool force)
+{
+    //pops are credited back to size_ in batches of at most half the capacity, see pop():
+    //a bounded mailbox looks at most that much fuller than it is.
+    size_t size = size_.fetch_add(1, std::memory_order_relaxed);
+    if (!force && capacity_ > 0 && size >= capacity_)
     {
-        assert(vectCache_.empty());
-        Node* tmpNode = 0;
-        while (node)
-        {
-            vectCache_.push_back(node);
-            tmpNode = node->next_;
-            node->next_ = 0;
-            node = tmpNode;
-        }
+        size_.fetch_sub(1, std::memory_order_relaxed);
+        return false;
     }
+    link(node);
+    return true;
 }
 
-void OpenThread::SafeQueue::popAll(std::queue<Node*>& queueCache)
+OpenThread::Node* OpenThread::Mailbox::pop()
 {
-    popAll();
-    if (vectCache_.empty())
+    Node* tail = tail_;
+    Node* next = tail->next_.load(std::memory_order_acquire);
+    if (tail == &stub_)
     {
-        return;
+        if (!next) goto _empty;
+        tail_ = next;
+        tail = next;
+        next = next->next_.load(std::memory_order_acquire);
     }
-    for (size_t i = 0; i < vectCache_.size(); i++)
+    if (!next)
     {
-        if (vectCache_[i]->id_ != readId_)
-        {
-            assert(false);
-        }
-        ++readId_;
-        queueCache.push(vectCache_[i]);
+        //a producer has swapped head_ but not linked yet, or tail is the last node.
+        if (tail != head_.load(std::memory_order_acquire)) return 0;
+        link(&stub_);
+        next = tail->next_.load(std::memory_order_acquire);
+        if (!next) return 0;
+    }
+    tail_ = next;
+    if (++popCount_ >= 64 || (capacity_ > 0 && popCount_ >= capacity_ / 2))
+    {
+        size_.fetch_sub(popCount_, std::memory_order_relaxed);
+        popCount_ = 0;
+    }
+    return tail;
+_empty:
+    if (popCount_ > 0)
+    {
+        size_.fetch_sub(popCount_, std::memory_order_relaxed);
+        popCount_ = 0;
     }
-    vectCache_.clear();
+    return 0;
+}
+
+//tail_ is the next node pop() returns, unless it is the stub.
+bool OpenThread::Mailbox::empty()
+{
+    Node* tail = tail_;
+    if (tail != &stub_) return false;
+    if (tail->next_.load(std::memory_order_acquire)) return false;
+    return tail == head_.load();
 }
 
-void OpenThread::SafeQueue::push(OpenThread::Node* node)
+OpenThread::Node* OpenThread::NewNode()
 {
-    spinLock_.lock();
-    node->id_ = writeId_++;
-    tail_->next_ = node;
-    tail_ = node;
-    node->next_ = 0;
-    spinLock_.unlock();
+    return new (OpenBlockPool<sizeof(Node)>::Alloc()) Node;
+}
+
+void OpenThread::DeleteNode(Node* node)
+{
+    node->~Node();
+    OpenBlockPool<sizeof(Node)>::Free(node);
+}
+
+//the group actor running on this pthread.
+static thread_local OpenThread* CurrentActor_ = 0;
+
+//empty vectCpu allows every cpu again.
+static bool ApplyAffinity(pthread_t thread, const std::vector<int>& vectCpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    SocketCpuSet(&set, vectCpu);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+#else
+    (void)thread;
+    (void)vectCpu;
+    return false;
+#endif
 }
 
 //OpenThread
 OpenThread::OpenThread(const std::string& name)
     :state_(STOP),
     name_(name),
-    pool_(0)
+    pool_(0),
+    group_(0),
+    scheduled_(false),
+    needStart_(false)
 {
     cb_ = 0;
     pid_ = -1;
@@ -156,8 +225,16 @@ OpenThread::OpenThread(const std::string& name)
     totalCount_ = 0;
     cpuCost_   = 0;
     cpuStart_  = 0;
+    spinCost_  = 0;
+    yieldCost_ = 0;
+    parkCost_  = 0;
+    parkCount_ = 0;
+    spinUs_    = 0;
+    yieldUs_   = 0;
 
     isIdle_ = false;
+    parked_ = 0;
+    profile_ = false;
     custom_ = 0;
     memset(&threadId_, 0, sizeof(threadId_));
 
@@ -169,13 +246,24 @@ OpenThread::OpenThread(const OpenThread&)
 {
     assert(false);
     pool_ = 0;
+    group_ = 0;
+    scheduled_ = false;
+    needStart_ = false;
     cb_ = 0;
     pid_ = -1;
     leftCount_ = 0;
     totalCount_ = 0;
     cpuCost_ = 0;
     cpuStart_ = 0;
+    spinCost_ = 0;
+    yieldCost_ = 0;
+    parkCost_ = 0;
+    parkCount_ = 0;
+    spinUs_ = 0;
+    yieldUs_ = 0;
     isIdle_ = false;
+    parked_ = 0;
+    profile_ = false;
     custom_ = 0;
     memset(&threadId_, 0, sizeof(threadId_));
 
@@ -194,7 +282,7 @@ OpenThread::~OpenThread()
     pthread_cond_destroy(&cond_);
 }
 
-bool OpenThread::start(void (*cb)(const Msg&))
+bool OpenThread::start(void (*cb)(const Msg&), OpenThreadGroup* group)
 {
     if (!pool_)
     {
@@ -230,14 +318,37 @@ bool OpenThread::start(void (*cb)(const Msg&))
     state_ = START;
 
     cb_ = cb;
-    readId_ = 0;
     leftCount_ = 0;
     totalCount_ = 0;
 
     cpuCost_ = 0;
     cpuStart_ = 0;
+    spinCost_ = 0;
+    yieldCost_ = 0;
+    parkCost_ = 0;
+    parkCount_ = 0;
 
     memset(&threadId_, 0, sizeof(threadId_));
+    group_ = group;
+    if (group_)
+    {
+        if (!group_->isRunning())
+        {
+            assert(false);
+            group_ = 0;
+            cb_ = 0;
+            state_ = STOP;
+            pthread_mutex_unlock(&mutex_);
+            return false;
+        }
+        //the first slice on the group delivers START before any message.
+        needStart_ = true;
+        scheduled_ = true;
+        state_ = RUN;
+        pthread_mutex_unlock(&mutex_);
+        group_->schedule(this);
+        return true;
+    }
     std::shared_ptr<OpenThread>* ptr = new std::shared_ptr<OpenThread>(ref.thread_);
     int ret = pthread_create(&threadId_, NULL, (void* (*)(void*))OpenThread::Run, ptr);
     if (ret != 0)
@@ -268,13 +379,13 @@ bool OpenThread::stop()
 {
     //printf("OpenThread::stop==>>[%s]\n", name_.c_str());
     if (state_ != RUN) return false;
-    Node* node = new Node;
+    Node* node = NewNode();
     Msg& msg = node->msg_;
     msg.state_ = STOP;
     msg.thread_ = 0;
-    queue_.push(node);
-    //if (isIdle_)
-    pthread_cond_signal(&cond_);
+    msg.enqueue_ = 0;
+    queue_.push(node, true);
+    wakeup();
     return true;
 }
 
@@ -282,25 +393,77 @@ bool OpenThread::send(const std::shared_ptr<void>& data)
 {
     //printf("OpenThread::send==>>[%s]\n", name_.c_str());
     if (state_ != RUN) return false;
-    Node* node = new Node;
+    Node* node = NewNode();
     Msg& msg = node->msg_;
     msg.state_ = RUN;
     msg.data_  = data;
     msg.thread_ = 0;
-    queue_.push(node);
-    //if (isIdle_)
-    pthread_cond_signal(&cond_);
+    msg.enqueue_ = OpenTrace::IsOn() ? OpenTrace::Now() : 0;
+    OPENTHREAD_PROBE2(enqueue, pid_, node);
+    if (!queue_.push(node))
+    {
+        DeleteNode(node);
+        return false;
+    }
+    wakeup();
     return true;
 }
 
+//Only pay for the wakeup when the owner has announced it is about to park.
+void OpenThread::wakeup()
+{
+    if (group_)
+    {
+        if (scheduled_.load()) return;
+        if (scheduled_.exchange(true)) return;
+        group_->schedule(this);
+        return;
+    }
+    if (!parked_.load()) return;
+    if (!parked_.exchange(0)) return;
+#ifdef __linux__
+    syscall(SYS_futex, (int*)&parked_, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    //signal after unlock, so the woken owner does not immediately block on mutex_.
+    pthread_mutex_lock(&mutex_);
+    pthread_mutex_unlock(&mutex_);
+    pthread_cond_signal(&cond_);
+#endif
+}
+
+//start() holds mutex_ until the new thread has applied vectCpu_, so the two never overlap.
+bool OpenThread::setAffinity(const std::vector<int>& vectCpu)
+{
+    pthread_mutex_lock(&mutex_);
+    vectCpu_ = vectCpu;
+    bool ret = true;
+    if (group_)
+    {
+        ret = false;
+    }
+    else if (state_ == RUN)
+    {
+        ret = ApplyAffinity(threadId_, vectCpu_);
+    }
+    pthread_mutex_unlock(&mutex_);
+    return ret;
+}
+
+void OpenThread::setIdleStrategy(int spinUs, int yieldUs)
+{
+    spinUs_ = spinUs > 0 ? spinUs : 0;
+    yieldUs_ = yieldUs > 0 ? yieldUs : 0;
+}
+
 bool OpenThread::isCurrent()
 {
+    if (group_) return CurrentActor_ == this;
     return pthread_equal(pthread_self(), threadId_);
 }
 
 void OpenThread::waitIdle()
 {
-    if (pthread_equal(pthread_self(), threadId_))
+    if (isCurrent())
         return;
     
     while (state_ == RUN && !isIdle_) Sleep(1);
@@ -317,37 +480,25 @@ void OpenThread::Run(void* arg)
         return;
     }
     pthread_setname_np((*ptr)->threadId_, (*ptr)->name_.c_str());
+    //pin before run() allocates anything, first touch then keeps it on the local node.
+    if (!(*ptr)->vectCpu_.empty()) ApplyAffinity(pthread_self(), (*ptr)->vectCpu_);
     (*ptr)->run();
     delete ptr;
 }
 
 bool OpenThread::hasMsg()
 {
-    assert(pthread_equal(pthread_self(), threadId_));
-    if (!queueCache_.empty())
-    {
-        return true;
-    }
-    if (!queue_.empty())
-    {
-        queue_.popAll(queueCache_);
-    }
-    return !queueCache_.empty();
+    assert(isCurrent());
+    return !queue_.empty();
 }
 
 OpenThread::Node* OpenThread::popNode()
 {
-    if (!queue_.empty())
-    {
-        queue_.popAll(queueCache_);
-    }
-    Node* node = 0;
-    if (!queueCache_.empty())
+    Node* node = queue_.pop();
+    if (node)
     {
         totalCount_++;
-        leftCount_ = queueCache_.size();
-        node = queueCache_.front();
-        queueCache_.pop();
+        leftCount_ = queue_.size();
     }
     return node;
 }
@@ -367,71 +518,225 @@ void OpenThread::run()
     Node* node = 0;
     isIdle_ = false;
     bool isRunning = true;
-    assert(queueCache_.empty());
     while (state_ == RUN)
     {
         while ((node = popNode()))
         {
-            if (node->msg_.state_ == STOP)
+            if (!dispatch(node))
             {
-                node->msg_.thread_ = this;
-                if (node->id_ != readId_)
-                {
-                    printf("OpenThread[%s] node->id_:%d, readId_:%d\n", name_.c_str(), node->id_, readId_);
-                    assert(false);
-                }
-                ++readId_;
-                cb_(node->msg_);
-                delete node;
                 isRunning = false;
                 break;
             }
-            if (profile_)
-            {
-                cpuStart_ = ThreadTime();
-                node->msg_.thread_ = this;
-                if (node->id_ != readId_)
-                {
-                    printf("OpenThread[%s] node->id_:%d, readId_:%d\n", name_.c_str(), node->id_, readId_);
-                    assert(false);
-                }
-                ++readId_;
-                cb_(node->msg_);
-                cpuCost_ += ThreadTime() - cpuStart_;
-            }
-            else
-            {
-                node->msg_.thread_ = this;
-                if (node->id_ != readId_)
-                {
-                    printf("OpenThread[%s] node->id_:%d, readId_:%d\n", name_.c_str(), node->id_, readId_);
-                    assert(false);
-                }
-                ++readId_;
-                cb_(node->msg_);
-            }
-            delete node;
         }
         if (!isRunning) break;
 
         isIdle_ = true;
-        pthread_mutex_lock(&mutex_);
-        pthread_cond_wait(&cond_, &mutex_);
+        idle();
         isIdle_ = false;
-        pthread_mutex_unlock(&mutex_);
     }
     //printf("OpenThread[%s] exit\n", name_.c_str());
+    finish();
+    //printf("OpenThread[%s] exit===>>\n", name_.c_str());
+}
+
+//Returns false once the STOP message has been handled.
+bool OpenThread::dispatch(Node* node)
+{
+    node->msg_.thread_ = this;
+    if (node->msg_.state_ == STOP)
+    {
+        cb_(node->msg_);
+        DeleteNode(node);
+        return false;
+    }
+    OPENTHREAD_PROBE2(dequeue, pid_, node);
+    if (node->msg_.enqueue_)
+        callTraced(node->msg_);
+    else
+        call(node->msg_);
+    DeleteNode(node);
+    return true;
+}
+
+inline void OpenThread::call(Msg& msg)
+{
+    if (profile_)
+    {
+        cpuStart_ = ThreadTime();
+        cb_(msg);
+        cpuCost_ += ThreadTime() - cpuStart_;
+    }
+    else
+    {
+        cb_(msg);
+    }
+}
+
+void OpenThread::callTraced(Msg& msg)
+{
+    msg.start_ = OpenTrace::Now();
+    call(msg);
+    OpenTrace::Record(OpenTrace::EQueue, msg.start_ - msg.enqueue_);
+    OpenTrace::Record(OpenTrace::EHandler, OpenTrace::Now() - msg.start_);
+}
+
+//state_ goes last: once it reads STOP the pool may release this thread.
+void OpenThread::finish()
+{
+    parked_ = 0;
+    pthread_mutex_lock(&mutex_);
+    queue_.clear();
+    pthread_mutex_unlock(&mutex_);
     state_ = STOP;
+}
+
+//Its group has stopped: the messages are dropped, a pending STOP still runs, unless
+//START never did. Then the actor is finished, so join() returns.
+void OpenThread::abandon()
+{
+    OpenThread* current = CurrentActor_;
+    CurrentActor_ = this;
+    Node* node = 0;
+    while ((node = popNode()))
+    {
+        if (node->msg_.state_ == STOP && !needStart_)
+        {
+            dispatch(node);
+            break;
+        }
+        DeleteNode(node);
+    }
+    CurrentActor_ = current;
+    finish();
+}
+
+//One turn on a group pthread. Returns true if the actor still has messages
+//and must be queued again; scheduled_ stays set in that case.
+bool OpenThread::runGroup(size_t budget)
+{
+    CurrentActor_ = this;
+    isIdle_ = false;
+    if (needStart_)
+    {
+        needStart_ = false;
+        Msg msg;
+        msg.thread_ = this;
+        msg.state_ = START;
+        cb_(msg);
+    }
+    Node* node = 0;
+    size_t count = 0;
+    while ((node = popNode()))
+    {
+        if (!dispatch(node))
+        {
+            CurrentActor_ = 0;
+            finish();
+            return false;
+        }
+        if (++count >= budget)
+        {
+            CurrentActor_ = 0;
+            return true;
+        }
+    }
+    CurrentActor_ = 0;
+    isIdle_ = true;
+    //pairs with wakeup(): a sender that still saw scheduled_ set has pushed before this check.
+    scheduled_.store(false);
+    if (queue_.empty()) return false;
+    if (scheduled_.exchange(true)) return false;
+    isIdle_ = false;
+    return true;
+}
+
+void OpenThread::join()
+{
+    if (!isRunning()) return;
+    if (group_)
+    {
+        while (isRunning()) Sleep(1);
+        return;
+    }
+    pthread_join(threadId_, NULL);
+}
+
+static inline void CpuRelax()
+{
+#if defined(_MSC_VER)
+    YieldProcessor();
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+//spin, then yield, then park. Returns as soon as the mailbox has something.
+void OpenThread::idle()
+{
+    int spinUs = spinUs_.load(std::memory_order_relaxed);
+    int yieldUs = yieldUs_.load(std::memory_order_relaxed);
+    int64_t begin = (profile_ || spinUs > 0 || yieldUs > 0) ? SteadyTime() : 0;
+    int64_t end = 0;
+    if (spinUs > 0)
+    {
+        int count = 0;
+        while (queue_.empty())
+        {
+            CpuRelax();
+            if (++count < 64) continue;
+            count = 0;
+            if (SteadyTime() - begin >= spinUs) break;
+        }
+        end = SteadyTime();
+        if (profile_) spinCost_ += end - begin;
+        begin = end;
+        if (!queue_.empty()) return;
+    }
+    if (yieldUs > 0)
+    {
+        while (queue_.empty() && SteadyTime() - begin < yieldUs)
+        {
+            std::this_thread::yield();
+        }
+        end = SteadyTime();
+        if (profile_) yieldCost_ += end - begin;
+        begin = end;
+        if (!queue_.empty()) return;
+    }
+    park();
+    if (profile_)
+    {
+        parkCost_ += SteadyTime() - begin;
+        ++parkCount_;
+    }
+}
+
+void OpenThread::park()
+{
+    //announce the park before the last look at the mailbox; senders check parked_ after pushing.
+    parked_.store(1);
+    if (!queue_.empty())
+    {
+        //a sender may be preempted between claiming head_ and linking; let it finish.
+        parked_.store(0);
+        std::this_thread::yield();
+        return;
+    }
+#ifdef __linux__
+    while (parked_.load() == 1)
+    {
+        syscall(SYS_futex, (int*)&parked_, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+    }
+#else
     pthread_mutex_lock(&mutex_);
-    while (!queueCache_.empty())
+    while (parked_.load())
     {
-        node = queueCache_.front();
-        queueCache_.pop();
-        delete node;
+        pthread_cond_wait(&cond_, &mutex_);
     }
-    queue_.clear();
     pthread_mutex_unlock(&mutex_);
-    //printf("OpenThread[%s] exit===>>\n", name_.c_str());
+#endif
 }
 
 // static method
@@ -551,6 +856,16 @@ void OpenThread::ThreadJoinAll()
 
 //OpenThreader
 bool OpenThreader::start()
+{
+    return startThread(0);
+}
+
+bool OpenThreader::start(OpenThreadGroup& group)
+{
+    return startThread(&group);
+}
+
+bool OpenThreader::startThread(OpenThreadGroup* group)
 {
     auto threadRef = OpenThread::Thread(name_);
     if (threadRef)
@@ -568,8 +883,7 @@ bool OpenThreader::start()
         pid_ = thread_->pid();
         assert(!thread_->isRunning());
         thread_->setCustom(this);
-        thread_->start(OpenThreader::Thread);
-        return true;
+        return thread_->start(OpenThreader::Thread, group);
     }
     return false;
 }
@@ -1155,7 +1469,7 @@ void OpenThreadPool::threadJoin(const std::shared_ptr<OpenThread>& sptr)
 {
     if (sptr && sptr->isRunning())
     {
-        pthread_join(sptr->threadId_, NULL);
+        sptr->join();
     }
 }
 
@@ -1174,7 +1488,7 @@ void OpenThreadPool::threadJoin(const std::vector<int>& vectPid)
         {
             assert(sptr->pool_ == this);
             assert(sptr->pid() == vectPid[i]);
-            pthread_join(sptr->threadId_, NULL);
+            sptr->join();
         }
     }
 }
@@ -1194,7 +1508,7 @@ void OpenThreadPool::threadJoin(const std::vector<std::string>& vectName)
         {
             assert(sptr->pool_ == this);
             assert(sptr->name() == vectName[i]);
-            pthread_join(sptr->threadId_, NULL);
+            sptr->join();
         }
     }
 }
@@ -1210,17 +1524,299 @@ void OpenThreadPool::threadJoinAll()
         {
             assert(sptr->pool_ == this);
             assert(sptr->pid() == i);
-            pthread_join(sptr->threadId_, NULL);
+            sptr->join();
+        }
+    }
+}
+
+
+// OpenThreadGroup
+thread_local OpenThreadGroup::Worker* OpenThreadGroup::Current_ = 0;
+
+OpenThreadGroup::Deque::Deque()
+    :top_(0),
+    bottom_(0)
+{
+    for (size_t i = 0; i < ECapacity; ++i)
+    {
+        buffer_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+bool OpenThreadGroup::Deque::push(OpenThread* actor)
+{
+    int64_t bottom = bottom_.load(std::memory_order_relaxed);
+    int64_t top = top_.load(std::memory_order_acquire);
+    if (bottom - top >= ECapacity) return false;
+    buffer_[bottom & (ECapacity - 1)].store(actor, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(bottom + 1, std::memory_order_relaxed);
+    return true;
+}
+
+OpenThread* OpenThreadGroup::Deque::pop()
+{
+    int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+    bottom_.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t top = top_.load(std::memory_order_relaxed);
+    if (top > bottom)
+    {
+        bottom_.store(bottom + 1, std::memory_order_relaxed);
+        return 0;
+    }
+    OpenThread* actor = buffer_[bottom & (ECapacity - 1)].load(std::memory_order_relaxed);
+    if (top == bottom)
+    {
+        //last one, race the thieves for it.
+        if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        {
+            actor = 0;
+        }
+        bottom_.store(bottom + 1, std::memory_order_relaxed);
+    }
+    return actor;
+}
+
+OpenThread* OpenThreadGroup::Deque::steal()
+{
+    int64_t top = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t bottom = bottom_.load(std::memory_order_acquire);
+    if (top >= bottom) return 0;
+    OpenThread* actor = buffer_[top & (ECapacity - 1)].load(std::memory_order_relaxed);
+    if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+    {
+        return 0;
+    }
+    return actor;
+}
+
+OpenThreadGroup::OpenThreadGroup()
+    :budget_(64),
+    isRunning_(false),
+    injectSize_(0),
+    sleepers_(0)
+{
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_mutex_init(&sleepMutex_, NULL);
+    pthread_cond_init(&cond_, NULL);
+}
+
+OpenThreadGroup::OpenThreadGroup(const OpenThreadGroup&)
+    :budget_(64),
+    isRunning_(false),
+    injectSize_(0),
+    sleepers_(0)
+{
+    assert(false);
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_mutex_init(&sleepMutex_, NULL);
+    pthread_cond_init(&cond_, NULL);
+}
+
+OpenThreadGroup::~OpenThreadGroup()
+{
+    stop();
+    pthread_mutex_destroy(&mutex_);
+    pthread_mutex_destroy(&sleepMutex_);
+    pthread_cond_destroy(&cond_);
+}
+
+bool OpenThreadGroup::start(size_t threadNum, const std::string& name)
+{
+    if (isRunning_ || threadNum == 0)
+    {
+        assert(false);
+        return false;
+    }
+    name_ = name;
+    isRunning_ = true;
+    for (size_t i = 0; i < threadNum; ++i)
+    {
+        Worker* worker = new Worker;
+        worker->index_ = i;
+        worker->group_ = this;
+        memset(&worker->threadId_, 0, sizeof(worker->threadId_));
+        vectWorker_.push_back(worker);
+    }
+    for (size_t i = 0; i < vectWorker_.size(); ++i)
+    {
+        Worker* worker = vectWorker_[i];
+        if (pthread_create(&worker->threadId_, NULL, OpenThreadGroup::Run, worker) != 0)
+        {
+            printf("OpenThreadGroup::start[%s] pthread_create failed\n", name_.c_str());
+            assert(false);
+            vectWorker_.resize(i);
+            delete worker;
+            break;
         }
     }
+    return !vectWorker_.empty();
+}
+
+//The actors still queued are abandoned, and so is any actor scheduled from now on.
+void OpenThreadGroup::stop()
+{
+    if (!isRunning_) return;
+    isRunning_ = false;
+    pthread_mutex_lock(&sleepMutex_);
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&sleepMutex_);
+    std::vector<OpenThread*> vectActor;
+    OpenThread* actor = 0;
+    for (size_t i = 0; i < vectWorker_.size(); ++i)
+    {
+        pthread_join(vectWorker_[i]->threadId_, NULL);
+        while ((actor = vectWorker_[i]->deque_.pop())) vectActor.push_back(actor);
+        delete vectWorker_[i];
+    }
+    vectWorker_.clear();
+    pthread_mutex_lock(&mutex_);
+    vectActor.insert(vectActor.end(), injectQueue_.begin(), injectQueue_.end());
+    injectQueue_.clear();
+    injectSize_ = 0;
+    pthread_mutex_unlock(&mutex_);
+    for (size_t i = 0; i < vectActor.size(); ++i) vectActor[i]->abandon();
+}
+
+//A group pthread keeps the actor it woke on its own deque, so the receiver
+//runs next while the data is still in cache. Anyone else goes through the inject queue.
+void OpenThreadGroup::schedule(OpenThread* actor)
+{
+    Worker* worker = Current_;
+    if (!worker || worker->group_ != this || !worker->deque_.push(actor))
+    {
+        inject(actor);
+        return;
+    }
+    //order the bottom_ store before reading sleepers_.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers_.load() > 0) notify();
 }
 
+void OpenThreadGroup::inject(OpenThread* actor)
+{
+    //under mutex_: stop() drains the queue under it once isRunning_ is false.
+    pthread_mutex_lock(&mutex_);
+    if (!isRunning_)
+    {
+        pthread_mutex_unlock(&mutex_);
+        actor->abandon();
+        return;
+    }
+    injectQueue_.push_back(actor);
+    ++injectSize_;
+    pthread_mutex_unlock(&mutex_);
+    if (sleepers_.load() > 0) notify();
+}
+
+OpenThread* OpenThreadGroup::find(Worker* worker)
+{
+    OpenThread* actor = worker->deque_.pop();
+    if (actor) return actor;
+    if (injectSize_.load() > 0)
+    {
+        pthread_mutex_lock(&mutex_);
+        if (!injectQueue_.empty())
+        {
+            actor = injectQueue_.front();
+            injectQueue_.pop_front();
+            --injectSize_;
+        }
+        pthread_mutex_unlock(&mutex_);
+        if (actor) return actor;
+    }
+    size_t size = vectWorker_.size();
+    for (size_t i = 1; i < size; ++i)
+    {
+        actor = vectWorker_[(worker->index_ + i) % size]->deque_.steal();
+        if (actor) return actor;
+    }
+    return 0;
+}
+
+bool OpenThreadGroup::hasWork()
+{
+    if (injectSize_.load() > 0) return true;
+    for (size_t i = 0; i < vectWorker_.size(); ++i)
+    {
+        if (!vectWorker_[i]->deque_.empty()) return true;
+    }
+    return false;
+}
+
+//sleepers_ is raised before the last look for work; schedule() reads it after publishing work.
+void OpenThreadGroup::sleep()
+{
+    pthread_mutex_lock(&sleepMutex_);
+    ++sleepers_;
+    if (isRunning_ && !hasWork())
+    {
+        pthread_cond_wait(&cond_, &sleepMutex_);
+    }
+    --sleepers_;
+    pthread_mutex_unlock(&sleepMutex_);
+}
+
+void OpenThreadGroup::notify()
+{
+    pthread_mutex_lock(&sleepMutex_);
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&sleepMutex_);
+}
+
+void OpenThreadGroup::run(Worker* worker)
+{
+    Current_ = worker;
+    OpenThread* actor = 0;
+    while (isRunning_)
+    {
+        actor = find(worker);
+        if (!actor)
+        {
+            sleep();
+            continue;
+        }
+        //out of budget: go behind the actors that are already waiting.
+        if (actor->runGroup(budget_)) inject(actor);
+    }
+    Current_ = 0;
+}
+
+bool OpenThreadGroup::setAffinity(const std::vector<int>& vectCpu)
+{
+    bool ret = true;
+    pthread_mutex_lock(&mutex_);
+    vectCpu_ = vectCpu;
+    for (size_t i = 0; i < vectWorker_.size(); ++i)
+    {
+        if (!ApplyAffinity(vectWorker_[i]->threadId_, vectCpu_)) ret = false;
+    }
+    pthread_mutex_unlock(&mutex_);
+    return ret;
+}
+
+void* OpenThreadGroup::Run(void* arg)
+{
+    Worker* worker = (Worker*)arg;
+    OpenThreadGroup* group = worker->group_;
+    char name[16] = {0};
+    snprintf(name, sizeof(name), "%.10s%d", group->name_.c_str(), (int)worker->index_);
+    pthread_setname_np(pthread_self(), name);
+    pthread_mutex_lock(&group->mutex_);
+    std::vector<int> vectCpu = group->vectCpu_;
+    pthread_mutex_unlock(&group->mutex_);
+    if (!vectCpu.empty()) ApplyAffinity(pthread_self(), vectCpu);
+    group->run(worker);
+    return 0;
+}
 
 // OpenThreadRef
-bool OpenThreadRef::start(void (*cb)(OpenThreadMsg&))
+bool OpenThreadRef::start(void (*cb)(OpenThreadMsg&), OpenThreadGroup* group)
 {
     OpenThread* ptr = thread_.get();
-    return ptr ? ptr->start(cb) : false;
+    return ptr ? ptr->start(cb, group) : false;
 }
 
 bool OpenThreadRef::stop()
@@ -1295,7 +1891,7 @@ bool OpenThreadWorker::send(int pid, const std::shared_ptr<void>& data)
     if (proto)
     {
         proto->srcPid_ = pid_;
-        proto->srcName_ = name_;
+        proto->srcName_.clear();
     }
     return OpenThread::Send(pid, data);
 }
@@ -1311,7 +1907,7 @@ bool OpenThreadWorker::send(std::vector<int>& vectPid, const std::shared_ptr<voi
     if (proto)
     {
         proto->srcPid_ = pid_;
-        proto->srcName_ = name_;
+        proto->srcName_.clear();
     }
     return OpenThread::Send(vectPid, data);
 }
@@ -1327,7 +1923,7 @@ bool OpenThreadWorker::sendLoop(const std::shared_ptr<void>& data)
     if (proto)
     {
         proto->srcPid_ = pid_;
-        proto->srcName_ = name_;
+        proto->srcName_.clear();
     }
     return OpenThread::Send(pid_, data);
 }
@@ -1356,6 +1952,13 @@ void OpenThreadWorker::onMsg(OpenThreadMsg& msg)
 {
     const OpenThreadProto* proto = msg.data<OpenThreadProto>();
     if (!proto) return;
+    size_t id = (size_t)proto->typeId_;
+    if (id > 0 && id < vectHandle_.size() && vectHandle_[id].call_)
+    {
+        const TypedHandle& handle = vectHandle_[id];
+        handle.call_(*this, *proto, handle.handle_.get());
+        return;
+    }
     std::map<int, OpenThreadHandle>::iterator iter = mapHandle_.find(proto->protoType());
     if (iter != mapHandle_.end())
     {
@@ -1366,6 +1969,101 @@ void OpenThreadWorker::onMsg(OpenThreadMsg& msg)
 }
 
 
+//OpenTrace
+std::atomic<bool> OpenTrace::On_(false);
+std::atomic<uint64_t> OpenTrace::Buckets_[OpenTrace::EStageMax][OpenTrace::BucketCount];
+std::atomic<int64_t> OpenTrace::Max_[OpenTrace::EStageMax];
+
+int64_t OpenTrace::Now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//below 8 exact, then 8 buckets per power of two.
+static inline int TraceIndex(uint64_t ns)
+{
+    if (ns < 8) return (int)ns;
+    int msb = 63;
+    while (!(ns >> msb)) --msb;
+    int shift = msb - 3;
+    return ((shift + 1) << 3) + (int)((ns >> shift) & 7);
+}
+
+static inline int64_t TraceValue(int index)
+{
+    if (index < 8) return index;
+    int shift = (index >> 3) - 1;
+    return ((int64_t)(8 + (index & 7)) << shift) + (((int64_t)1 << shift) >> 1);
+}
+
+void OpenTrace::Record(Stage stage, int64_t ns)
+{
+    if (stage < 0 || stage >= EStageMax) return;
+    if (ns < 0) ns = 0;
+    Buckets_[stage][TraceIndex((uint64_t)ns)].fetch_add(1, std::memory_order_relaxed);
+    int64_t max = Max_[stage].load(std::memory_order_relaxed);
+    while (ns > max && !Max_[stage].compare_exchange_weak(max, ns, std::memory_order_relaxed)) {}
+}
+
+void OpenTrace::Summarize(Stage stage, Summary& summary)
+{
+    memset(&summary, 0, sizeof(summary));
+    if (stage < 0 || stage >= EStageMax) return;
+    std::vector<uint64_t> counts(BucketCount);
+    for (int i = 0; i < BucketCount; ++i)
+    {
+        counts[i] = Buckets_[stage][i].load(std::memory_order_relaxed);
+        summary.count_ += counts[i];
+    }
+    summary.max_ = Max_[stage].load(std::memory_order_relaxed);
+    if (summary.count_ == 0) return;
+    const double percents[3] = { 50, 99, 99.9 };
+    int64_t* values[3] = { &summary.p50_, &summary.p99_, &summary.p999_ };
+    for (int k = 0; k < 3; ++k)
+    {
+        uint64_t rank = (uint64_t)(percents[k] / 100 * summary.count_ + 0.5);
+        if (rank < 1) rank = 1;
+        uint64_t count = 0;
+        for (int i = 0; i < BucketCount; ++i)
+        {
+            count += counts[i];
+            if (count < rank) continue;
+            int64_t value = TraceValue(i);
+            *values[k] = value < summary.max_ ? value : summary.max_;
+            break;
+        }
+    }
+}
+
+const char* OpenTrace::StageName(Stage stage)
+{
+    switch (stage)
+    {
+    case EReady: return "ready";
+    case EForward: return "forward";
+    case EQueue: return "queue";
+    case EHandler: return "handler";
+    default: return "";
+    }
+}
+
+void OpenTrace::Clear()
+{
+    for (int stage = 0; stage < EStageMax; ++stage)
+    {
+        for (int i = 0; i < BucketCount; ++i) Buckets_[stage][i].store(0, std::memory_order_relaxed);
+        Max_[stage].store(0, std::memory_order_relaxed);
+    }
+}
+
+//OpenThreadTypeId
+int OpenThreadTypeId::Next()
+{
+    static std::atomic<int> Count_(0);
+    return ++Count_;
+}
+
 //OpenSync
 OpenSync::OpenSyncRef::OpenSyncRef()
 {
@@ -1421,6 +2119,82 @@ void OpenThread::Sleep(int64_t milliSecond)
 #endif
 }
 
+//monotonic microseconds
+int64_t OpenThread::SteadyTime()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int OpenThread::CurrentCpu()
+{
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+    return (int)GetCurrentProcessorNumber();
+#elif defined(__linux__)
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+}
+
+int OpenThread::CpuNode(int cpu)
+{
+    int node = -1;
+    if (cpu < 0) return node;
+#ifdef __linux__
+    char path[64] = {0};
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR* dir = opendir(path);
+    if (!dir) return node;
+    struct dirent* entry = 0;
+    while ((entry = readdir(dir)))
+    {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+        {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+#endif
+    return node;
+}
+
+//cpulist looks like "0-3,8-11".
+bool OpenThread::NodeCpus(int node, std::vector<int>& vectCpu)
+{
+    vectCpu.clear();
+    if (node < 0) return false;
+#ifdef __linux__
+    char path[64] = {0};
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE* file = fopen(path, "r");
+    if (!file) return false;
+    char line[1024] = {0};
+    char* ptr = fgets(line, sizeof(line), file);
+    fclose(file);
+    while (ptr && *ptr >= '0' && *ptr <= '9')
+    {
+        int begin = (int)strtol(ptr, &ptr, 10);
+        int end = begin;
+        if (*ptr == '-') end = (int)strtol(ptr + 1, &ptr, 10);
+        for (int i = begin; i <= end; ++i) vectCpu.push_back(i);
+        if (*ptr != ',') break;
+        ++ptr;
+    }
+#endif
+    return !vectCpu.empty();
+}
+
+bool OpenThread::Colocate(int pid, int cpu)
+{
+    std::shared_ptr<OpenThread> sptr = DefaultPool_.thread(pid);
+    if (!sptr || cpu < 0) return false;
+    std::vector<int> vectCpu;
+    if (!NodeCpus(CpuNode(cpu), vectCpu)) vectCpu.push_back(cpu);
+    return sptr->setAffinity(vectCpu);
+}
+
 int64_t OpenThread::MilliUnixtime()
 {
 #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
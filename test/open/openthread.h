@@ -15,9 +15,11 @@
 #include <string>
 #include <vector>
 #include <queue>
+#include <deque>
 #include <atomic>
 #include <assert.h>
 #include <map>
+#include <type_traits>
 
 #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
 #ifdef __cplusplus
@@ -68,6 +70,169 @@ namespace open
 
 class OpenThreadRef;
 class OpenThreadPool;
+class OpenThreadGroup;
+
+////////////OpenBlockPool//////////////////////
+//Recycles fixed-size blocks. Every thread keeps a private free list and spills it
+//to a shared stack when it grows too long; an empty thread takes the whole stack.
+//Blocks freed after the thread's cache is gone (statics released at exit, after the
+//main thread's thread_locals) go straight to the shared stack.
+template <size_t SIZE>
+class OpenBlockPool
+{
+    struct Block
+    {
+        Block* next_;
+    };
+    struct Cache
+    {
+        Block* head_;
+        Block* tail_;
+        size_t size_;
+        Cache() :head_(0), tail_(0), size_(0) {}
+        ~Cache()
+        {
+            Dead_ = true;
+            Block* block = 0;
+            while ((block = head_))
+            {
+                head_ = block->next_;
+                ::operator delete(block);
+            }
+        }
+    };
+    static std::atomic<Block*> Shared_;
+    static thread_local Cache Cache_;
+    //trivially destructible, still readable once Cache_ is destroyed.
+    static thread_local bool Dead_;
+    static void Push(Block* head, Block* tail)
+    {
+        Block* top = Shared_.load(std::memory_order_relaxed);
+        do {
+            tail->next_ = top;
+        } while (!Shared_.compare_exchange_weak(top, head, std::memory_order_release, std::memory_order_relaxed));
+    }
+public:
+    enum { ECacheSize = 256 };
+    static void* Alloc()
+    {
+        if (Dead_) return ::operator new(SIZE < sizeof(Block) ? sizeof(Block) : SIZE);
+        Cache& cache = Cache_;
+        if (!cache.head_)
+        {
+            Block* block = Shared_.exchange(0, std::memory_order_acquire);
+            if (!block) return ::operator new(SIZE < sizeof(Block) ? sizeof(Block) : SIZE);
+            cache.head_ = block;
+            cache.size_ = 1;
+            while (block->next_)
+            {
+                block = block->next_;
+                ++cache.size_;
+            }
+            cache.tail_ = block;
+        }
+        Block* block = cache.head_;
+        cache.head_ = block->next_;
+        if (!cache.head_) cache.tail_ = 0;
+        --cache.size_;
+        return block;
+    }
+    static void Free(void* ptr)
+    {
+        if (!ptr) return;
+        Block* block = (Block*)ptr;
+        if (Dead_)
+        {
+            Push(block, block);
+            return;
+        }
+        Cache& cache = Cache_;
+        block->next_ = cache.head_;
+        cache.head_ = block;
+        if (!cache.tail_) cache.tail_ = block;
+        if (++cache.size_ < ECacheSize) return;
+        Push(cache.head_, cache.tail_);
+        cache.head_ = 0;
+        cache.tail_ = 0;
+        cache.size_ = 0;
+    }
+};
+template <size_t SIZE>
+std::atomic<typename OpenBlockPool<SIZE>::Block*> OpenBlockPool<SIZE>::Shared_(0);
+template <size_t SIZE>
+thread_local typename OpenBlockPool<SIZE>::Cache OpenBlockPool<SIZE>::Cache_;
+template <size_t SIZE>
+thread_local bool OpenBlockPool<SIZE>::Dead_ = false;
+
+////////////OpenBlockAllocator//////////////////////
+//std allocator over OpenBlockPool, for std::allocate_shared.
+template <class T>
+class OpenBlockAllocator
+{
+public:
+    typedef T value_type;
+    OpenBlockAllocator() {}
+    template <class U>
+    OpenBlockAllocator(const OpenBlockAllocator<U>&) {}
+    T* allocate(size_t n)
+    {
+        if (n == 1) return (T*)OpenBlockPool<sizeof(T)>::Alloc();
+        return (T*)::operator new(n * sizeof(T));
+    }
+    void deallocate(T* p, size_t n)
+    {
+        if (n == 1) OpenBlockPool<sizeof(T)>::Free(p);
+        else ::operator delete(p);
+    }
+    template <class U>
+    bool operator==(const OpenBlockAllocator<U>&) const { return true; }
+    template <class U>
+    bool operator!=(const OpenBlockAllocator<U>&) const { return false; }
+};
+
+////////////OpenTrace//////////////////////
+//Per-stage latency of traced messages, aggregated over all threads:
+//  EReady    socket event seen (epoll_wait returned) -> OpenSocket callback entered
+//  EForward  OpenSocket callback -> OpenThread::send (the dispatcher)
+//  EQueue    OpenThread::send -> handler start, mailbox wait and wakeup
+//  EHandler  handler run time
+//OpenThread records EQueue/EHandler for what send() stamped while SetOn(true);
+//the socket stages are recorded by the dispatcher (see OpenSocketDispatch).
+//Buckets are log2 split in 8 (~12%), lock free. Off: one branch per site.
+class OpenTrace
+{
+public:
+    enum Stage
+    {
+        EReady,
+        EForward,
+        EQueue,
+        EHandler,
+        EStageMax
+    };
+    struct Summary
+    {
+        uint64_t count_;
+        int64_t p50_;
+        int64_t p99_;
+        int64_t p999_;
+        int64_t max_;
+    };
+    static inline bool IsOn() { return On_.load(std::memory_order_relaxed); }
+    static inline void SetOn(bool on) { On_.store(on, std::memory_order_relaxed); }
+    //steady_clock nanoseconds, the clock of OpenSocket::Msg::ready_/forward_.
+    static int64_t Now();
+    static void Record(Stage stage, int64_t ns);
+    //nanoseconds.
+    static void Summarize(Stage stage, Summary& summary);
+    static const char* StageName(Stage stage);
+    static void Clear();
+private:
+    enum { SubBits = 3, BucketCount = 64 << SubBits };
+    static std::atomic<bool> On_;
+    static std::atomic<uint64_t> Buckets_[EStageMax][BucketCount];
+    static std::atomic<int64_t> Max_[EStageMax];
+};
 
 ////////////OpenThread//////////////////////
 class OpenThread
@@ -83,11 +248,15 @@ public:
     {
         OpenThread* thread_;
         std::shared_ptr<void> data_;
-        Msg():thread_(0), data_(0), state_(START) {};
-        Msg(const Msg&) :thread_(0), data_(0), state_(START){}
+        Msg():thread_(0), data_(0), state_(START), enqueue_(0), start_(0) {};
+        Msg(const Msg&) :thread_(0), data_(0), state_(START), enqueue_(0), start_(0) {}
         void operator=(const Msg&) {}
     public:
         State state_;
+        //OpenTrace on at send(): steady_clock nanoseconds of send() and of the
+        //handler's start. 0 when not traced.
+        int64_t enqueue_;
+        int64_t start_;
         template <class T>
         inline const T* data() const { return dynamic_cast<const T*>((const T*)data_.get()); }
         template <class T>
@@ -102,7 +271,8 @@ public:
     friend class Msg;
 
     ~OpenThread();
-    bool start(void (*cb)(const Msg&));
+    //With a group the thread becomes an actor multiplexed over the group's pthreads.
+    bool start(void (*cb)(const Msg&), OpenThreadGroup* group = 0);
     bool stop();
     bool send(const std::shared_ptr<void>& data);
     bool isCurrent();
@@ -114,15 +284,42 @@ public:
 
     inline int pid() { return pid_; }
     inline const std::string& name() { return name_; }
+    inline OpenThreadGroup* group() { return group_; }
     inline size_t& totalCount() { return totalCount_; }
     inline size_t& leftCount() { return leftCount_; }
     inline int64_t& cpuCost() { return cpuCost_; }
     inline int64_t& cpuStart() { return cpuStart_; }
 
+    //0 is unbounded. A bounded mailbox makes send() fail when it is full.
+    inline void setCapacity(size_t capacity) { queue_.setCapacity(capacity); }
+    inline size_t capacity() { return queue_.capacity(); }
+
+    //When the mailbox runs dry: busy-spin for spinUs, then yield for yieldUs, then park.
+    //The default 0/0 parks at once. Spinning trades CPU for wakeup latency.
+    void setIdleStrategy(int spinUs, int yieldUs);
+    inline void setProfile(bool profile) { profile_ = profile; }
+    //Idle phase costs in microseconds, collected while profile_ is on.
+    inline int64_t& spinCost() { return spinCost_; }
+    inline int64_t& yieldCost() { return yieldCost_; }
+    inline int64_t& parkCost() { return parkCost_; }
+    inline size_t& parkCount() { return parkCount_; }
+
+    //Pin to vectCpu, empty clears the mask. Set before start() it is the thread's first step,
+    //so the pools and buffers it touches first are placed on its NUMA node. Linux only.
+    //A group actor runs on the group's pthreads, see OpenThreadGroup::setAffinity.
+    bool setAffinity(const std::vector<int>& vectCpu);
+    inline const std::vector<int>& affinity() { return vectCpu_; }
+
     template <class T>
     static std::shared_ptr<T> MakeShared()
     { 
         return std::shared_ptr<T>(new T); 
+    }
+    //T and its control block in one pooled block.
+    template <class T>
+    static std::shared_ptr<T> MakePooled()
+    {
+        return std::allocate_shared<T>(OpenBlockAllocator<T>());
     }
 	static bool Init(size_t capacity = 256, bool profile = true);
     static OpenThreadRef Create(const std::string& name);
@@ -149,8 +346,16 @@ public:
 
     static void Sleep(int64_t milliSecond);
     static int64_t ThreadTime();
+    static int64_t SteadyTime();
     static int64_t MilliUnixtime();
 
+    //NUMA helpers, -1 or false when unknown.
+    static int CurrentCpu();
+    static int CpuNode(int cpu);
+    static bool NodeCpus(int node, std::vector<int>& vectCpu);
+    //Pin thread pid to the NUMA node of cpu.
+    static bool Colocate(int pid, int cpu);
+
     //Use with care
     bool hasMsg();
     inline void setCustom(void* custom) { custom_ = custom; }
@@ -172,57 +377,75 @@ private:
     pthread_mutex_t mutex_;
     void (*cb_)(const Msg&);
     OpenThreadPool* pool_;
+    OpenThreadGroup* group_;
+    //set while the actor is queued in or running on its group.
+    std::atomic<bool> scheduled_;
+    bool needStart_;
 
     bool profile_;
     size_t totalCount_;
     size_t leftCount_;
     int64_t cpuCost_;
     int64_t cpuStart_;
+    int64_t spinCost_;
+    int64_t yieldCost_;
+    int64_t parkCost_;
+    size_t parkCount_;
+    std::atomic<int> spinUs_;
+    std::atomic<int> yieldUs_;
+    std::vector<int> vectCpu_;
 private:
     struct Node
     {
-        unsigned int id_;
         Msg msg_;
-        Node* next_;
-        Node():id_(0), next_(0){}
-    };
-    class SpinLock
-    {
-    private:
-        SpinLock(const SpinLock&) {};
-        void operator=(const SpinLock) {};
-    public:
-        SpinLock() {};
-        void lock() { while (flag_.test_and_set(std::memory_order_acquire)); }
-        void unlock() { flag_.clear(std::memory_order_release); }
-    private:
-        std::atomic_flag flag_;
+        std::atomic<Node*> next_;
+        Node():next_(0){}
     };
-    class SafeQueue
+    //Intrusive MPSC queue. Producers only touch head_, the owner thread only touches tail_.
+    class Mailbox
     {
-        Node head_;
+        std::atomic<Node*> head_;
+        char pad_[64];
         Node* tail_;
-        SpinLock spinLock_;
-        unsigned int writeId_;
-        unsigned int readId_;
-        std::vector<Node*> vectCache_;
+        Node stub_;
+        size_t popCount_;
+        size_t capacity_;
+        std::atomic<size_t> size_;
+        Mailbox(const Mailbox&);
+        void operator=(const Mailbox&) {}
+        void link(Node* node);
     public:
-        SafeQueue();
-        ~SafeQueue();
+        Mailbox();
+        ~Mailbox();
         void clear();
-        void popAll();
-        void popAll(std::queue<Node*>& queueCache);
-        void push(Node* node);
-        bool empty() { return !head_.next_; }
+        bool push(Node* node, bool force = false);
+        Node* pop();
+        bool empty();
+        inline size_t size() { return size_.load(std::memory_order_relaxed) - popCount_; }
+        inline size_t capacity() { return capacity_; }
+        inline void setCapacity(size_t capacity) { capacity_ = capacity; }
     };
-    unsigned int readId_;
-    SafeQueue queue_;
+    Mailbox queue_;
+    //1 while the owner is parked. int-sized so it can be a futex word on Linux.
+    std::atomic<int> parked_;
 
     Node* popNode();
-    std::queue<Node*> queueCache_;
+    bool dispatch(Node* node);
+    void call(Msg& msg);
+    void callTraced(Msg& msg);
+    void finish();
+    void abandon();
+    bool runGroup(size_t budget);
+    void join();
+    void idle();
+    void park();
+    void wakeup();
+    static Node* NewNode();
+    static void DeleteNode(Node* node);
 private:
     static OpenThreadPool DefaultPool_;
     friend class OpenThreadPool;
+    friend class OpenThreadGroup;
  public:
      static inline bool Send(const std::initializer_list<int>& list, const std::shared_ptr<void>& data) 
      { std::vector<int> v = list;return Send(v, data); }
@@ -298,6 +521,76 @@ private:
     pthread_mutex_t mutex_close_;
 };
 
+////////////OpenThreadGroup//////////////////////
+//M OpenThread actors multiplexed over N pthreads with work stealing.
+//An actor runs on one pthread at a time, so its messages keep their order.
+//Stop the actors before the group: the group's stop() drops the messages of
+//the actors still queued, runs only their STOP and stops them.
+class OpenThreadGroup
+{
+    //Chase-Lev deque. The owner pushes and pops at the bottom, thieves take from the top.
+    class Deque
+    {
+        enum { ECapacity = 1024 };
+        std::atomic<int64_t> top_;
+        char pad_[64];
+        std::atomic<int64_t> bottom_;
+        std::atomic<OpenThread*> buffer_[ECapacity];
+        Deque(const Deque&);
+        void operator=(const Deque&) {}
+    public:
+        Deque();
+        bool push(OpenThread* actor);
+        OpenThread* pop();
+        OpenThread* steal();
+        inline bool empty() { return bottom_.load() <= top_.load(); }
+    };
+    struct Worker
+    {
+        size_t index_;
+        pthread_t threadId_;
+        OpenThreadGroup* group_;
+        Deque deque_;
+    };
+public:
+    OpenThreadGroup();
+    ~OpenThreadGroup();
+    bool start(size_t threadNum, const std::string& name = "group");
+    void stop();
+    inline size_t size() { return vectWorker_.size(); }
+    inline bool isRunning() { return isRunning_; }
+    //messages an actor may handle before it goes to the back of the line.
+    inline void setBudget(size_t budget) { budget_ = budget > 0 ? budget : 1; }
+    //Pin every pthread of the group, see OpenThread::setAffinity.
+    bool setAffinity(const std::vector<int>& vectCpu);
+
+private:
+    void schedule(OpenThread* actor);
+    void inject(OpenThread* actor);
+    OpenThread* find(Worker* worker);
+    bool hasWork();
+    void sleep();
+    void notify();
+    void run(Worker* worker);
+    static void* Run(void* arg);
+    OpenThreadGroup(const OpenThreadGroup&);
+    void operator=(const OpenThreadGroup&) {}
+
+    std::string name_;
+    size_t budget_;
+    volatile bool isRunning_;
+    std::vector<int> vectCpu_;
+    std::vector<Worker*> vectWorker_;
+    std::deque<OpenThread*> injectQueue_;
+    std::atomic<size_t> injectSize_;
+    std::atomic<int> sleepers_;
+    pthread_mutex_t mutex_;
+    pthread_mutex_t sleepMutex_;
+    pthread_cond_t cond_;
+    static thread_local Worker* Current_;
+    friend class OpenThread;
+};
+
 ////////////OpenThreadRef//////////////////////
 class OpenThreadRef
 {
@@ -310,7 +603,7 @@ public:
     bool operator==(const OpenThreadRef& that) { return thread_ == that.thread_; }
     bool operator==(const std::shared_ptr<OpenThread>& that) { return thread_ == that; }
     inline void waitIdle() { if (thread_) thread_->waitIdle(); }
-    bool start(void (*cb)(OpenThreadMsg&));
+    bool start(void (*cb)(OpenThreadMsg&), OpenThreadGroup* group = 0);
     bool stop();
     bool send(const std::shared_ptr<void>& data);
     bool waitStop(int64_t milliSecond = 1);
@@ -331,6 +624,8 @@ public:
     OpenThreader(const std::string& name) :name_(name), pid_(-1) {}
     virtual ~OpenThreader(){ stop(); }
     virtual bool start();
+    //run as an actor of group instead of on a dedicated pthread.
+    bool start(OpenThreadGroup& group);
     virtual void stop();
     virtual void onStart() { }
     virtual void onMsg(OpenThreadMsg& msg) { }
@@ -344,6 +639,8 @@ protected:
     int pid_;
     const std::string name_;
     std::shared_ptr<OpenThread> thread_;
+private:
+    bool startThread(OpenThreadGroup* group);
 };
 
 ////////////OpenThreadProto//////////////////////
@@ -351,23 +648,67 @@ struct OpenThreadProto
 {
     int srcPid_;
     std::string srcName_;
+    //dense id from OpenThreadTypeId, 0 for protos that only have protoType().
+    int typeId_;
 
-    OpenThreadProto() :srcPid_(-1) {}
+    OpenThreadProto() :srcPid_(-1), typeId_(0) {}
     int srcPid() { return srcPid_; }
-    const std::string& srcName() { return srcName_; }
     int srcPid() const { return srcPid_; }
-    const std::string& srcName() const { return srcName_; }
+    //the sender's name is looked up on demand, srcName_ only overrides it.
+    const std::string& srcName() const
+    {
+        if (!srcName_.empty() || srcPid_ < 0) return srcName_;
+        return OpenThread::ThreadName(srcPid_);
+    }
 
     static inline int ProtoType() { return -1; }
     //implement
     virtual inline int protoType() const { assert(false); return OpenThreadProto::ProtoType(); }
 };
 
+////////////OpenThreadTypeId//////////////////////
+//Hands out dense ids 1,2,3... one per type, on first use.
+class OpenThreadTypeId
+{
+    static int Next();
+public:
+    template <class T>
+    static int Id()
+    {
+        static const int id = Next();
+        return id;
+    }
+};
+
+//Derive as struct MyProto : public OpenThreadTypedProto<MyProto> to be
+//dispatched by OpenThreadWorker's jump table instead of protoType().
+template <class T>
+struct OpenThreadTypedProto : public OpenThreadProto
+{
+    OpenThreadTypedProto() { typeId_ = OpenThreadTypeId::Id<T>(); }
+};
+
 ////////////OpenThreadWorker//////////////////////
 class OpenThreadWorker;
 typedef void(OpenThreadWorker::*OpenThreadHandle)(const OpenThreadProto&);
 class OpenThreadWorker : public OpenThreader
 {
+    //A typed handler: call_ is the TypedCall<W, T> of its registers(), handle_
+    //holds the member pointer it was given.
+    typedef void (*TypedCallFn)(OpenThreadWorker& worker, const OpenThreadProto& proto, const void* handle);
+    struct TypedHandle
+    {
+        TypedCallFn call_;
+        std::shared_ptr<void> handle_;
+        TypedHandle() :call_(0) {}
+    };
+    //static_cast both ways, so W and T get their own this/base adjustment.
+    template <class W, class T>
+    static void TypedCall(OpenThreadWorker& worker, const OpenThreadProto& proto, const void* handle)
+    {
+        void (W::*member)(const T&) = *static_cast<void (W::* const*)(const T&)>(handle);
+        (static_cast<W&>(worker).*member)(static_cast<const T&>(proto));
+    }
 public:
     OpenThreadWorker(const std::string& name)
         :OpenThreader(name) {}
@@ -387,6 +728,25 @@ public:
         }
         mapHandle_[protoId] = handle;
     }
+    //registers(&MyWorker::onMyProto), T must derive from OpenThreadTypedProto<T>.
+    template <class W, class T>
+    void registers(void (W::*handle)(const T&))
+    {
+        static_assert(std::is_base_of<OpenThreadTypedProto<T>, T>::value,
+            "registers<W, T>: T must derive from OpenThreadTypedProto<T>");
+        static_assert(std::is_base_of<OpenThreadWorker, W>::value,
+            "registers<W, T>: W must derive from OpenThreadWorker");
+        size_t id = (size_t)OpenThreadTypeId::Id<T>();
+        if (id >= vectHandle_.size()) vectHandle_.resize(id + 1);
+        if (vectHandle_[id].call_)
+        {
+            assert(false);
+            return;
+        }
+        typedef void (W::*Member)(const T&);
+        vectHandle_[id].call_ = &OpenThreadWorker::TypedCall<W, T>;
+        vectHandle_[id].handle_ = std::make_shared<Member>(handle);
+    }
 protected:
     bool canLoop()
     {
@@ -395,6 +755,8 @@ protected:
     }
     virtual void onMsg(OpenThreadMsg& msg);
     
+    //indexed by typeId_, typed handlers.
+    std::vector<TypedHandle> vectHandle_;
     std::map<int, OpenThreadHandle> mapHandle_;
 };
 
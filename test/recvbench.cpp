@@ -0,0 +1,149 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <vector>
+#include <unistd.h>
+#include "opensocket.h"
+#include "open/openthread.h"
+#include "socketdispatch.h"
+#include "bench.h"
+using namespace open;
+
+// Receive path with reads that alternate small and large: a malloc per read
+// against EOptionRecvChunk slices. Counts the mallocs of the socket thread (glibc).
+// ./recvbench [rounds] [small] [large]
+
+static std::atomic<size_t> Mallocs_(0);
+static __thread bool SocketThread_ = false;
+#ifdef __GLIBC__
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* malloc(size_t size)
+{
+    if (SocketThread_) ++Mallocs_;
+    return __libc_malloc(size);
+}
+#endif
+
+static void Dispatch(OpenSocketMsg& msg)
+{
+    SocketThread_ = true;
+    OpenSocketDispatch::Dispatch(msg);
+}
+
+static int Rounds_ = 5000;
+static int Small_ = 64;
+static int Large_ = 64 * 1024;
+static OpenSocket* Socket_ = 0;
+static int ChunkSize_ = 0;
+static std::atomic<int> Reads_(0);
+static int Expect_ = 0;
+static int Received_ = 0;
+
+//acks one byte once the whole message of the round is in.
+static void Receiver(OpenThreadMsg& msg)
+{
+    if (msg.state_ != OpenThread::RUN) return;
+    const SocketProto* proto = msg.data<SocketProto>();
+    if (!proto) return;
+    const OpenSocketMsg& socketMsg = proto->data_;
+    switch (socketMsg.type_)
+    {
+    case OpenSocket::ESocketAccept:
+        if (ChunkSize_ > 0) Socket_->setOption(socketMsg.ud_, OpenSocket::EOptionRecvChunk, ChunkSize_);
+        Socket_->start((uintptr_t)msg.pid(), socketMsg.ud_);
+        break;
+    case OpenSocket::ESocketData:
+        ++Reads_;
+        Received_ += (int)socketMsg.size();
+        if (Received_ >= Expect_)
+        {
+            Received_ -= Expect_;
+            Expect_ = Expect_ == Small_ ? Large_ : Small_;
+            Socket_->send(socketMsg.fd_, "k", 1);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static bool WriteAll(int fd, const char* buffer, int size)
+{
+    while (size > 0)
+    {
+        int n = (int)write(fd, buffer, size);
+        if (n <= 0) return false;
+        buffer += n;
+        size -= n;
+    }
+    return true;
+}
+
+static void Bench(int chunkSize, int port)
+{
+    OpenSocket openSocket;
+    Socket_ = &openSocket;
+    ChunkSize_ = chunkSize;
+    Expect_ = Small_;
+    Received_ = 0;
+    openSocket.run(Dispatch);
+    OpenThreadRef receiver = OpenThread::Create(chunkSize > 0 ? "chunkrecv" : "mallocrecv", Receiver);
+    int listenFd = openSocket.listen((uintptr_t)receiver.pid(), "127.0.0.1", port, 64);
+    if (listenFd < 0)
+    {
+        printf("listen 127.0.0.1:%d faild\n", port);
+        return;
+    }
+    openSocket.start((uintptr_t)receiver.pid(), listenFd);
+    OpenThread::Sleep(100);
+    int fd = BenchConnect("127.0.0.1", port, true);
+    if (fd < 0)
+    {
+        printf("connect 127.0.0.1:%d faild\n", port);
+        return;
+    }
+    OpenThread::Sleep(100);
+
+    std::vector<char> buffer(Large_, 'r');
+    char ack = 0;
+    Reads_ = 0;
+    size_t mallocs = Mallocs_;
+    int64_t start = BenchClock::NowNs();
+    int rounds = 0;
+    for (; rounds < Rounds_; ++rounds)
+    {
+        int size = (rounds & 1) ? Large_ : Small_;
+        if (!WriteAll(fd, buffer.data(), size)) break;
+        if (read(fd, &ack, 1) != 1) break;
+    }
+    int64_t cost = BenchClock::NowNs() - start;
+    mallocs = Mallocs_ - mallocs;
+    int reads = Reads_;
+    printf("recv %-6s chunk=%-6d rounds=%d reads=%d  %5.2f mallocs/read  %8.1f ns/round\n",
+        chunkSize > 0 ? "chunk" : "malloc", chunkSize, rounds, reads,
+        reads ? (double)mallocs / reads : 0.0, rounds ? (double)cost / rounds : 0.0);
+
+    ::close(fd);
+    openSocket.close((uintptr_t)receiver.pid(), listenFd);
+    OpenThread::Sleep(100);
+    receiver.stop();
+    Socket_ = 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) Rounds_ = atoi(argv[1]);
+    if (argc > 2) Small_ = atoi(argv[2]);
+    if (argc > 3) Large_ = atoi(argv[3]);
+    if (Rounds_ <= 0) Rounds_ = 5000;
+    if (Small_ <= 0) Small_ = 64;
+    if (Large_ <= Small_) Large_ = Small_ * 1024;
+
+    Bench(0, 18099);
+    Bench(256 * 1024, 18100);
+
+    OpenThread::StopAll();
+    return 0;
+}
@@ -5,6 +5,7 @@
 #include <string.h>
 #include "opensocket.h"
 #include "open/openthread.h"
+#include "socketdispatch.h"
 using namespace open;
 
 const std::string TestServerIp_ = "0.0.0.0";
@@ -12,13 +13,6 @@ const std::string TestClientIp_ = "127.0.0.1";
 const int TestServerPort_ = 8888;
 
 //proto
-struct SocketProto : public OpenThreadProto
-{
-    std::shared_ptr<OpenSocketMsg> data_;
-    static inline int ProtoType() { return 1; }
-    virtual inline int protoType() const { return SocketProto::ProtoType(); }
-};
-
 
 class ProtoBuffer : public OpenThreadProto
 {
@@ -64,24 +58,9 @@ public:
 ////////////App//////////////////////
 class App
 {
-    static void SocketFunc(const OpenSocketMsg* msg)
-    {
-        if (!msg) return;
-        if (msg->uid_ >= 0)
-        {
-            auto proto = std::shared_ptr<SocketProto>(new SocketProto);
-            proto->srcPid_ = -1;
-            proto->srcName_ = "OpenSocket";
-            proto->data_ = std::shared_ptr<OpenSocketMsg>((OpenSocketMsg*)msg);
-            if (!OpenThread::Send((int)msg->uid_, proto))
-                printf("SocketFunc dispatch faild pid = %d\n", (int)msg->uid_);
-            return;
-        }
-        delete msg;
-    }
 public:
     static App Instance_;
-    App() { OpenSocket::Start(App::SocketFunc); }
+    App() { OpenSocketDispatch::Start(); }
 };
 App App::Instance_;
 
@@ -169,7 +148,7 @@ private:
     }
     virtual void onSocketProto(const SocketProto& proto)
     {
-        const auto msg = proto.data_;
+        const OpenSocketMsg* msg = &proto.data_;
         switch (msg->type_)
         {
         case OpenSocket::ESocketAccept:
@@ -259,7 +238,7 @@ private:
         }
     }
 
-    void onRead(const std::shared_ptr<OpenSocketMsg>& msg)
+    void onRead(const OpenSocketMsg* msg)
     {
         auto iter = mapClient_.find(msg->fd_);
         if (iter == mapClient_.end())
@@ -280,7 +259,7 @@ private:
 
     virtual void onSocketProto(const SocketProto& proto)
     {
-        const auto msg = proto.data_;
+        const OpenSocketMsg* msg = &proto.data_;
         switch (msg->type_)
         {
         case OpenSocket::ESocketData:
@@ -364,7 +343,7 @@ private:
             }
         }
     }
-    void onRead(const std::shared_ptr<OpenSocketMsg>& msg)
+    void onRead(const OpenSocketMsg* msg)
     {
         auto iter = mapUser_.find(msg->fd_);
         if (iter == mapUser_.end())
@@ -382,7 +361,7 @@ private:
     }
     virtual void onSocketProto(const SocketProto& proto)
     {
-        const auto msg = proto.data_;
+        const OpenSocketMsg* msg = &proto.data_;
         switch (msg->type_)
         {
         case OpenSocket::ESocketData:
@@ -0,0 +1,49 @@
+#ifndef SOCKET_DISPATCH_HEADER_H
+#define SOCKET_DISPATCH_HEADER_H
+
+#include <stdio.h>
+#include "opensocket.h"
+#include "open/openthread.h"
+
+namespace open
+{
+
+////////////SocketProto//////////////////////
+//Carries the socket message inline. Proto, message and shared_ptr control block
+//come out of a single OpenBlockPool block. Register it either way,
+//registers(&W::onSocketProto) or registers(SocketProto::ProtoType(), ...).
+struct SocketProto : public OpenThreadTypedProto<SocketProto>
+{
+    OpenSocketMsg data_;
+    static inline int ProtoType() { return 1; }
+    virtual inline int protoType() const { return SocketProto::ProtoType(); }
+};
+
+////////////OpenSocketDispatch//////////////////////
+//Forwards every socket message to the OpenThread whose pid is the socket's uid.
+class OpenSocketDispatch
+{
+public:
+    static void Dispatch(OpenSocketMsg& msg)
+    {
+        int pid = (int)msg.uid_;
+        if (pid < 0) return;
+        std::shared_ptr<SocketProto> proto = OpenThread::MakePooled<SocketProto>();
+        proto->data_.swap(msg);
+        if (proto->data_.ready_)
+        {
+            OpenTrace::Record(OpenTrace::EReady, proto->data_.forward_ - proto->data_.ready_);
+            OpenTrace::Record(OpenTrace::EForward, OpenTrace::Now() - proto->data_.forward_);
+        }
+        if (!OpenThread::Send(pid, proto))
+            printf("OpenSocketDispatch faild pid = %d\n", pid);
+    }
+    static inline void Start() { OpenSocket::Start(OpenSocketDispatch::Dispatch); }
+    static inline bool Run(OpenSocket& openSocket) { return openSocket.run(OpenSocketDispatch::Dispatch); }
+    //socket stamps and OpenThread stamps together, read with OpenTrace::Summarize.
+    static inline void Trace(OpenSocket& openSocket, bool on) { openSocket.setTrace(on); OpenTrace::SetOn(on); }
+};
+
+};
+
+#endif //SOCKET_DISPATCH_HEADER_H
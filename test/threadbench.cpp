@@ -0,0 +1,461 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <queue>
+#include <vector>
+#include "open/openthread.h"
+#include "bench.h"
+using namespace open;
+
+// Mailbox benchmark: OpenThread against the spinlock queue it used to have.
+// ./threadbench [rounds] [producers] [pairs]
+
+////////////LegacyThread//////////////////////
+// The previous OpenThread mailbox: new Node per message, SpinLock push,
+// unconditional pthread_cond_signal, popAll into a std::queue.
+// The wait is timed because the old signal could be lost between the empty
+// check and pthread_cond_wait.
+class LegacyThread
+{
+    struct Node
+    {
+        std::shared_ptr<void> data_;
+        Node* next_;
+        Node() :next_(0) {}
+    };
+    class SpinLock
+    {
+        std::atomic_flag flag_;
+    public:
+        SpinLock() { flag_.clear(); }
+        void lock() { while (flag_.test_and_set(std::memory_order_acquire)); }
+        void unlock() { flag_.clear(std::memory_order_release); }
+    };
+    Node head_;
+    Node* tail_;
+    SpinLock spinLock_;
+    std::queue<Node*> queueCache_;
+    pthread_t thread_;
+    pthread_cond_t cond_;
+    pthread_mutex_t mutex_;
+    volatile bool isRunning_;
+    void (*cb_)(LegacyThread&, const std::shared_ptr<void>&);
+
+    void popAll()
+    {
+        spinLock_.lock();
+        Node* node = head_.next_;
+        head_.next_ = 0;
+        tail_ = &head_;
+        spinLock_.unlock();
+        while (node)
+        {
+            queueCache_.push(node);
+            node = node->next_;
+        }
+    }
+    static void* Run(void* arg)
+    {
+        LegacyThread* that = (LegacyThread*)arg;
+        while (that->isRunning_)
+        {
+            that->popAll();
+            while (!that->queueCache_.empty())
+            {
+                Node* node = that->queueCache_.front();
+                that->queueCache_.pop();
+                that->cb_(*that, node->data_);
+                delete node;
+            }
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 1000000;
+            if (ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
+            pthread_mutex_lock(&that->mutex_);
+            if (!that->head_.next_) pthread_cond_timedwait(&that->cond_, &that->mutex_, &ts);
+            pthread_mutex_unlock(&that->mutex_);
+        }
+        return 0;
+    }
+public:
+    LegacyThread(void (*cb)(LegacyThread&, const std::shared_ptr<void>&))
+        :tail_(&head_), isRunning_(true), cb_(cb)
+    {
+        pthread_mutex_init(&mutex_, NULL);
+        pthread_cond_init(&cond_, NULL);
+        pthread_create(&thread_, NULL, LegacyThread::Run, this);
+    }
+    ~LegacyThread()
+    {
+        isRunning_ = false;
+        pthread_cond_signal(&cond_);
+        pthread_join(thread_, NULL);
+        pthread_mutex_destroy(&mutex_);
+        pthread_cond_destroy(&cond_);
+    }
+    bool send(const std::shared_ptr<void>& data)
+    {
+        Node* node = new Node;
+        node->data_ = data;
+        spinLock_.lock();
+        tail_->next_ = node;
+        tail_ = node;
+        spinLock_.unlock();
+        pthread_cond_signal(&cond_);
+        return true;
+    }
+};
+
+////////////PingPong//////////////////////
+struct Ball
+{
+    int count_;
+};
+static int Rounds_ = 100000;
+static std::atomic<int> Done_(0);
+static int64_t StartNs_ = 0;
+
+static LegacyThread* LegacyPing_ = 0;
+static LegacyThread* LegacyPong_ = 0;
+static void LegacyPingPong(LegacyThread& self, const std::shared_ptr<void>& data)
+{
+    Ball* ball = (Ball*)data.get();
+    if (&self == LegacyPong_)
+    {
+        LegacyPing_->send(data);
+        return;
+    }
+    if (++ball->count_ >= Rounds_)
+    {
+        Done_ = 1;
+        return;
+    }
+    LegacyPong_->send(data);
+}
+
+static OpenThreadRef Ping_;
+static OpenThreadRef Pong_;
+static std::shared_ptr<void> Ball_;
+static void OpenPingPong(OpenThreadMsg& msg)
+{
+    if (msg.state_ != OpenThread::RUN) return;
+    Ball* ball = msg.edit<Ball>();
+    if (msg.pid() == Pong_.pid())
+    {
+        Ping_.send(Ball_);
+        return;
+    }
+    if (++ball->count_ >= Rounds_)
+    {
+        Done_ = 1;
+        return;
+    }
+    Pong_.send(Ball_);
+}
+
+static void WaitDone()
+{
+    while (!Done_) OpenThread::Sleep(1);
+}
+
+static void BenchPingPong()
+{
+    Ball_ = std::shared_ptr<Ball>(new Ball);
+    ((Ball*)Ball_.get())->count_ = 0;
+    Done_ = 0;
+    LegacyPing_ = new LegacyThread(LegacyPingPong);
+    LegacyPong_ = new LegacyThread(LegacyPingPong);
+    StartNs_ = BenchClock::NowNs();
+    LegacyPong_->send(Ball_);
+    WaitDone();
+    int64_t cost = BenchClock::NowNs() - StartNs_;
+    printf("pingpong legacy   rounds=%d  %8.1f ns/round\n", Rounds_, (double)cost / Rounds_);
+    delete LegacyPing_;
+    delete LegacyPong_;
+}
+
+//spinUs/yieldUs pick the OpenThread idle strategy of both ends.
+static void BenchIdleStrategy(int spinUs, int yieldUs)
+{
+    static int Index_ = 0;
+    char name[64] = {0};
+    ((Ball*)Ball_.get())->count_ = 0;
+    Done_ = 0;
+    snprintf(name, sizeof(name), "ping%d", Index_);
+    Ping_ = OpenThread::Create(name);
+    snprintf(name, sizeof(name), "pong%d", Index_++);
+    Pong_ = OpenThread::Create(name);
+    std::shared_ptr<OpenThread> ping = OpenThread::GetThread(Ping_);
+    std::shared_ptr<OpenThread> pong = OpenThread::GetThread(Pong_);
+    ping->setIdleStrategy(spinUs, yieldUs);
+    pong->setIdleStrategy(spinUs, yieldUs);
+    ping->setProfile(true);
+    pong->setProfile(true);
+    ping->start(OpenPingPong);
+    pong->start(OpenPingPong);
+
+    StartNs_ = BenchClock::NowNs();
+    Pong_.send(Ball_);
+    WaitDone();
+    int64_t cost = BenchClock::NowNs() - StartNs_;
+    printf("pingpong mailbox  rounds=%d spin=%dus yield=%dus  %8.1f ns/round"
+        "  idle(us) spin=%lld yield=%lld park=%lld parks=%zu\n",
+        Rounds_, spinUs, yieldUs, (double)cost / Rounds_,
+        (long long)(ping->spinCost() + pong->spinCost()),
+        (long long)(ping->yieldCost() + pong->yieldCost()),
+        (long long)(ping->parkCost() + pong->parkCost()),
+        ping->parkCount() + pong->parkCount());
+    Ping_.stop();
+    Pong_.stop();
+}
+
+////////////FanIn//////////////////////
+static int Producers_ = 4;
+static std::atomic<int> Received_(0);
+
+static void LegacyFanIn(LegacyThread& self, const std::shared_ptr<void>& data)
+{
+    if (++Received_ == Rounds_ * Producers_) Done_ = 1;
+}
+
+static void OpenFanIn(OpenThreadMsg& msg)
+{
+    if (msg.state_ != OpenThread::RUN) return;
+    if (++Received_ == Rounds_ * Producers_) Done_ = 1;
+}
+
+static LegacyThread* LegacySink_ = 0;
+static OpenThreadRef Sink_;
+static void* LegacyProducer(void*)
+{
+    for (int i = 0; i < Rounds_; ++i) LegacySink_->send(Ball_);
+    return 0;
+}
+static void* OpenProducer(void*)
+{
+    for (int i = 0; i < Rounds_; ++i) Sink_.send(Ball_);
+    return 0;
+}
+
+static int64_t RunProducers(void* (*producer)(void*))
+{
+    std::vector<pthread_t> vectThread(Producers_);
+    int64_t start = BenchClock::NowNs();
+    for (int i = 0; i < Producers_; ++i) pthread_create(&vectThread[i], NULL, producer, NULL);
+    for (int i = 0; i < Producers_; ++i) pthread_join(vectThread[i], NULL);
+    WaitDone();
+    return BenchClock::NowNs() - start;
+}
+
+static void BenchFanIn()
+{
+    int total = Rounds_ * Producers_;
+    Received_ = 0;
+    Done_ = 0;
+    LegacySink_ = new LegacyThread(LegacyFanIn);
+    int64_t cost = RunProducers(LegacyProducer);
+    printf("fanin    legacy   producers=%d msgs=%d  %8.1f ns/msg\n", Producers_, total, (double)cost / total);
+    delete LegacySink_;
+
+    Received_ = 0;
+    Done_ = 0;
+    Sink_ = OpenThread::Create("sink", OpenFanIn);
+    cost = RunProducers(OpenProducer);
+    printf("fanin    mailbox  producers=%d msgs=%d  %8.1f ns/msg\n", Producers_, total, (double)cost / total);
+}
+
+////////////Group//////////////////////
+struct PairBall
+{
+    int count_;
+    int index_;
+    int ping_;
+    int pong_;
+};
+static int Pairs_ = 8;
+static std::atomic<int> PairDone_(0);
+static std::vector<std::shared_ptr<void>> VectBall_;
+
+static void PairPingPong(OpenThreadMsg& msg)
+{
+    if (msg.state_ != OpenThread::RUN) return;
+    PairBall* ball = msg.edit<PairBall>();
+    const std::shared_ptr<void>& data = VectBall_[ball->index_];
+    if (msg.pid() == ball->pong_)
+    {
+        OpenThread::Send(ball->ping_, data);
+        return;
+    }
+    if (++ball->count_ >= Rounds_ / Pairs_)
+    {
+        if (++PairDone_ == Pairs_) Done_ = 1;
+        return;
+    }
+    OpenThread::Send(ball->pong_, data);
+}
+
+//Pairs_ ping-pong pairs, each actor on its own pthread (threadNum 0) or all on one group.
+static void BenchGroup(int threadNum)
+{
+    static int Index_ = 0;
+    OpenThreadGroup group;
+    if (threadNum > 0) group.start(threadNum, "bench");
+    char name[64] = {0};
+    std::vector<OpenThreadRef> vectRef;
+    VectBall_.clear();
+    for (int i = 0; i < Pairs_; ++i)
+    {
+        std::shared_ptr<PairBall> ball(new PairBall);
+        ball->count_ = 0;
+        ball->index_ = i;
+        snprintf(name, sizeof(name), "pair%d_ping%d", Index_, i);
+        OpenThreadRef ping = OpenThread::Create(name);
+        snprintf(name, sizeof(name), "pair%d_pong%d", Index_, i);
+        OpenThreadRef pong = OpenThread::Create(name);
+        ball->ping_ = ping.pid();
+        ball->pong_ = pong.pid();
+        ping.start(PairPingPong, threadNum > 0 ? &group : 0);
+        pong.start(PairPingPong, threadNum > 0 ? &group : 0);
+        vectRef.push_back(ping);
+        vectRef.push_back(pong);
+        VectBall_.push_back(ball);
+    }
+    ++Index_;
+    PairDone_ = 0;
+    Done_ = 0;
+    int rounds = Rounds_ / Pairs_ * Pairs_;
+    StartNs_ = BenchClock::NowNs();
+    for (int i = 0; i < Pairs_; ++i)
+    {
+        OpenThread::Send(((PairBall*)VectBall_[i].get())->pong_, VectBall_[i]);
+    }
+    WaitDone();
+    int64_t cost = BenchClock::NowNs() - StartNs_;
+    printf("pairs    %-8s pairs=%d threads=%d rounds=%d  %8.1f ns/round  %.0f msgs/s\n",
+        threadNum > 0 ? "group" : "pthread", Pairs_, threadNum > 0 ? threadNum : Pairs_ * 2, rounds,
+        (double)cost / rounds, 2.0 * rounds * 1e9 / cost);
+    for (size_t i = 0; i < vectRef.size(); ++i) vectRef[i].stop();
+    for (size_t i = 0; i < vectRef.size(); ++i) vectRef[i].waitStop();
+}
+
+////////////WorkerDispatch//////////////////////
+//OpenThreadWorker handler lookup alone, protoType() + std::map against the
+//typed jump table: one message is dispatched Rounds_ times on the worker.
+struct MapProto : public OpenThreadProto
+{
+    static inline int ProtoType() { return 1; }
+    virtual inline int protoType() const { return MapProto::ProtoType(); }
+};
+struct TypedProto : public OpenThreadTypedProto<TypedProto>
+{
+};
+class DispatchWorker : public OpenThreadWorker
+{
+    int count_;
+public:
+    int64_t cost_;
+    DispatchWorker(const std::string& name, bool typed)
+        :OpenThreadWorker(name), count_(0), cost_(0)
+    {
+        //a few neighbours so the map is not a single node.
+        for (int i = 2; i < 16; ++i) registers(i, (OpenThreadHandle)&DispatchWorker::onMapProto);
+        if (typed)
+            registers(&DispatchWorker::onTypedProto);
+        else
+            registers(MapProto::ProtoType(), (OpenThreadHandle)&DispatchWorker::onMapProto);
+    }
+    virtual void onMsg(OpenThreadMsg& msg)
+    {
+        int64_t start = BenchClock::NowNs();
+        for (int i = 0; i < Rounds_; ++i) OpenThreadWorker::onMsg(msg);
+        cost_ = BenchClock::NowNs() - start;
+        Done_ = 1;
+    }
+    void onMapProto(const MapProto& proto) { ++count_; }
+    void onTypedProto(const TypedProto& proto) { ++count_; }
+};
+
+static void BenchWorkerDispatch(bool typed)
+{
+    DispatchWorker worker(typed ? "typedworker" : "mapworker", typed);
+    worker.start();
+    std::shared_ptr<void> proto;
+    if (typed)
+        proto = std::shared_ptr<TypedProto>(new TypedProto);
+    else
+        proto = std::shared_ptr<MapProto>(new MapProto);
+    Done_ = 0;
+    OpenThread::Send(worker.pid(), proto);
+    WaitDone();
+    printf("worker   %-8s dispatches=%d  %8.2f ns/dispatch\n", typed ? "typed" : "map", Rounds_, (double)worker.cost_ / Rounds_);
+    worker.stop();
+}
+
+////////////HasMsg//////////////////////
+//hasMsg() from a handler while the rest of a batch is queued: the gate message
+//holds the thread until the three others are all pushed.
+static std::atomic<int> Gate_(0);
+static std::atomic<int> HasMsgErrors_(0);
+static void OpenHasMsg(OpenThreadMsg& msg)
+{
+    if (msg.state_ != OpenThread::RUN) return;
+    Ball* ball = msg.edit<Ball>();
+    if (ball->count_ == 0)
+    {
+        Gate_ = 1;
+        while (Gate_ != 2) OpenThread::Sleep(0);
+    }
+    bool expect = ball->count_ < 3;
+    if (msg.thread().hasMsg() != expect) ++HasMsgErrors_;
+    if (ball->count_ == 3) Done_ = 1;
+}
+
+static bool CheckHasMsg()
+{
+    Done_ = 0;
+    Gate_ = 0;
+    HasMsgErrors_ = 0;
+    OpenThreadRef ref = OpenThread::Create("hasmsg");
+    OpenThread::GetThread(ref)->start(OpenHasMsg);
+    std::shared_ptr<Ball> vectBall[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        vectBall[i] = std::shared_ptr<Ball>(new Ball);
+        vectBall[i]->count_ = i;
+    }
+    ref.send(vectBall[0]);
+    while (Gate_ != 1) OpenThread::Sleep(0);
+    for (int i = 1; i < 4; ++i) ref.send(vectBall[i]);
+    Gate_ = 2;
+    WaitDone();
+    ref.stop();
+    printf("hasmsg   queued batch  %s\n", HasMsgErrors_ ? "FAILED" : "ok");
+    return HasMsgErrors_ == 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) Rounds_ = atoi(argv[1]);
+    if (argc > 2) Producers_ = atoi(argv[2]);
+    if (argc > 3) Pairs_ = atoi(argv[3]);
+    if (Rounds_ <= 0) Rounds_ = 100000;
+    if (Producers_ <= 0) Producers_ = 4;
+    if (Pairs_ <= 0) Pairs_ = 8;
+
+    if (!CheckHasMsg()) return 1;
+    BenchPingPong();
+    BenchIdleStrategy(0, 0);
+    BenchIdleStrategy(0, 50);
+    BenchIdleStrategy(20, 50);
+    BenchFanIn();
+    BenchGroup(0);
+    BenchGroup(2);
+    BenchGroup(4);
+    BenchWorkerDispatch(false);
+    BenchWorkerDispatch(true);
+
+    OpenThread::StopAll();
+    return 0;
+}
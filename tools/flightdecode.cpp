@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "socket_flight.h"
+
+// Prints a flight recorder dump (OpenSocket::dumpFlight, OpenSocket::DumpFlightOnSignal):
+// for each socket server a summary and the slowest iterations, then every iteration whose
+// busy time is at least min_busy_us (all of them with 0, none with -1).
+//   at     ms before the dump
+//   wait   us blocked in sp_wait before the iteration
+//   busy   us from the return of sp_wait to the next one
+//   slow   us of the slowest operation, its op and socket id
+// ./flightdecode dumpfile [min_busy_us] [top]
+
+static const char* OpName(int op)
+{
+    switch (op)
+    {
+    case 0: return "-";
+    case FLIGHT_OP_READ: return "read";
+    case FLIGHT_OP_WRITE: return "write";
+    case FLIGHT_OP_ACCEPT: return "accept";
+    case FLIGHT_OP_CONNECT: return "connect";
+    case FLIGHT_OP_ERROR: return "error";
+    case 'S': return "cmd:start";
+    case 'B': return "cmd:bind";
+    case 'L': return "cmd:listen";
+    case 'K': return "cmd:close";
+    case 'O': return "cmd:open";
+    case 'X': return "cmd:exit";
+    case 'D': return "cmd:send";
+    case 'P': return "cmd:sendlow";
+    case 'A': return "cmd:udpsend";
+    case 'C': return "cmd:udpconnect";
+    case 'T': return "cmd:setopt";
+    case 'U': return "cmd:udp";
+    case 'I': return "cmd:inline";
+    case 'M': return "cmd:broadcast";
+    case 'H': return "cmd:shm";
+    case 'F': return "cmd:sendfd";
+    default: return "cmd:?";
+    }
+}
+
+static void PrintRecord(const flight_record& r, int64_t now)
+{
+    printf("%10.3f %9.1f %9.1f %6u %6u %10llu %9.1f %-14s %8d%s\n",
+        (r.time - now) / 1e6, r.wait / 1e3, r.busy / 1e3, r.events, r.cmds,
+        (unsigned long long)r.bytes, r.slowest / 1e3, OpName(r.slowest_op), r.slowest_id,
+        (r.flags & FLIGHT_PARTIAL) ? "  (in progress)" : "");
+}
+
+static void PrintHead()
+{
+    printf("%10s %9s %9s %6s %6s %10s %9s %-14s %8s\n",
+        "at_ms", "wait_us", "busy_us", "events", "cmds", "bytes", "slow_us", "slow_op", "slow_id");
+}
+
+static bool BusyGreater(const flight_record& a, const flight_record& b)
+{
+    return a.busy > b.busy;
+}
+
+static void PrintServer(const flight_header& header, std::vector<flight_record>& vectRecord,
+    int64_t minBusy, size_t top)
+{
+    int64_t wait = 0;
+    int64_t busy = 0;
+    uint64_t bytes = 0;
+    uint64_t cmds = 0;
+    int overwritten = 0;
+    std::vector<flight_record> vectValid;
+    for (size_t i = 0; i < vectRecord.size(); ++i)
+    {
+        const flight_record& r = vectRecord[i];
+        if (r.flags & FLIGHT_OVERWRITTEN)
+        {
+            ++overwritten;
+            continue;
+        }
+        wait += r.wait;
+        busy += r.busy;
+        bytes += r.bytes;
+        cmds += r.cmds;
+        vectValid.push_back(r);
+    }
+    printf("== server %d: %d iterations", header.server, (int)vectValid.size());
+    if (!vectValid.empty())
+    {
+        printf(" over %.3f ms, busy %.1f%%, %llu cmds, %llu bytes",
+            (vectValid.back().time + vectValid.back().busy - vectValid.front().time) / 1e6,
+            wait + busy > 0 ? busy * 100.0 / (wait + busy) : 0.0,
+            (unsigned long long)cmds, (unsigned long long)bytes);
+    }
+    if (overwritten > 0) printf(", %d overwritten while dumped", overwritten);
+    printf("\n");
+    if (vectValid.empty()) return;
+
+    std::vector<flight_record> vectTop = vectValid;
+    std::sort(vectTop.begin(), vectTop.end(), BusyGreater);
+    if (vectTop.size() > top) vectTop.resize(top);
+    printf("-- %d slowest iterations\n", (int)vectTop.size());
+    PrintHead();
+    for (size_t i = 0; i < vectTop.size(); ++i) PrintRecord(vectTop[i], header.now);
+
+    if (minBusy < 0) return;
+    printf("-- iterations, busy >= %lld us\n", (long long)(minBusy / 1000));
+    PrintHead();
+    for (size_t i = 0; i < vectValid.size(); ++i)
+    {
+        if (vectValid[i].busy >= minBusy) PrintRecord(vectValid[i], header.now);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s dumpfile [min_busy_us] [top]\n", argv[0]);
+        return 1;
+    }
+    int64_t minBusy = argc > 2 ? atoll(argv[2]) * 1000 : 0;
+    size_t top = argc > 3 ? (size_t)atoi(argv[3]) : 10;
+    FILE* file = fopen(argv[1], "rb");
+    if (!file)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    flight_header header;
+    int sections = 0;
+    while (fread(&header, sizeof(header), 1, file) == 1)
+    {
+        if (memcmp(header.magic, FLIGHT_MAGIC, sizeof(header.magic)) != 0 || header.version != FLIGHT_VERSION
+            || header.record_size != sizeof(flight_record))
+        {
+            fprintf(stderr, "%s: not a flight dump of this version\n", argv[1]);
+            fclose(file);
+            return 1;
+        }
+        std::vector<flight_record> vectRecord(header.count);
+        if (header.count > 0 && fread(&vectRecord[0], sizeof(flight_record), header.count, file) != header.count)
+        {
+            fprintf(stderr, "%s: truncated\n", argv[1]);
+            fclose(file);
+            return 1;
+        }
+        PrintServer(header, vectRecord, minBusy, top);
+        ++sections;
+    }
+    fclose(file);
+    if (sections == 0) fprintf(stderr, "%s: empty\n", argv[1]);
+    return sections > 0 ? 0 : 1;
+}